@@ -20,35 +20,62 @@ extern "C" {
  * There are two types of words identified by the most significant bit
  *
  *     Literal word: 0XXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX
- *        Fill word: 1PPPPPLL LLLLLLLL LLLLLLLL LLLLLLLL
+ *        Fill word: 1PPPPPOL LLLLLLLL LLLLLLLL LLLLLLLL
  *
  * X = Uncompressed bits
  * L = represents the length of the span of clean words
+ * O = if set, the span is a run of words with every bit set (a one-fill)
+ *     rather than a run of empty words
  * P = if the word proceeding the span contains only 1 bit, this 5-bit length
- *     stores the position of the bit so that the next literal can be omitted
+ *     stores the position of the bit so that the next literal can be omitted.
+ *     One-fills never carry a position
+ *
+ * The one-fill flag takes the top bit of what used to be the fill length, so
+ * BITSET_MAX_LENGTH is half of what it was in the version 1 encoding, i.e.
+ * 2^25 - 1 words rather than 2^26 - 1. Longer runs are split across fills.
+ *
+ * 64-bit words are supported using -DBITSET_64BIT_WORDS. Literals then carry
+ * 63 bits, the position takes 6 bits and fills can span 2^56 words. The word
+ * size is chosen when the library is built rather than per bitset, so every
+ * operand of an operation has the same word size. Buffers are not
+ * interchangeable between the two word sizes.
  */
 
+#ifndef BITSET_64BIT_WORDS
 typedef                                uint32_t bitset_word;
 #define BITSET_WORD_BYTES              4
+#define BITSET_CLZ(word)               __builtin_clz(word)
+#define BITSET_CTZ(word)               __builtin_ctz(word)
+#else
+typedef                                uint64_t bitset_word;
+#define BITSET_WORD_BYTES              8
+#define BITSET_CLZ(word)               __builtin_clzll(word)
+#define BITSET_CTZ(word)               __builtin_ctzll(word)
+#endif
 
 #define BITSET_WORD_LENGTH             (sizeof(bitset_word) * 8)
 #define BITSET_POSITION_LENGTH         BITSET_LOG2(BITSET_WORD_LENGTH)
-#define BITSET_FILL_BIT                (1 << (BITSET_WORD_LENGTH - 1))
+#define BITSET_FILL_BIT                ((bitset_word)1 << (BITSET_WORD_LENGTH - 1))
 #define BITSET_SPAN_LENGTH             (BITSET_WORD_LENGTH - BITSET_POSITION_LENGTH - 1)
-#define BITSET_POSITION_MASK           (((1 << (BITSET_POSITION_LENGTH)) - 1) << (BITSET_SPAN_LENGTH))
-#define BITSET_LENGTH_MASK             ((1 << (BITSET_SPAN_LENGTH)) - 1)
+#define BITSET_POSITION_MASK           ((((bitset_word)1 << (BITSET_POSITION_LENGTH)) - 1) << (BITSET_SPAN_LENGTH))
+#define BITSET_ONES_BIT                ((bitset_word)1 << (BITSET_SPAN_LENGTH - 1))
+#define BITSET_LENGTH_MASK             (BITSET_ONES_BIT - 1)
 #define BITSET_LITERAL_LENGTH          (BITSET_WORD_LENGTH - 1)
+#define BITSET_ONES_LITERAL            ((bitset_word)~BITSET_FILL_BIT)
 
 #define BITSET_IS_FILL_WORD(word)      ((word) & BITSET_FILL_BIT)
 #define BITSET_IS_LITERAL_WORD(word)   (((word) & BITSET_FILL_BIT) == 0)
+#define BITSET_IS_ONE_FILL(word)       (((word) & (BITSET_FILL_BIT | BITSET_ONES_BIT)) \
+                                           == (BITSET_FILL_BIT | BITSET_ONES_BIT))
 #define BITSET_GET_LENGTH(word)        ((word) & BITSET_LENGTH_MASK)
 #define BITSET_SET_LENGTH(word, len)   ((word) | (len))
 #define BITSET_GET_POSITION(word)      (((word) & BITSET_POSITION_MASK) >> BITSET_SPAN_LENGTH)
-#define BITSET_SET_POSITION(word, pos) ((word) | ((pos) << BITSET_SPAN_LENGTH))
+#define BITSET_SET_POSITION(word, pos) ((word) | ((bitset_word)(pos) << BITSET_SPAN_LENGTH))
 #define BITSET_UNSET_POSITION(word)    ((word) & ~BITSET_POSITION_MASK)
 #define BITSET_CREATE_FILL(len, pos)   BITSET_SET_POSITION(BITSET_FILL_BIT | (len), (pos) + 1)
 #define BITSET_CREATE_EMPTY_FILL(len)  (BITSET_FILL_BIT | (len))
-#define BITSET_CREATE_LITERAL(bit)     ((1 << (BITSET_WORD_LENGTH - 2)) >> (bit))
+#define BITSET_CREATE_ONE_FILL(len)    (BITSET_FILL_BIT | BITSET_ONES_BIT | (len))
+#define BITSET_CREATE_LITERAL(bit)     (((bitset_word)1 << (BITSET_WORD_LENGTH - 2)) >> (bit))
 #define BITSET_MAX_LENGTH              BITSET_LENGTH_MASK
 
 #define BITSET_TMPVAR(i, line)         BITSET_TMPVAR_(i, line)
@@ -68,11 +95,35 @@ typedef                                uint32_t bitset_word;
 #define BITSET_NEXT_POW2(d,s)          d=s;d--;d|=d>>1;d|=d>>2;d|=d>>4;d|=d>>8;d|=d>>16;d++;
 #define BITSET_POP_COUNT(c,w)          w&=P1;w-=(w>>1)&P2;w=(w&P3)+((w>>2)&P3);w=(w+(w>>4))\
                                        &P4;c+=(w*P5)>>(BITSET_WORD_LENGTH-8);
+#ifndef BITSET_64BIT_WORDS
 #define P1 0x7FFFFFFF
 #define P2 0x55555555
 #define P3 0x33333333
 #define P4 0x0F0F0F0F
 #define P5 0x01010101
+#else
+#define P1 0x7FFFFFFFFFFFFFFFULL
+#define P2 0x5555555555555555ULL
+#define P3 0x3333333333333333ULL
+#define P4 0x0F0F0F0F0F0F0F0FULL
+#define P5 0x0101010101010101ULL
+#endif
+
+/**
+ * Buffer encodings. Version 1 buffers predate one-fills, so a version 1 fill
+ * of BITSET_ONES_BIT words or more would be read as a run of ones. Nothing in
+ * a buffer records its encoding, so functions that import a buffer without
+ * taking an encoding reject words that read differently in the two, i.e.
+ * one-fills and long version 1 fills. Buffers with such words have to be
+ * imported with the encoding stated.
+ */
+
+enum bitset_encoding {
+    BITSET_ENCODING_V1 = 1,
+    BITSET_ENCODING_V2 = 2
+};
+
+#define BITSET_ENCODING_CURRENT        BITSET_ENCODING_V2
 
 /**
  * 64-bit offsets are supported using -DBITSET_64BIT_OFFSETS.
@@ -81,18 +132,65 @@ typedef                                uint32_t bitset_word;
 #ifndef BITSET_64BIT_OFFSETS
 typedef uint32_t bitset_offset;
 #define bitset_format "%u"
+#define BITSET_OFFSET_MAX UINT32_MAX
 #else
 typedef uint64_t bitset_offset;
 #define bitset_format "%llu"
+#define BITSET_OFFSET_MAX UINT64_MAX
 #endif
 
 /**
- * Bitset types.
+ * An optional skip index can be attached to a bitset. Every `interval` words
+ * it samples the buffer index of the word, the logical word offset that the
+ * word starts at and the number of bits set before it, so that lookups can
+ * binary search the samples and then scan a handful of words rather than the
+ * whole buffer.
+ */
+
+#define BITSET_INDEX_INTERVAL          64
+
+typedef struct bitset_index_sample_s {
+    size_t word;
+    bitset_offset offset;
+    bitset_offset rank;
+} bitset_index_sample_t;
+
+typedef struct bitset_index_s {
+    bitset_index_sample_t *samples;
+    size_t length;
+    size_t size;
+    unsigned interval;
+} bitset_index_t;
+
+/**
+ * Optional cached metadata. When attached, the population count, the lowest
+ * and highest set bits and the number of logical words spanned by the buffer
+ * are available in constant time. The metadata is kept up to date by
+ * bitset_set_to(), and is attached to bitsets created by bitset_new_bits()
+ * and bitset_operation_exec().
+ */
+
+typedef struct bitset_meta_s {
+    bitset_offset count;
+    bitset_offset min;
+    bitset_offset max;
+    bitset_offset words;
+} bitset_meta_t;
+
+/**
+ * Bitset types. A bitset that borrows its buffer (a view) is read-only and
+ * must be upgraded with bitset_view_own() before it can be mutated. The
+ * version changes whenever the bitset is modified, and is unique to each
+ * bitset, so that cached results can be keyed by their operands.
  */
 
 typedef struct bitset_s {
     bitset_word *buffer;
     size_t length;
+    bitset_index_t *index;
+    bitset_meta_t *meta;
+    bool borrowed;
+    uint64_t version;
 } bitset_t;
 
 typedef struct bitset_iterator_s {
@@ -100,6 +198,17 @@ typedef struct bitset_iterator_s {
     size_t length;
 } bitset_iterator_t;
 
+typedef struct bitset_cursor_s {
+    const bitset_word *buffer;
+    const bitset_word *start;
+    const bitset_word *end;
+    const bitset_index_t *index;
+    bitset_offset next;
+    bitset_offset offset;
+    bitset_offset ones;
+    bitset_word word;
+} bitset_cursor_t;
+
 /**
  * Create a new bitset.
  */
@@ -131,16 +240,60 @@ void bitset_resize(bitset_t *, size_t);
 size_t bitset_length(const bitset_t *);
 
 /**
- * Create a new bitset from an existing buffer.
+ * Create a new bitset from an existing buffer. Returns NULL if the buffer has
+ * a word that reads differently in each encoding, i.e. a one-fill or a long
+ * version 1 fill. Such buffers must be imported with
+ * bitset_new_encoded_buffer().
  */
 
 bitset_t *bitset_new_buffer(const char *, size_t);
 
 /**
- * Create a new bitset from an array of bits.
+ * Create a new bitset from an existing buffer in the specified encoding.
+ * Buffers in an older encoding are converted to the current one. Returns
+ * NULL if the buffer is in the current encoding and has a word that can't
+ * occur in it, i.e. a one-fill that carries a position.
+ */
+
+bitset_t *bitset_new_encoded_buffer(const char *, size_t, enum bitset_encoding);
+
+/**
+ * Create a read-only view of an existing buffer without copying it. The
+ * buffer must be word aligned, its length must be a multiple of the word
+ * size and it must outlive the view. The buffer is checked like it is by
+ * bitset_new_buffer(). Returns NULL if the buffer is invalid or ambiguous.
+ */
+
+bitset_t *bitset_new_view(const char *, size_t);
+
+/**
+ * Create a read-only view of an existing buffer in the specified encoding.
+ * A view can't be converted, so a buffer in an older encoding is only
+ * accepted if it reads the same in the current one.
+ */
+
+bitset_t *bitset_new_encoded_view(const char *, size_t, enum bitset_encoding);
+
+/**
+ * Give a view its own copy of the buffer so that it can be mutated. This is
+ * a no-op if the bitset already owns its buffer.
  */
 
-bitset_t *bitset_new_bits(bitset_offset *, size_t);
+void bitset_view_own(bitset_t *);
+
+/**
+ * Create a new bitset from an array of bits. The array doesn't need to be
+ * sorted and isn't modified.
+ */
+
+bitset_t *bitset_new_bits(const bitset_offset *, size_t);
+
+/**
+ * Create a new bitset from an array of bits in ascending order. Duplicates
+ * are allowed. This skips the sort in bitset_new_bits().
+ */
+
+bitset_t *bitset_new_sorted_bits(const bitset_offset *, size_t);
 
 /**
  * A helper for creating bitsets: BITSET_NEW(b1, 1, 10, 100);
@@ -187,6 +340,44 @@ bool bitset_set(bitset_t *, bitset_offset);
 
 bool bitset_unset(bitset_t *, bitset_offset);
 
+/**
+ * Set or unset many bits in a single pass over the bitset. The array of bits
+ * is sorted in place if it isn't already in ascending order.
+ */
+
+void bitset_set_many_to(bitset_t *, bitset_offset *, size_t, bool);
+
+/**
+ * Set many bits.
+ */
+
+void bitset_set_many(bitset_t *, bitset_offset *, size_t);
+
+/**
+ * Unset many bits.
+ */
+
+void bitset_unset_many(bitset_t *, bitset_offset *, size_t);
+
+/**
+ * Set or unset every bit in the range [start, end). Whole words inside the
+ * range are stored as a single fill.
+ */
+
+void bitset_set_range_to(bitset_t *, bitset_offset, bitset_offset, bool);
+
+/**
+ * Set every bit in the range [start, end).
+ */
+
+void bitset_set_range(bitset_t *, bitset_offset, bitset_offset);
+
+/**
+ * Unset every bit in the range [start, end).
+ */
+
+void bitset_clear_range(bitset_t *, bitset_offset, bitset_offset);
+
 /**
  * Find the lowest set bit in the bitset.
  */
@@ -199,6 +390,51 @@ bitset_offset bitset_min(const bitset_t *);
 
 bitset_offset bitset_max(const bitset_t *);
 
+/**
+ * Count the number of set bits below the specified offset.
+ */
+
+bitset_offset bitset_rank(const bitset_t *, bitset_offset);
+
+/**
+ * Find the Nth (zero-based) set bit. Returns false if there are N or fewer
+ * bits set.
+ */
+
+bool bitset_select(const bitset_t *, bitset_offset, bitset_offset *);
+
+/**
+ * Attach a skip index to the bitset which samples every N words (pass 0 to
+ * use BITSET_INDEX_INTERVAL). The index is kept up to date by bitset_set_to()
+ * and speeds up get, set, rank, select and cursor seeks.
+ */
+
+void bitset_index_build(bitset_t *, unsigned);
+
+/**
+ * Remove the skip index from the bitset.
+ */
+
+void bitset_index_drop(bitset_t *);
+
+/**
+ * Attach cached metadata to the bitset.
+ */
+
+void bitset_meta_build(bitset_t *);
+
+/**
+ * Remove cached metadata from the bitset.
+ */
+
+void bitset_meta_drop(bitset_t *);
+
+/**
+ * Get the number of logical (uncompressed) words spanned by the bitset.
+ */
+
+bitset_offset bitset_words(const bitset_t *);
+
 /**
  * Create a new bitset iterator.
  */
@@ -221,6 +457,62 @@ bitset_iterator_t *bitset_iterator_new(const bitset_t *);
 
 void bitset_iterator_free(bitset_iterator_t *);
 
+/**
+ * Initialise a cursor which decodes set bits lazily. Cursors don't allocate
+ * and can live on the stack. The bitset must not be modified while the
+ * cursor is in use.
+ */
+
+void bitset_cursor_init(bitset_cursor_t *, const bitset_t *);
+
+/**
+ * Get the next set bit. Returns false once the bitset is exhausted.
+ */
+
+bool bitset_cursor_next(bitset_cursor_t *, bitset_offset *);
+
+/**
+ * Advance to the first set bit that's greater than or equal to the specified
+ * offset and return it. The cursor only moves forwards, so an offset behind
+ * the cursor behaves like bitset_cursor_next().
+ */
+
+bool bitset_cursor_seek(bitset_cursor_t *, bitset_offset, bitset_offset *);
+
+/**
+ * Decode up to `capacity` set bits into the offsets array and return the
+ * number of offsets written, or 0 once the bitset is exhausted. Decoding
+ * resumes from the cursor, which must have been initialised with the same
+ * bitset. Pass NULL as the cursor to decode from the start of the bitset.
+ */
+
+size_t bitset_decode(const bitset_t *, bitset_cursor_t *, bitset_offset *, size_t);
+
+/**
+ * Iterate over all bits without materialising them.
+ */
+
+#define BITSET_CURSOR_FOREACH(bitset, offset) \
+    for (bitset_cursor_t BITSET_TMPVAR(c, __LINE__), *BITSET_TMPVAR(p, __LINE__) = \
+            (bitset_cursor_init(&BITSET_TMPVAR(c, __LINE__), bitset), &BITSET_TMPVAR(c, __LINE__)); \
+        bitset_cursor_next(BITSET_TMPVAR(p, __LINE__), &offset);)
+
+/**
+ * Some routines have SIMD kernels which are selected at runtime based on
+ * what the CPU supports. The selection can be capped at a lower level, e.g.
+ * for benchmarking. The level that was selected is returned.
+ */
+
+enum bitset_kernel {
+    BITSET_KERNEL_GENERIC,
+    BITSET_KERNEL_POPCNT,
+    BITSET_KERNEL_AVX2,
+    BITSET_KERNEL_AVX512,
+    BITSET_KERNEL_BEST
+};
+
+enum bitset_kernel bitset_kernel_select(enum bitset_kernel);
+
 /**
  * Custom out of memory behaviour.
  */
@@ -1,6 +1,8 @@
 #ifndef BITSET_OPERATION_H
 #define BITSET_OPERATION_H
 
+#include <stdio.h>
+
 #include "bitset/bitset.h"
 
 #ifdef __cplusplus
@@ -8,19 +10,16 @@ extern "C" {
 #endif
 
 /**
- * Bitset hash types.
+ * Bitset hash types. The hash uses open addressing with linear probing, and
+ * offsets and words are kept in separate arrays so that probing only touches
+ * the offsets. An offset of zero marks an empty slot.
  */
 
-typedef struct bucket_ {
-    bitset_offset offset;
-    bitset_word word;
-    struct bucket_ *next;
-} bitset_hash_bucket_t;
-
 typedef struct hash_ {
-    bitset_hash_bucket_t **buckets;
-    bitset_word *buffer;
+    bitset_offset *offsets;
+    bitset_word *words;
     size_t size;
+    unsigned shift;
     unsigned count;
 } bitset_hash_t;
 
@@ -47,11 +46,37 @@ typedef struct bitset_operation_step_s {
     enum bitset_operation_type type;
 } bitset_operation_step_t;
 
+typedef struct bitset_cache_s bitset_cache_t;
+
 struct bitset_operation_s {
     bitset_operation_step_t **steps;
     size_t length;
+    unsigned threads;
+    bitset_cache_t *cache;
 };
 
+typedef struct bitset_compiled_s bitset_compiled_t;
+
+/**
+ * A sink receives the result of an operation in ascending order, as batches of
+ * decoded offsets, as chunks of compressed words, or both. Either callback can
+ * be NULL. The chunks of words form a canonically compressed buffer when
+ * concatenated. Returning false from a callback stops the operation.
+ */
+
+typedef struct bitset_sink_s {
+    bool (*offsets)(const bitset_offset *, size_t, void *);
+    bool (*words)(const bitset_word *, size_t, void *);
+} bitset_sink_t;
+
+typedef struct bitset_cache_stats_s {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+} bitset_cache_stats_t;
+
 /**
  * Create a new bitset operation.
  */
@@ -82,6 +107,24 @@ void bitset_operation_add_buffer(bitset_operation_t *, bitset_word *, size_t len
 
 void bitset_operation_add_nested(bitset_operation_t *, bitset_operation_t *, enum bitset_operation_type);
 
+/**
+ * Set the number of threads used to execute the operation. Large operations
+ * are split into ranges of word offsets which are executed in parallel, and
+ * the results are stitched together. Defaults to 1.
+ */
+
+void bitset_operation_threads(bitset_operation_t *, unsigned threads);
+
+/**
+ * Use a cache for the results of nested operations. Results are keyed by the
+ * structure of the nested operation and the identity and version of its
+ * operands, so an operand that's modified or freed is never matched. Buffers
+ * added with bitset_operation_add_buffer() have no version, and operations
+ * that use them aren't cached. Nested operations inherit the cache.
+ */
+
+void bitset_operation_cache(bitset_operation_t *, bitset_cache_t *);
+
 /**
  * Execute the operation and return the result.
  */
@@ -95,6 +138,187 @@ bitset_t *bitset_operation_exec(bitset_operation_t *);
 
 bitset_offset bitset_operation_count(bitset_operation_t *);
 
+/**
+ * Execute the operation and stream the result to a sink rather than building
+ * a bitset. The operands are merged in a single pass and the result is passed
+ * to the sink in fixed-size chunks, so memory use doesn't grow with the size
+ * of the result. Nested operations are still executed into bitsets first.
+ * Returns false if the sink stopped the operation early.
+ */
+
+bool bitset_operation_exec_to(bitset_operation_t *, const bitset_sink_t *, void *);
+
+/**
+ * Execute the operation over the bits in [start, end) only. Each operand is
+ * positioned at the start of the range without scanning the bits before it
+ * when the bitset has an index (see bitset_index_build()), and evaluation
+ * stops at the end of the range.
+ */
+
+bitset_t *bitset_operation_exec_range(bitset_operation_t *, bitset_offset start, bitset_offset end);
+
+/**
+ * Execute the operation until the result holds the first `limit` bits at or
+ * after the start offset. To page through a result, pass the last offset of
+ * the previous page plus one.
+ */
+
+bitset_t *bitset_operation_exec_limit(bitset_operation_t *, bitset_offset start, bitset_offset limit);
+
+/**
+ * Write the plan that would be used to execute the operation, i.e. the
+ * executor and the order the steps are applied in. Nested operations are
+ * executed while planning.
+ */
+
+void bitset_operation_explain(bitset_operation_t *, FILE *);
+
+/**
+ * Compile an operation so that it can be executed any number of times. The
+ * operation (including any nested operations) is left untouched, and each
+ * bitset in it becomes a slot that can be rebound to another bitset between
+ * executions. Slots are numbered in the order that bitsets were added, with
+ * the bitsets of a nested operation numbered from where it was added. Slots
+ * borrow the bitsets bound to them and start out bound to the operation's own
+ * steps, so the operation must outlive the compiled operation unless every
+ * slot is rebound.
+ */
+
+bitset_compiled_t *bitset_operation_compile(const bitset_operation_t *);
+
+/**
+ * Get the number of slots in a compiled operation.
+ */
+
+size_t bitset_compiled_slots(const bitset_compiled_t *);
+
+/**
+ * Bind a slot in a compiled operation to a bitset.
+ */
+
+void bitset_compiled_bind(bitset_compiled_t *, size_t slot, const bitset_t *);
+
+/**
+ * Execute a compiled operation and return the result.
+ */
+
+bitset_t *bitset_compiled_exec(bitset_compiled_t *);
+
+/**
+ * Get the population count of a compiled operation's result.
+ */
+
+bitset_offset bitset_compiled_count(bitset_compiled_t *);
+
+/**
+ * Free a compiled operation. Bound bitsets aren't freed.
+ */
+
+void bitset_compiled_free(bitset_compiled_t *);
+
+/**
+ * Create a cache for the results of nested operations which holds up to the
+ * specified number of bytes. The least recently used results are evicted
+ * first. A cache can be shared by operations running on different threads.
+ */
+
+bitset_cache_t *bitset_cache_new(size_t bytes);
+
+/**
+ * Free a cache. Operations that use the cache must not be executed after.
+ */
+
+void bitset_cache_free(bitset_cache_t *);
+
+/**
+ * Evict every result from a cache.
+ */
+
+void bitset_cache_clear(bitset_cache_t *);
+
+/**
+ * Get the number of hits, misses and evictions, and the current size of
+ * a cache.
+ */
+
+void bitset_cache_stats(bitset_cache_t *, bitset_cache_stats_t *);
+
+/**
+ * Combine two bitsets into a new bitset. The compressed buffers are merged
+ * directly, so these are cheaper than an operation with two steps.
+ */
+
+bitset_t *bitset_and(const bitset_t *, const bitset_t *);
+bitset_t *bitset_or(const bitset_t *, const bitset_t *);
+bitset_t *bitset_xor(const bitset_t *, const bitset_t *);
+bitset_t *bitset_andnot(const bitset_t *, const bitset_t *);
+
+/**
+ * Compare two bitsets without allocating. The compressed buffers are walked
+ * side by side and the walk stops at the first word that decides the answer,
+ * seeking over runs of empty words and skipping overlapping runs of ones
+ * together. Metadata is checked first when both bitsets have it attached.
+ *
+ * bitset_intersects() checks whether a bit is set in both bitsets,
+ * bitset_is_subset() checks whether every bit set in the first bitset is also
+ * set in the second, and bitset_equal() checks whether both bitsets have the
+ * same bits set regardless of how their buffers are encoded.
+ */
+
+bool bitset_intersects(const bitset_t *, const bitset_t *);
+bool bitset_is_subset(const bitset_t *, const bitset_t *);
+bool bitset_equal(const bitset_t *, const bitset_t *);
+
+/**
+ * Order two bitsets by comparing their set bits in ascending order, so a
+ * bitset sorts before any other bitset that it's a prefix of. Returns a
+ * negative, zero or positive value like memcmp().
+ */
+
+int bitset_compare(const bitset_t *, const bitset_t *);
+
+/**
+ * Count the bits in the intersection, union or difference of two bitsets
+ * without building the result. The compressed buffers are merged directly and
+ * the intersecting words are counted in batches by the popcount kernel, so
+ * nothing is allocated. The union and difference are derived from the
+ * intersection and the count of each bitset.
+ */
+
+bitset_offset bitset_and_count(const bitset_t *, const bitset_t *);
+bitset_offset bitset_or_count(const bitset_t *, const bitset_t *);
+bitset_offset bitset_andnot_count(const bitset_t *, const bitset_t *);
+
+/**
+ * Get the Jaccard index of two bitsets, i.e. the size of their intersection
+ * over the size of their union. Two empty bitsets have an index of zero.
+ */
+
+double bitset_jaccard(const bitset_t *, const bitset_t *);
+
+/**
+ * Combine a bitset into another bitset in place. The result is written to
+ * a per-thread scratch buffer which then swaps places with the destination's
+ * buffer, so folding many bitsets into one only allocates while the result
+ * grows. Scratch buffers of more than 64K words are freed after each call
+ * rather than kept until the thread exits. The destination's index and
+ * metadata are rebuilt if attached.
+ */
+
+void bitset_and_into(bitset_t *, const bitset_t *);
+void bitset_or_into(bitset_t *, const bitset_t *);
+void bitset_xor_into(bitset_t *, const bitset_t *);
+void bitset_andnot_into(bitset_t *, const bitset_t *);
+
+/**
+ * Get the bits that are set in at least k of n bitsets. The compressed buffers
+ * are merged directly in a single pass. A threshold of one is a union, a
+ * threshold of n is an intersection, and a threshold greater than n (or zero
+ * bitsets) gives an empty bitset. A threshold of zero is treated as one.
+ */
+
+bitset_t *bitset_threshold(bitset_t *const *, size_t n, unsigned k);
+
 #ifdef __cplusplus
 } //extern "C"
 #endif
@@ -35,6 +35,7 @@ typedef struct bitset_vector_s {
     size_t length;
     size_t size;
     unsigned tail_offset;
+    uint64_t version;
 } bitset_vector_t;
 
 typedef struct bitset_vector_operation_s bitset_vector_operation_t;
@@ -55,6 +56,7 @@ struct bitset_vector_operation_s {
     unsigned min;
     unsigned max;
     size_t length;
+    bitset_cache_t *cache;
 };
 
 #define BITSET_VECTOR_START 0
@@ -67,11 +69,22 @@ struct bitset_vector_operation_s {
 bitset_vector_t *bitset_vector_new(void);
 
 /**
- * Create a new bitset vector based on an existing buffer.
+ * Create a new bitset vector based on an existing buffer. Returns NULL if a
+ * bitset in the buffer is invalid or ambiguous, as checked by
+ * bitset_new_buffer(), e.g. if it has a run of ones.
  */
 
 bitset_vector_t *bitset_vector_import(const char *, size_t);
 
+/**
+ * Create a new bitset vector based on an existing buffer in the specified
+ * encoding. Bitsets in an older encoding are converted to the current one.
+ * Returns NULL if the buffer is in the current encoding and a bitset in it
+ * is invalid.
+ */
+
+bitset_vector_t *bitset_vector_import_encoded(const char *, size_t, enum bitset_encoding);
+
 /**
  * Free the specified vector.
  */
@@ -178,6 +191,12 @@ void bitset_vector_operation_add(bitset_vector_operation_t *,
 void bitset_vector_operation_add_nested(bitset_vector_operation_t *,
     bitset_vector_operation_t *, enum bitset_operation_type);
 
+/**
+ * Use a cache for the results of nested operations. See bitset_operation_cache().
+ */
+
+void bitset_vector_operation_cache(bitset_vector_operation_t *, bitset_cache_t *);
+
 /**
  * Execute the operation and return the result.
  */
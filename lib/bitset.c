@@ -4,6 +4,9 @@
 
 #include "bitset/malloc.h"
 #include "bitset/operation.h"
+#include "stream.h"
+#include "kernel.h"
+#include "cache.h"
 
 bitset_t *bitset_new() {
     bitset_t *bitset = bitset_malloc(sizeof(bitset_t));
@@ -12,20 +15,187 @@ bitset_t *bitset_new() {
     }
     bitset->length = 0;
     bitset->buffer = NULL;
+    bitset->index = NULL;
+    bitset->meta = NULL;
+    bitset->borrowed = false;
+    bitset->version = bitset_version_new();
     return bitset;
 }
 
 void bitset_free(bitset_t *bitset) {
-    if (bitset->length) {
+    if (bitset->buffer && !bitset->borrowed) {
         bitset_malloc_free(bitset->buffer);
     }
+    bitset_index_drop(bitset);
+    bitset_meta_drop(bitset);
     bitset_malloc_free(bitset);
 }
 
+static inline void bitset_index_push(bitset_index_t *index, size_t at,
+        size_t word, bitset_offset offset, bitset_offset rank) {
+    if (index->length == index->size) {
+        index->size = index->size ? index->size * 2 : 16;
+        index->samples = bitset_realloc(index->samples,
+            sizeof(bitset_index_sample_t) * index->size);
+        if (!index->samples) {
+            bitset_oom();
+        }
+    }
+    if (at < index->length) {
+        memmove(index->samples + at + 1, index->samples + at,
+            sizeof(bitset_index_sample_t) * (index->length - at));
+    }
+    index->samples[at].word = word;
+    index->samples[at].offset = offset;
+    index->samples[at].rank = rank;
+    index->length++;
+}
+
+static void bitset_index_extend(bitset_t *bitset) {
+    bitset_index_t *index = bitset->index;
+    if (!bitset->length) {
+        return;
+    }
+    if (!index->length) {
+        bitset_index_push(index, 0, 0, 0, 0);
+    }
+    size_t word = index->samples[index->length - 1].word;
+    bitset_offset offset = index->samples[index->length - 1].offset;
+    bitset_offset rank = index->samples[index->length - 1].rank;
+    while (word + index->interval < bitset->length) {
+        rank += bitset_kernel_count(bitset->buffer + word, index->interval);
+        for (size_t end = word + index->interval; word < end; word++) {
+            offset += bitset_word_span(bitset->buffer[word]);
+        }
+        bitset_index_push(index, index->length, word, offset, rank);
+    }
+}
+
+/**
+ * Find the sample to start scanning from. The word offset is made relative
+ * to the sampled word and the buffer index of the sampled word is returned.
+ */
+
+static inline size_t bitset_index_seek(const bitset_index_t *index, bitset_offset *word_offset) {
+    const bitset_index_sample_t *sample = bitset_index_lookup(index, *word_offset);
+    if (!sample) {
+        return 0;
+    }
+    *word_offset -= sample->offset;
+    return sample->word;
+}
+
+/**
+ * Account for words that were inserted at the specified buffer index. The
+ * logical offsets of the samples are unaffected, but if the insertion leaves
+ * too wide a gap between two samples then a new sample is added between them.
+ */
+
+static void bitset_index_insert(bitset_t *bitset, size_t at, size_t count) {
+    bitset_index_t *index = bitset->index;
+    size_t i = index->length, interval = index->interval;
+    while (i && index->samples[i - 1].word >= at) {
+        index->samples[--i].word += count;
+    }
+    if (i == index->length) {
+        bitset_index_extend(bitset);
+    } else if (i && index->samples[i].word - index->samples[i - 1].word > interval * 2) {
+        size_t word = index->samples[i - 1].word;
+        bitset_offset offset = index->samples[i - 1].offset;
+        bitset_offset rank = index->samples[i - 1].rank
+            + bitset_kernel_count(bitset->buffer + word, interval);
+        for (size_t end = word + interval; word < end; word++) {
+            offset += bitset_word_span(bitset->buffer[word]);
+        }
+        bitset_index_push(index, i, word, offset, rank);
+    }
+}
+
+/**
+ * Account for a bit being set or unset in the specified logical word, which
+ * changes the rank of every sample that starts after it. This must be called
+ * before the buffer is modified, since samples added as a result of the
+ * modification are counted from the modified buffer.
+ */
+
+static inline void bitset_index_count(bitset_t *bitset, bitset_offset word_offset, bool value) {
+    bitset_index_t *index = bitset->index;
+    if (!index) {
+        return;
+    }
+    for (size_t i = index->length; i && index->samples[i - 1].offset > word_offset; i--) {
+        if (value) {
+            index->samples[i - 1].rank++;
+        } else {
+            index->samples[i - 1].rank--;
+        }
+    }
+}
+
+void bitset_index_build(bitset_t *bitset, unsigned interval) {
+    if (!bitset->index) {
+        bitset->index = bitset_calloc(1, sizeof(bitset_index_t));
+        if (!bitset->index) {
+            bitset_oom();
+        }
+    }
+    bitset->index->interval = interval ? interval : BITSET_INDEX_INTERVAL;
+    bitset->index->length = 0;
+    bitset_index_extend(bitset);
+}
+
+void bitset_index_drop(bitset_t *bitset) {
+    if (bitset->index) {
+        bitset_malloc_free(bitset->index->samples);
+        bitset_malloc_free(bitset->index);
+        bitset->index = NULL;
+    }
+}
+
+/**
+ * Replace buffer[i] with `count` words that span the same logical words.
+ */
+
+static inline void bitset_splice_word(bitset_t *bitset, size_t i,
+        const bitset_word *words, size_t count) {
+    bitset_resize(bitset, bitset->length + count - 1);
+    if (i + count < bitset->length) {
+        memmove(bitset->buffer+i+count, bitset->buffer+i+1,
+            sizeof(bitset_word) * (bitset->length - i - count));
+    }
+    memcpy(bitset->buffer+i, words, sizeof(bitset_word) * count);
+    if (bitset->index && count > 1) {
+        bitset_index_insert(bitset, i + 1, count - 1);
+    }
+}
+
+/**
+ * Replace buffer[i] with two words that span the same logical words.
+ */
+
+static inline void bitset_split_word(bitset_t *bitset, size_t i,
+        bitset_word first, bitset_word second) {
+    bitset_word words[2] = { first, second };
+    bitset_splice_word(bitset, i, words, 2);
+}
+
+/**
+ * Views borrow their buffer, which may be read-only memory. Every write bumps
+ * the version of the bitset.
+ */
+
+static inline void bitset_check_writable(bitset_t *bitset) {
+    if (bitset->borrowed) {
+        BITSET_FATAL("bitset views are read-only");
+    }
+    bitset->version++;
+}
+
 void bitset_resize(bitset_t *bitset, size_t length) {
+    bitset_check_writable(bitset);
     size_t current_size, next_size;
     BITSET_NEXT_POW2(next_size, length);
-    if (!bitset->length) {
+    if (!bitset->buffer) {
         bitset->buffer = bitset_malloc(sizeof(bitset_word) * next_size);
     } else {
         BITSET_NEXT_POW2(current_size, bitset->length);
@@ -36,22 +206,52 @@ void bitset_resize(bitset_t *bitset, size_t length) {
     if (!bitset->buffer) {
         bitset_oom();
     }
+    bool truncated = length < bitset->length;
     bitset->length = length;
+    if (bitset->index) {
+        while (bitset->index->length &&
+                bitset->index->samples[bitset->index->length - 1].word >= length) {
+            bitset->index->length--;
+        }
+    }
+    if (bitset->meta && truncated) {
+        bitset_meta_build(bitset);
+    }
 }
 
 void bitset_clear(bitset_t *bitset) {
+    if (bitset->borrowed) {
+        bitset->buffer = NULL;
+        bitset->borrowed = false;
+    }
     bitset->length = 0;
+    bitset->version++;
+    if (bitset->index) {
+        bitset->index->length = 0;
+    }
+    if (bitset->meta) {
+        memset(bitset->meta, 0, sizeof(bitset_meta_t));
+    }
 }
 
 size_t bitset_length(const bitset_t *bitset) {
     return bitset->length * sizeof(bitset_word);
 }
 
+static inline void bitset_meta_attach(bitset_t *bitset, const bitset_meta_t *meta) {
+    bitset->meta = bitset_malloc(sizeof(bitset_meta_t));
+    if (!bitset->meta) {
+        bitset_oom();
+    }
+    memcpy(bitset->meta, meta, sizeof(bitset_meta_t));
+}
+
 bitset_t *bitset_copy(const bitset_t *bitset) {
     bitset_t *copy = bitset_calloc(1, sizeof(bitset_t));
     if (!copy) {
         bitset_oom();
     }
+    copy->version = bitset_version_new();
     if (bitset->length) {
         size_t size;
         BITSET_NEXT_POW2(size, bitset->length);
@@ -62,6 +262,12 @@ bitset_t *bitset_copy(const bitset_t *bitset) {
         memcpy(copy->buffer, bitset->buffer, bitset->length * sizeof(bitset_word));
         copy->length = bitset->length;
     }
+    if (bitset->index) {
+        bitset_index_build(copy, bitset->index->interval);
+    }
+    if (bitset->meta) {
+        bitset_meta_attach(copy, bitset->meta);
+    }
     return copy;
 }
 
@@ -71,12 +277,12 @@ bool bitset_get(const bitset_t *bitset, bitset_offset bit) {
     }
     bitset_offset length, word_offset = bit / BITSET_LITERAL_LENGTH;
     bit %= BITSET_LITERAL_LENGTH;
-    for (size_t i = 0; i < bitset->length; i++) {
+    for (size_t i = bitset_index_seek(bitset->index, &word_offset); i < bitset->length; i++) {
         if (BITSET_IS_FILL_WORD(bitset->buffer[i])) {
             length = BITSET_GET_LENGTH(bitset->buffer[i]);
             unsigned position = BITSET_GET_POSITION(bitset->buffer[i]);
             if (word_offset < length) {
-                return false;
+                return BITSET_IS_ONE_FILL(bitset->buffer[i]);
             } else if (position) {
                 if (word_offset == length) {
                     return position == bit + 1;
@@ -92,18 +298,10 @@ bool bitset_get(const bitset_t *bitset, bitset_offset bit) {
 }
 
 bitset_offset bitset_count(const bitset_t *bitset) {
-    bitset_offset count = 0;
-    for (size_t i = 0; i < bitset->length; i++) {
-        if (BITSET_IS_FILL_WORD(bitset->buffer[i])) {
-            if (BITSET_GET_POSITION(bitset->buffer[i])) {
-                count += 1;
-            }
-        } else {
-            bitset_word word = bitset->buffer[i];
-            BITSET_POP_COUNT(count, word);
-        }
+    if (bitset->meta) {
+        return bitset->meta->count;
     }
-    return count;
+    return bitset_kernel_count(bitset->buffer, bitset->length);
 }
 
 /*
@@ -126,7 +324,7 @@ static inline unsigned char bitset_fls(bitset_word word) {
     return table[word >> 26] - 1;
 }*/
 static inline unsigned char bitset_fls(bitset_word word) {
-    return (__builtin_clz(word)-1);
+    return (BITSET_CLZ(word)-1);
 }
 
 /*
@@ -139,46 +337,266 @@ static inline unsigned char bitset_ffs(bitset_word word) {
 }
 */
 static inline unsigned char bitset_ffs(bitset_word word) {
-    return (__builtin_ctz(word)+1);
+    return (BITSET_CTZ(word)+1);
 }
 
-bitset_offset bitset_min(const bitset_t *bitset) {
+static bitset_offset bitset_min_scan(const bitset_t *bitset) {
     bitset_offset offset = 0;
     for (size_t i = 0; i < bitset->length; i++) {
-        if (BITSET_IS_FILL_WORD(bitset->buffer[i])) {
+        if (BITSET_IS_ONE_FILL(bitset->buffer[i]) && BITSET_GET_LENGTH(bitset->buffer[i])) {
+            return offset * BITSET_LITERAL_LENGTH;
+        } else if (BITSET_IS_FILL_WORD(bitset->buffer[i])) {
             offset += BITSET_GET_LENGTH(bitset->buffer[i]);
             unsigned position = BITSET_GET_POSITION(bitset->buffer[i]);
             if (position) {
                 return offset * BITSET_LITERAL_LENGTH + position - 1;
             }
-        } else {
+        } else if (bitset->buffer[i]) {
             return offset * BITSET_LITERAL_LENGTH + bitset_fls(bitset->buffer[i]);
+        } else {
+            offset++;
         }
     }
     return 0;
 }
 
+/**
+ * Find the highest set bit, starting from the last skip index sample. Words
+ * at the end of the buffer can be empty after bits are unset, in which case
+ * the scan is repeated from the start.
+ */
+
+static bitset_offset bitset_max_scan(const bitset_t *bitset) {
+    bitset_offset max = 0, offset = 0;
+    bitset_word word;
+    unsigned position;
+    size_t start = 0;
+    bool found = false;
+    if (bitset->index && bitset->index->length) {
+        start = bitset->index->samples[bitset->index->length - 1].word;
+        offset = bitset->index->samples[bitset->index->length - 1].offset;
+    }
+    for (;;) {
+        for (size_t i = start; i < bitset->length; i++) {
+            word = bitset->buffer[i];
+            if (BITSET_IS_ONE_FILL(word)) {
+                if (BITSET_GET_LENGTH(word)) {
+                    offset += BITSET_GET_LENGTH(word);
+                    max = offset * BITSET_LITERAL_LENGTH - 1;
+                    found = true;
+                }
+                continue;
+            } else if (BITSET_IS_FILL_WORD(word)) {
+                offset += BITSET_GET_LENGTH(word);
+                position = BITSET_GET_POSITION(word);
+                if (!position) {
+                    continue;
+                }
+                max = offset * BITSET_LITERAL_LENGTH + position - 1;
+                found = true;
+            } else if (word) {
+                max = offset * BITSET_LITERAL_LENGTH + BITSET_LITERAL_LENGTH - bitset_ffs(word);
+                found = true;
+            }
+            offset++;
+        }
+        if (found || !start) {
+            return max;
+        }
+        start = 0;
+        offset = 0;
+    }
+}
+
+bitset_offset bitset_min(const bitset_t *bitset) {
+    if (bitset->meta) {
+        return bitset->meta->min;
+    }
+    return bitset_min_scan(bitset);
+}
+
 bitset_offset bitset_max(const bitset_t *bitset) {
-    if (!bitset->length) {
-        return 0;
+    if (bitset->meta) {
+        return bitset->meta->max;
     }
-    bitset_offset offset = 0;
-    for (size_t i = 0; i < bitset->length; i++) {
-        if (BITSET_IS_FILL_WORD(bitset->buffer[i])) {
-            offset += BITSET_GET_LENGTH(bitset->buffer[i]);
-            if (BITSET_GET_POSITION(bitset->buffer[i])) {
-                offset += 1;
+    return bitset_max_scan(bitset);
+}
+
+bitset_offset bitset_words(const bitset_t *bitset) {
+    if (bitset->meta) {
+        return bitset->meta->words;
+    }
+    bitset_offset words = 0;
+    size_t i = 0;
+    if (bitset->index && bitset->index->length) {
+        i = bitset->index->samples[bitset->index->length - 1].word;
+        words = bitset->index->samples[bitset->index->length - 1].offset;
+    }
+    for (; i < bitset->length; i++) {
+        words += bitset_word_span(bitset->buffer[i]);
+    }
+    return words;
+}
+
+void bitset_meta_build(bitset_t *bitset) {
+    if (!bitset->meta) {
+        bitset->meta = bitset_malloc(sizeof(bitset_meta_t));
+        if (!bitset->meta) {
+            bitset_oom();
+        }
+    }
+    bitset_meta_t *meta = bitset->meta;
+    bitset->meta = NULL;
+    meta->count = bitset_count(bitset);
+    meta->min = bitset_min_scan(bitset);
+    meta->max = bitset_max_scan(bitset);
+    meta->words = bitset_words(bitset);
+    bitset->meta = meta;
+}
+
+void bitset_meta_drop(bitset_t *bitset) {
+    if (bitset->meta) {
+        bitset_malloc_free(bitset->meta);
+        bitset->meta = NULL;
+    }
+}
+
+/**
+ * Update cached metadata after the specified bit was set or unset.
+ */
+
+static void bitset_meta_update(bitset_t *bitset, bitset_offset bit, bool value) {
+    bitset_meta_t *meta = bitset->meta;
+    bitset_offset word_offset = bit / BITSET_LITERAL_LENGTH;
+    if (value) {
+        if (!meta->count++) {
+            meta->min = meta->max = bit;
+        } else if (bit < meta->min) {
+            meta->min = bit;
+        } else if (bit > meta->max) {
+            meta->max = bit;
+        }
+        if (word_offset >= meta->words) {
+            meta->words = word_offset + 1;
+        }
+        return;
+    }
+    if (!--meta->count) {
+        meta->min = meta->max = 0;
+    } else {
+        if (bit == meta->min) {
+            meta->min = bitset_min_scan(bitset);
+        }
+        if (bit == meta->max) {
+            meta->max = bitset_max_scan(bitset);
+        }
+    }
+    //Unsetting the position of a trailing fill shortens the span
+    if (word_offset + 1 == meta->words
+            && BITSET_IS_FILL_WORD(bitset->buffer[bitset->length - 1])
+            && !BITSET_IS_ONE_FILL(bitset->buffer[bitset->length - 1])) {
+        meta->words = word_offset;
+    }
+}
+
+bitset_offset bitset_rank(const bitset_t *bitset, bitset_offset offset) {
+    bitset_offset length, rank = 0, word_offset = offset / BITSET_LITERAL_LENGTH;
+    unsigned position, bit = offset % BITSET_LITERAL_LENGTH;
+    size_t start = 0, i;
+    bitset_word word;
+    const bitset_index_sample_t *sample = bitset_index_lookup(bitset->index, word_offset);
+    if (sample) {
+        start = sample->word;
+        word_offset -= sample->offset;
+        rank = sample->rank;
+    }
+    //Find the word containing the offset, then count everything before it
+    for (i = start; i < bitset->length; i++) {
+        word = bitset->buffer[i];
+        if (BITSET_IS_FILL_WORD(word)) {
+            length = BITSET_GET_LENGTH(word);
+            if (word_offset < length) {
+                if (BITSET_IS_ONE_FILL(word)) {
+                    rank += word_offset * BITSET_LITERAL_LENGTH + bit;
+                }
+                break;
+            }
+            word_offset -= length;
+            position = BITSET_GET_POSITION(word);
+            if (position) {
+                if (!word_offset) {
+                    rank += position - 1 < bit;
+                    break;
+                }
+                word_offset--;
+            }
+        } else if (!word_offset--) {
+            word &= ~(((bitset_word)1 << (BITSET_LITERAL_LENGTH - bit)) - 1);
+            BITSET_POP_COUNT(rank, word);
+            break;
+        }
+    }
+    return rank + bitset_kernel_count(bitset->buffer + start, i - start);
+}
+
+bool bitset_select(const bitset_t *bitset, bitset_offset n, bitset_offset *offset) {
+    bitset_offset count, word_offset = 0;
+    const bitset_index_t *index = bitset->index;
+    bitset_word word, tmp;
+    unsigned position;
+    size_t i = 0;
+    if (index && index->length) {
+        size_t low = 0, high = index->length, mid;
+        while (high - low > 1) {
+            mid = low + (high - low) / 2;
+            if (index->samples[mid].rank <= n) {
+                low = mid;
+            } else {
+                high = mid;
             }
-        } else {
-            offset += 1;
         }
+        i = index->samples[low].word;
+        word_offset = index->samples[low].offset;
+        n -= index->samples[low].rank;
     }
-    bitset_word last = bitset->buffer[bitset->length-1];
-    offset = (offset - 1) * BITSET_LITERAL_LENGTH;
-    if (BITSET_IS_FILL_WORD(last)) {
-        return offset + BITSET_GET_POSITION(last) - 1;
+    for (; i < bitset->length; i++) {
+        word = bitset->buffer[i];
+        if (BITSET_IS_ONE_FILL(word)) {
+            count = BITSET_GET_LENGTH(word) * BITSET_LITERAL_LENGTH;
+            if (n < count) {
+                *offset = word_offset * BITSET_LITERAL_LENGTH + n;
+                return true;
+            }
+            n -= count;
+            word_offset += BITSET_GET_LENGTH(word);
+            continue;
+        } else if (BITSET_IS_FILL_WORD(word)) {
+            word_offset += BITSET_GET_LENGTH(word);
+            position = BITSET_GET_POSITION(word);
+            if (!position) {
+                continue;
+            }
+            if (!n) {
+                *offset = word_offset * BITSET_LITERAL_LENGTH + position - 1;
+                return true;
+            }
+            n--;
+        } else {
+            count = 0;
+            tmp = word;
+            BITSET_POP_COUNT(count, tmp);
+            if (n < count) {
+                for (; n; n--) {
+                    word ^= BITSET_CREATE_LITERAL(bitset_fls(word));
+                }
+                *offset = word_offset * BITSET_LITERAL_LENGTH + bitset_fls(word);
+                return true;
+            }
+            n -= count;
+        }
+        word_offset++;
     }
-    return offset + BITSET_LITERAL_LENGTH - bitset_ffs(last);
+    return false;
 }
 
 bool bitset_set(bitset_t *bitset, bitset_offset bit) {
@@ -189,31 +607,78 @@ bool bitset_unset(bitset_t *bitset, bitset_offset bit) {
     return bitset_set_to(bitset, bit, false);
 }
 
-bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
-    bitset_offset word_offset = bit / BITSET_LITERAL_LENGTH;
+/**
+ * Remove the position bit from the fill at buffer[i]. Unless the fill is the
+ * last word, the span that the position covered must be preserved.
+ */
+
+static inline void bitset_unset_position(bitset_t *bitset, size_t i) {
+    bitset_word word = bitset->buffer[i];
+    bitset_offset fill_length = BITSET_GET_LENGTH(word);
+    if (i == bitset->length - 1) {
+        bitset->buffer[i] = BITSET_UNSET_POSITION(word);
+    } else if (fill_length < BITSET_MAX_LENGTH) {
+        bitset->buffer[i] = BITSET_CREATE_EMPTY_FILL(fill_length + 1);
+    } else {
+        bitset_split_word(bitset, i, BITSET_UNSET_POSITION(word), 0);
+    }
+}
+
+/**
+ * Unset a bit in the run of ones at buffer[i]. The run is split into the
+ * words before, the word containing the bit and the words after.
+ */
+
+static inline void bitset_unset_run(bitset_t *bitset, size_t i,
+        bitset_offset word_offset, unsigned bit) {
+    bitset_offset after = BITSET_GET_LENGTH(bitset->buffer[i]) - word_offset - 1;
+    bitset_word words[3];
+    size_t count = 0;
+    if (word_offset) {
+        words[count++] = word_offset > 1 ? BITSET_CREATE_ONE_FILL(word_offset) : BITSET_ONES_LITERAL;
+    }
+    words[count++] = BITSET_ONES_LITERAL & ~BITSET_CREATE_LITERAL(bit);
+    if (after) {
+        words[count++] = after > 1 ? BITSET_CREATE_ONE_FILL(after) : BITSET_ONES_LITERAL;
+    }
+    bitset_splice_word(bitset, i, words, count);
+}
+
+/**
+ * Set or unset a bit in the buffer, keeping the skip index up to date.
+ */
+
+static bool bitset_update(bitset_t *bitset, bitset_offset bit, bool value) {
+    bitset_offset word_offset = bit / BITSET_LITERAL_LENGTH, target = word_offset;
     bit %= BITSET_LITERAL_LENGTH;
     if (bitset->length) {
         bitset_word word;
         bitset_offset fill_length;
         unsigned position;
-        for (size_t i = 0; i < bitset->length; i++) {
+        for (size_t i = bitset_index_seek(bitset->index, &word_offset); i < bitset->length; i++) {
             word = bitset->buffer[i];
-            if (BITSET_IS_FILL_WORD(word)) {
+            if (BITSET_IS_ONE_FILL(word)) {
+                fill_length = BITSET_GET_LENGTH(word);
+                if (word_offset < fill_length) {
+                    if (!value) {
+                        bitset_index_count(bitset, target, false);
+                        bitset_unset_run(bitset, i, word_offset, bit);
+                    }
+                    return true;
+                }
+                word_offset -= fill_length;
+            } else if (BITSET_IS_FILL_WORD(word)) {
                 position = BITSET_GET_POSITION(word);
                 fill_length = BITSET_GET_LENGTH(word);
-                if (word_offset == fill_length - 1) {
+                if (!value && word_offset < fill_length) {
+                    return false;
+                } else if (word_offset == fill_length - 1) {
+                    bitset_index_count(bitset, target, true);
                     if (position) {
-                        bitset_resize(bitset, bitset->length + 1);
-                        if (i < bitset->length - 1) {
-                            memmove(bitset->buffer+i+2, bitset->buffer+i+1,
-                                sizeof(bitset_word) * (bitset->length - i - 2));
-                        }
-                        bitset->buffer[i+1] = BITSET_CREATE_LITERAL(position - 1);
-                        if (word_offset) {
-                            bitset->buffer[i] = BITSET_CREATE_FILL(fill_length - 1, bit);
-                        } else {
-                            bitset->buffer[i] = BITSET_CREATE_LITERAL(bit);
-                        }
+                        bitset_split_word(bitset, i, word_offset
+                            ? BITSET_CREATE_FILL(fill_length - 1, bit)
+                            : BITSET_CREATE_LITERAL(bit),
+                            BITSET_CREATE_LITERAL(position - 1));
                     } else {
                         if (fill_length - 1 > 0) {
                             bitset->buffer[i] = BITSET_CREATE_FILL(fill_length - 1, bit);
@@ -223,17 +688,11 @@ bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
                     }
                     return false;
                 } else if (word_offset < fill_length) {
-                    bitset_resize(bitset, bitset->length + 1);
-                    if (i < bitset->length - 1) {
-                        memmove(bitset->buffer+i+2, bitset->buffer+i+1,
-                            sizeof(bitset_word) * (bitset->length - i - 2));
-                    }
-                    if (!word_offset) {
-                        bitset->buffer[i] = BITSET_CREATE_LITERAL(bit);
-                    } else {
-                        bitset->buffer[i] = BITSET_CREATE_FILL(word_offset, bit);
-                    }
-                    bitset->buffer[i+1] = BITSET_CREATE_FILL(fill_length - word_offset - 1, position - 1);
+                    bitset_index_count(bitset, target, true);
+                    bitset_split_word(bitset, i, word_offset
+                        ? BITSET_CREATE_FILL(word_offset, bit)
+                        : BITSET_CREATE_LITERAL(bit),
+                        BITSET_CREATE_FILL(fill_length - word_offset - 1, position - 1));
                     return false;
                 }
                 word_offset -= fill_length;
@@ -241,31 +700,30 @@ bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
                     if (!word_offset) {
                         if (position == bit + 1) {
                             if (!value) {
-                                bitset->buffer[i] = BITSET_UNSET_POSITION(word);
+                                bitset_index_count(bitset, target, false);
+                                bitset_unset_position(bitset, i);
                             }
                             return true;
-                        } else {
-                            bitset_resize(bitset, bitset->length + 1);
-                            if (i < bitset->length - 1) {
-                                memmove(bitset->buffer+i+2, bitset->buffer+i+1,
-                                    sizeof(bitset_word) * (bitset->length - i - 2));
-                            }
-                            bitset->buffer[i] = BITSET_UNSET_POSITION(word);
+                        } else if (value) {
+                            bitset_index_count(bitset, target, true);
                             bitset_word literal = 0;
                             literal |= BITSET_CREATE_LITERAL(position - 1);
                             literal |= BITSET_CREATE_LITERAL(bit);
-                            bitset->buffer[i+1] = literal;
-                            return false;
+                            bitset_split_word(bitset, i, BITSET_UNSET_POSITION(word), literal);
                         }
+                        return false;
                     }
                     word_offset--;
-                } else if (!word_offset && i == bitset->length - 1) {
+                } else if (value && !word_offset && i == bitset->length - 1) {
                     bitset->buffer[i] = BITSET_SET_POSITION(word, bit + 1);
                     return false;
                 }
             } else if (!word_offset--) {
                 bitset_word mask = BITSET_CREATE_LITERAL(bit);
                 bool previous = word & mask;
+                if (previous != value) {
+                    bitset_index_count(bitset, target, value);
+                }
                 if (value) {
                     bitset->buffer[i] |= mask;
                 } else {
@@ -291,96 +749,323 @@ bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
         } else {
             bitset->buffer[bitset->length - 1] = BITSET_CREATE_LITERAL(bit);
         }
+        if (bitset->index) {
+            bitset_index_extend(bitset);
+        }
     }
     return false;
 }
 
-bitset_t *bitset_new_buffer(const char *buffer, size_t length) {
-    bitset_t *bitset = bitset_malloc(sizeof(bitset_t));
-    if (!bitset) {
-        bitset_oom();
+bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
+    bitset_check_writable(bitset);
+    bool previous = bitset_update(bitset, bit, value);
+    if (bitset->meta && previous != value) {
+        bitset_meta_update(bitset, bit, value);
     }
-    bitset->buffer = bitset_malloc(length * sizeof(char));
-    if (!bitset->buffer) {
-        bitset_oom();
+    return previous;
+}
+
+static bitset_t *bitset_new_checked_buffer(const char *buffer, size_t length,
+        enum bitset_encoding encoding, bool stated) {
+    size_t words = length / sizeof(bitset_word), size;
+    if (encoding == BITSET_ENCODING_CURRENT && !bitset_encoding_check(buffer, words, stated)) {
+        return NULL;
+    }
+    bitset_t *bitset = bitset_new();
+    if (encoding != BITSET_ENCODING_CURRENT) {
+        words = bitset_encoding_upgrade(buffer, length / sizeof(bitset_word), NULL);
+    }
+    if (words) {
+        //Buffers are sized to the next power of two like any other, since
+        //that's what they're assumed to be when they grow or change hands
+        BITSET_NEXT_POW2(size, words);
+        bitset->buffer = bitset_malloc(sizeof(bitset_word) * size);
+        if (!bitset->buffer) {
+            bitset_oom();
+        }
+        if (encoding == BITSET_ENCODING_CURRENT) {
+            memcpy(bitset->buffer, buffer, sizeof(bitset_word) * words);
+        } else {
+            bitset_encoding_upgrade(buffer, length / sizeof(bitset_word), bitset->buffer);
+        }
     }
-    memcpy(bitset->buffer, buffer, length * sizeof(char));
+    bitset->length = words;
+    return bitset;
+}
+
+bitset_t *bitset_new_buffer(const char *buffer, size_t length) {
+    return bitset_new_checked_buffer(buffer, length, BITSET_ENCODING_CURRENT, false);
+}
+
+bitset_t *bitset_new_encoded_buffer(const char *buffer, size_t length,
+        enum bitset_encoding encoding) {
+    return bitset_new_checked_buffer(buffer, length, encoding, true);
+}
+
+static bitset_t *bitset_new_checked_view(const char *buffer, size_t length, bool stated) {
+    if ((uintptr_t)buffer % sizeof(bitset_word) || length % sizeof(bitset_word)
+            || !bitset_encoding_check(buffer, length / sizeof(bitset_word), stated)) {
+        return NULL;
+    }
+    bitset_t *bitset = bitset_new();
+    bitset->buffer = (bitset_word *) buffer;
     bitset->length = length / sizeof(bitset_word);
+    bitset->borrowed = true;
     return bitset;
 }
 
+bitset_t *bitset_new_view(const char *buffer, size_t length) {
+    return bitset_new_checked_view(buffer, length, false);
+}
+
+bitset_t *bitset_new_encoded_view(const char *buffer, size_t length,
+        enum bitset_encoding encoding) {
+    //A view can't be converted, so an older buffer is only accepted if it
+    //reads the same in the current encoding
+    return bitset_new_checked_view(buffer, length, encoding == BITSET_ENCODING_CURRENT);
+}
+
+void bitset_view_own(bitset_t *bitset) {
+    if (!bitset->borrowed) {
+        return;
+    }
+    bitset_word *buffer = bitset->buffer;
+    size_t size;
+    bitset->buffer = NULL;
+    bitset->borrowed = false;
+    if (bitset->length) {
+        BITSET_NEXT_POW2(size, bitset->length);
+        bitset->buffer = bitset_malloc(sizeof(bitset_word) * size);
+        if (!bitset->buffer) {
+            bitset_oom();
+        }
+        memcpy(bitset->buffer, buffer, bitset->length * sizeof(bitset_word));
+    }
+}
+
+/**
+ * Replace the buffer of a bitset with the buffer of a temporary bitset, which
+ * is freed, and rebuild the index and metadata.
+ */
+
+static void bitset_replace(bitset_t *bitset, bitset_t *result) {
+    if (bitset->buffer) {
+        bitset_malloc_free(bitset->buffer);
+    }
+    bitset->buffer = result->buffer;
+    bitset->length = result->length;
+    bitset_malloc_free(result);
+    if (bitset->index) {
+        bitset_index_build(bitset, bitset->index->interval);
+    }
+    if (bitset->meta) {
+        bitset_meta_build(bitset);
+    }
+}
+
 static int bitset_new_bits_sort(const void *a, const void *b) {
     bitset_offset al = *(bitset_offset *)a, bl = *(bitset_offset *)b;
     return al > bl ? 1 : -1;
 }
 
-bitset_t *bitset_new_bits(bitset_offset *bits, size_t count) {
-    bitset_t *bitset = bitset_new();
-    if (!count) {
-        return bitset;
+/**
+ * Arrays at least this long are sorted with an LSD radix sort rather than
+ * qsort().
+ */
+
+#define BITSET_RADIX_SORT_MIN 256
+
+/**
+ * Sort an array of bits using one pass per byte. A histogram of every byte
+ * is built up front so that passes where all bits share the same byte can
+ * be skipped, which is common for the high bytes of offsets.
+ */
+
+static void bitset_radix_sort(bitset_offset *bits, size_t count) {
+    size_t histogram[sizeof(bitset_offset)][256], offsets[256], total;
+    bitset_offset *tmp = bitset_malloc(sizeof(bitset_offset) * count);
+    bitset_offset *from = bits, *to = tmp, *swap;
+    if (!tmp) {
+        bitset_oom();
+    }
+    memset(histogram, 0, sizeof(histogram));
+    for (size_t i = 0; i < count; i++) {
+        for (size_t byte = 0; byte < sizeof(bitset_offset); byte++) {
+            histogram[byte][(bits[i] >> (byte * 8)) & 0xFF]++;
+        }
     }
-    unsigned pos = 0, rem, next_rem, i;
-    bitset_offset word_offset = 0, div, next_div, fills, last_bit;
-    bitset_word fill = BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH);
-    qsort(bits, count, sizeof(bitset_offset), bitset_new_bits_sort);
-    last_bit = bits[0];
-    div = bits[0] / BITSET_LITERAL_LENGTH;
-    rem = bits[0] % BITSET_LITERAL_LENGTH;
-    bitset_resize(bitset, 1);
-    bitset->buffer[0] = 0;
-    for (i = 1; i < count; i++) {
-        if (bits[i] == last_bit) {
+    for (size_t byte = 0; byte < sizeof(bitset_offset); byte++) {
+        unsigned shift = byte * 8;
+        if (histogram[byte][(bits[0] >> shift) & 0xFF] == count) {
             continue;
         }
-        last_bit = bits[i];
-        next_div = bits[i] / BITSET_LITERAL_LENGTH;
-        next_rem = bits[i] % BITSET_LITERAL_LENGTH;
-        if (div == word_offset) {
-            bitset->buffer[pos] |= BITSET_CREATE_LITERAL(rem);
-            if (div != next_div) {
-                bitset_resize(bitset, bitset->length + 1);
-                bitset->buffer[++pos] = 0;
-                word_offset = div + 1;
-            }
-        } else {
-            bitset_resize(bitset, bitset->length + 1);
-            if (div == next_div) {
-                bitset->buffer[pos++] = BITSET_CREATE_EMPTY_FILL(div - word_offset);
-                bitset->buffer[pos] = BITSET_CREATE_LITERAL(rem);
-                word_offset = div;
-            } else {
-                bitset->buffer[pos++] = BITSET_CREATE_FILL(div - word_offset, rem);
-                bitset->buffer[pos] = 0;
-                word_offset = div + 1;
-            }
+        total = 0;
+        for (size_t digit = 0; digit < 256; digit++) {
+            offsets[digit] = total;
+            total += histogram[byte][digit];
         }
-        if (next_div - word_offset > BITSET_MAX_LENGTH) {
-            fills = (next_div - word_offset) / BITSET_MAX_LENGTH;
-            bitset_resize(bitset, bitset->length + fills);
-            for (bitset_offset j = 0; j < fills; j++) {
-                bitset->buffer[pos++] = fill;
-            }
-            word_offset += fills * BITSET_MAX_LENGTH;
+        for (size_t i = 0; i < count; i++) {
+            to[offsets[(from[i] >> shift) & 0xFF]++] = from[i];
         }
-        div = next_div;
-        rem = next_rem;
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != bits) {
+        memcpy(bits, from, sizeof(bitset_offset) * count);
     }
-    if (count > 1 && div == bits[i-2] / BITSET_LITERAL_LENGTH) {
-        bitset->buffer[pos] |= BITSET_CREATE_LITERAL(rem);
+    bitset_malloc_free(tmp);
+}
+
+static inline void bitset_sort(bitset_offset *bits, size_t count) {
+    if (count < BITSET_RADIX_SORT_MIN) {
+        qsort(bits, count, sizeof(bitset_offset), bitset_new_bits_sort);
     } else {
-        if (div - word_offset > BITSET_MAX_LENGTH) {
-            fills = (div - word_offset) / BITSET_MAX_LENGTH;
-            bitset_resize(bitset, bitset->length + fills);
-            for (bitset_offset j = 0; j < fills; j++) {
-                bitset->buffer[pos++] = fill;
-            }
-            word_offset += fills * BITSET_MAX_LENGTH;
+        bitset_radix_sort(bits, count);
+    }
+}
+
+static inline bool bitset_is_sorted(const bitset_offset *bits, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        if (bits[i] < bits[i-1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bitset_t *bitset_new_sorted_bits(const bitset_offset *bits, size_t count) {
+    bitset_t *bitset = bitset_new();
+    bitset_meta_t meta = { 0, 0, 0, 0 };
+    if (!count) {
+        bitset_meta_attach(bitset, &meta);
+        return bitset;
+    }
+    bitset_writer_t writer;
+    bitset_offset word_offset, last = bits[count - 1] / BITSET_LITERAL_LENGTH;
+    bitset_word word, tmp;
+    size_t words = last < count ? last + 1 : count;
+    bitset_writer_init(&writer, bitset);
+    //Each distinct word needs at most a fill and a literal, plus fills for long gaps
+    bitset_writer_reserve(&writer, words * 2 + last / BITSET_MAX_LENGTH + 1);
+    for (size_t i = 0; i < count; ) {
+        word_offset = bits[i] / BITSET_LITERAL_LENGTH;
+        word = 0;
+        for (; i < count && bits[i] / BITSET_LITERAL_LENGTH == word_offset; i++) {
+            word |= BITSET_CREATE_LITERAL(bits[i] % BITSET_LITERAL_LENGTH);
         }
-        bitset->buffer[pos] = BITSET_CREATE_FILL(div - word_offset, rem);
+        tmp = word;
+        BITSET_POP_COUNT(meta.count, tmp);
+        bitset_writer_append(&writer, word_offset, word);
     }
+    bitset_writer_finish(&writer);
+    meta.min = bits[0];
+    meta.max = bits[count - 1];
+    meta.words = word_offset + 1;
+    bitset_meta_attach(bitset, &meta);
     return bitset;
 }
 
+bitset_t *bitset_new_bits(const bitset_offset *bits, size_t count) {
+    if (bitset_is_sorted(bits, count)) {
+        return bitset_new_sorted_bits(bits, count);
+    }
+    bitset_offset *sorted = bitset_malloc(sizeof(bitset_offset) * count);
+    if (!sorted) {
+        bitset_oom();
+    }
+    memcpy(sorted, bits, sizeof(bitset_offset) * count);
+    bitset_sort(sorted, count);
+    bitset_t *bitset = bitset_new_sorted_bits(sorted, count);
+    bitset_malloc_free(sorted);
+    return bitset;
+}
+
+void bitset_set_many_to(bitset_t *bitset, bitset_offset *bits, size_t count, bool value) {
+    if (!count) {
+        return;
+    }
+    bitset_check_writable(bitset);
+    if (!bitset_is_sorted(bits, count)) {
+        bitset_sort(bits, count);
+    }
+    bitset_t *result = bitset_new();
+    bitset_reader_t reader;
+    bitset_writer_t writer;
+    bitset_offset word_offset;
+    bitset_word word, mask;
+    bitset_reader_init(&reader, bitset->buffer, bitset->length);
+    bitset_writer_init(&writer, result);
+    bool more = bitset_reader_next(&reader);
+    for (size_t i = 0; i < count; ) {
+        word_offset = bits[i] / BITSET_LITERAL_LENGTH;
+        mask = 0;
+        for (; i < count && bits[i] / BITSET_LITERAL_LENGTH == word_offset; i++) {
+            mask |= BITSET_CREATE_LITERAL(bits[i] % BITSET_LITERAL_LENGTH);
+        }
+        more = bitset_stream_copy(&reader, &writer, more, word_offset);
+        word = 0;
+        if (more && reader.offset == word_offset) {
+            word = reader.word;
+            more = bitset_reader_seek(&reader, word_offset + 1);
+        }
+        bitset_writer_append(&writer, word_offset, value ? word | mask : word & ~mask);
+    }
+    bitset_stream_copy(&reader, &writer, more, BITSET_OFFSET_MAX);
+    bitset_replace(bitset, result);
+}
+
+void bitset_set_many(bitset_t *bitset, bitset_offset *bits, size_t count) {
+    bitset_set_many_to(bitset, bits, count, true);
+}
+
+void bitset_unset_many(bitset_t *bitset, bitset_offset *bits, size_t count) {
+    bitset_set_many_to(bitset, bits, count, false);
+}
+
+void bitset_set_range_to(bitset_t *bitset, bitset_offset start, bitset_offset end, bool value) {
+    if (start >= end) {
+        return;
+    }
+    bitset_check_writable(bitset);
+    bitset_offset first = start / BITSET_LITERAL_LENGTH, last = (end - 1) / BITSET_LITERAL_LENGTH;
+    bitset_word first_mask = ((bitset_word)1 << (BITSET_LITERAL_LENGTH - start % BITSET_LITERAL_LENGTH)) - 1;
+    bitset_word last_mask = BITSET_ONES_LITERAL
+        & ~(((bitset_word)1 << (BITSET_LITERAL_LENGTH - 1 - (end - 1) % BITSET_LITERAL_LENGTH)) - 1);
+    bitset_word word;
+    if (first == last) {
+        first_mask &= last_mask;
+    }
+    bitset_t *result = bitset_new();
+    bitset_reader_t reader;
+    bitset_writer_t writer;
+    bitset_reader_init(&reader, bitset->buffer, bitset->length);
+    bitset_writer_init(&writer, result);
+    bool more = bitset_reader_next(&reader);
+    more = bitset_stream_copy(&reader, &writer, more, first);
+    word = more && reader.offset == first ? reader.word : 0;
+    bitset_writer_append(&writer, first, value ? word | first_mask : word & ~first_mask);
+    if (first < last) {
+        if (value) {
+            bitset_writer_append_ones(&writer, first + 1, last - first - 1);
+        }
+        more = more && bitset_reader_seek(&reader, last);
+        word = more && reader.offset == last ? reader.word : 0;
+        bitset_writer_append(&writer, last, value ? word | last_mask : word & ~last_mask);
+    }
+    more = more && bitset_reader_seek(&reader, last + 1);
+    bitset_stream_copy(&reader, &writer, more, BITSET_OFFSET_MAX);
+    bitset_replace(bitset, result);
+}
+
+void bitset_set_range(bitset_t *bitset, bitset_offset start, bitset_offset end) {
+    bitset_set_range_to(bitset, start, end, true);
+}
+
+void bitset_clear_range(bitset_t *bitset, bitset_offset start, bitset_offset end) {
+    bitset_set_range_to(bitset, start, end, false);
+}
+
 bitset_iterator_t *bitset_iterator_new(const bitset_t *bitset) {
     bitset_iterator_t *iterator = bitset_malloc(sizeof(bitset_iterator_t));
     if (!iterator) {
@@ -395,26 +1080,9 @@ bitset_iterator_t *bitset_iterator_new(const bitset_t *bitset) {
     if (!iterator->offsets) {
         bitset_oom();
     }
-    bitset_offset offset = 0;
-    unsigned position;
-    for (size_t j = 0, k = 0; j < bitset->length; j++) {
-        if (BITSET_IS_FILL_WORD(bitset->buffer[j])) {
-            offset += BITSET_GET_LENGTH(bitset->buffer[j]);
-            position = BITSET_GET_POSITION(bitset->buffer[j]);
-            if (!position) {
-                continue;
-            }
-            iterator->offsets[k++] = BITSET_LITERAL_LENGTH * offset + position - 1;
-        } else {
-            for (size_t x = BITSET_LITERAL_LENGTH; x--; ) {
-                if (bitset->buffer[j] & (1 << x)) {
-                    iterator->offsets[k++] = BITSET_LITERAL_LENGTH * offset
-                        + BITSET_LITERAL_LENGTH - x - 1;
-                }
-            }
-        }
-        offset++;
-    }
+    bitset_cursor_t cursor;
+    bitset_cursor_init(&cursor, bitset);
+    for (size_t k = 0; bitset_cursor_next(&cursor, &iterator->offsets[k]); k++);
     return iterator;
 }
 
@@ -425,3 +1093,79 @@ void bitset_iterator_free(bitset_iterator_t *iterator) {
     bitset_malloc_free(iterator);
 }
 
+
+void bitset_cursor_init(bitset_cursor_t *cursor, const bitset_t *bitset) {
+    cursor->buffer = cursor->start = bitset->buffer;
+    cursor->end = bitset->buffer + bitset->length;
+    cursor->index = bitset->index;
+    cursor->next = 0;
+    cursor->offset = 0;
+    cursor->ones = 0;
+    cursor->word = 0;
+}
+
+bool bitset_cursor_next(bitset_cursor_t *cursor, bitset_offset *offset) {
+    if (!cursor->word && !bitset_cursor_load(cursor)) {
+        return false;
+    }
+    unsigned char bit = bitset_fls(cursor->word);
+    cursor->word ^= BITSET_CREATE_LITERAL(bit);
+    *offset = cursor->offset * BITSET_LITERAL_LENGTH + bit;
+    return true;
+}
+
+bool bitset_cursor_seek(bitset_cursor_t *cursor, bitset_offset bit, bitset_offset *offset) {
+    bitset_offset word_offset = bit / BITSET_LITERAL_LENGTH;
+    if (!cursor->word || cursor->offset < word_offset) {
+        cursor->word = 0;
+        if (cursor->ones && cursor->next < word_offset) {
+            if (cursor->next + cursor->ones > word_offset) {
+                //The offset is inside the current run of ones
+                cursor->ones -= word_offset - cursor->next;
+                cursor->next = word_offset;
+            } else {
+                cursor->next += cursor->ones;
+                cursor->ones = 0;
+            }
+        }
+        if (cursor->next < word_offset && cursor->index) {
+            bitset_offset relative = word_offset;
+            size_t word = bitset_index_seek(cursor->index, &relative);
+            if (cursor->start + word > cursor->buffer) {
+                cursor->buffer = cursor->start + word;
+                cursor->next = word_offset - relative;
+            }
+        }
+        bitset_offset span;
+        while (cursor->next < word_offset && cursor->buffer < cursor->end) {
+            span = bitset_word_span(*cursor->buffer);
+            if (cursor->next + span > word_offset) {
+                if (BITSET_IS_ONE_FILL(*cursor->buffer)) {
+                    cursor->ones = cursor->next + span - word_offset;
+                    cursor->next = word_offset;
+                    cursor->buffer++;
+                }
+                break;
+            }
+            cursor->next += span;
+            cursor->buffer++;
+        }
+        if (!bitset_cursor_load(cursor)) {
+            return false;
+        }
+    }
+    if (cursor->offset == word_offset) {
+        cursor->word &= ((bitset_word)1 << (BITSET_LITERAL_LENGTH - bit % BITSET_LITERAL_LENGTH)) - 1;
+    }
+    return bitset_cursor_next(cursor, offset);
+}
+
+size_t bitset_decode(const bitset_t *bitset, bitset_cursor_t *cursor,
+        bitset_offset *offsets, size_t capacity) {
+    bitset_cursor_t start;
+    if (!cursor) {
+        bitset_cursor_init(&start, bitset);
+        cursor = &start;
+    }
+    return bitset_kernel_decode(cursor, offsets, capacity);
+}
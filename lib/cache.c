@@ -0,0 +1,381 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef BITSET_NO_THREADS
+#include <pthread.h>
+#endif
+
+#include "bitset/malloc.h"
+#include "bitset/vector.h"
+#include "cache.h"
+
+uint64_t bitset_version_base = 0;
+
+/**
+ * Cached results are kept in a chained hash table and in a list ordered from
+ * the most to the least recently used result.
+ */
+
+typedef struct bitset_cache_entry_s {
+    uint64_t hash;
+    uint64_t *key;
+    size_t key_length;
+    bool is_vector;
+    union {
+        bitset_t *bitset;
+        bitset_vector_t *vector;
+    } value;
+    size_t bytes;
+    struct bitset_cache_entry_s *chain;
+    struct bitset_cache_entry_s *prev;
+    struct bitset_cache_entry_s *next;
+} bitset_cache_entry_t;
+
+struct bitset_cache_s {
+    bitset_cache_entry_t **buckets;
+    size_t size;
+    bitset_cache_entry_t *head;
+    bitset_cache_entry_t *tail;
+    size_t budget;
+    bitset_cache_stats_t stats;
+#ifndef BITSET_NO_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef BITSET_NO_THREADS
+#  define BITSET_CACHE_LOCK(cache)
+#  define BITSET_CACHE_UNLOCK(cache)
+#else
+#  define BITSET_CACHE_LOCK(cache) pthread_mutex_lock(&(cache)->lock)
+#  define BITSET_CACHE_UNLOCK(cache) pthread_mutex_unlock(&(cache)->lock)
+#endif
+
+#define BITSET_CACHE_MIN_BUCKETS 64
+
+static inline void bitset_cache_key_push(bitset_cache_key_t *key, uint64_t word) {
+    if (key->length == key->size) {
+        key->size = key->size ? key->size * 2 : 16;
+        key->words = bitset_realloc(key->words, sizeof(uint64_t) * key->size);
+        if (!key->words) {
+            bitset_oom();
+        }
+    }
+    key->words[key->length++] = word;
+    key->hash = (key->hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    key->hash ^= key->hash >> 29;
+}
+
+static inline void bitset_cache_key_init(bitset_cache_key_t *key, uint64_t kind) {
+    key->words = NULL;
+    key->length = 0;
+    key->size = 0;
+    key->hash = 0;
+    bitset_cache_key_push(key, kind);
+}
+
+static bool bitset_cache_key_push_operation(bitset_cache_key_t *key,
+        const bitset_operation_t *operation) {
+    const bitset_operation_step_t *step;
+    bitset_cache_key_push(key, operation->length);
+    for (size_t i = 0; i < operation->length; i++) {
+        step = operation->steps[i];
+        bitset_cache_key_push(key, step->type);
+        if (step->is_operation) {
+            bitset_cache_key_push(key, 1);
+            if (!bitset_cache_key_push_operation(key, step->data.nested)) {
+                return false;
+            }
+        } else if (!step->data.bitset.version) {
+            return false;
+        } else {
+            bitset_cache_key_push(key, 0);
+            bitset_cache_key_push(key, (uintptr_t) step->data.bitset.buffer);
+            bitset_cache_key_push(key, step->data.bitset.length);
+            bitset_cache_key_push(key, step->data.bitset.version);
+        }
+    }
+    return true;
+}
+
+bool bitset_cache_key_operation(bitset_cache_key_t *key, const bitset_operation_t *operation) {
+    bitset_cache_key_init(key, 'B');
+    return bitset_cache_key_push_operation(key, operation);
+}
+
+static bool bitset_cache_key_push_vector_operation(bitset_cache_key_t *key,
+        const bitset_vector_operation_t *operation) {
+    const bitset_vector_operation_step_t *step;
+    const bitset_vector_t *vector;
+    bitset_cache_key_push(key, operation->length);
+    for (size_t i = 0; i < operation->length; i++) {
+        step = operation->steps[i];
+        bitset_cache_key_push(key, step->type);
+        if (step->is_operation) {
+            bitset_cache_key_push(key, 1);
+            if (!bitset_cache_key_push_vector_operation(key, step->data.operation)) {
+                return false;
+            }
+            continue;
+        }
+        vector = step->data.vector;
+        if (!vector) {
+            //Unresolved data is treated as an empty vector
+            bitset_cache_key_push(key, 2);
+        } else if (!vector->version) {
+            return false;
+        } else {
+            bitset_cache_key_push(key, 0);
+            bitset_cache_key_push(key, (uintptr_t) vector->buffer);
+            bitset_cache_key_push(key, vector->length);
+            bitset_cache_key_push(key, vector->version);
+        }
+    }
+    return true;
+}
+
+bool bitset_cache_key_vector_operation(bitset_cache_key_t *key,
+        const bitset_vector_operation_t *operation) {
+    bitset_cache_key_init(key, 'V');
+    return bitset_cache_key_push_vector_operation(key, operation);
+}
+
+void bitset_cache_key_free(bitset_cache_key_t *key) {
+    if (key->words) {
+        bitset_malloc_free(key->words);
+        key->words = NULL;
+    }
+}
+
+bitset_cache_t *bitset_cache_new(size_t bytes) {
+    bitset_cache_t *cache = bitset_calloc(1, sizeof(bitset_cache_t));
+    if (!cache) {
+        bitset_oom();
+    }
+    cache->size = BITSET_CACHE_MIN_BUCKETS;
+    cache->buckets = bitset_calloc(1, sizeof(bitset_cache_entry_t *) * cache->size);
+    if (!cache->buckets) {
+        bitset_oom();
+    }
+    cache->budget = bytes;
+#ifndef BITSET_NO_THREADS
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
+    return cache;
+}
+
+static void bitset_cache_entry_free(bitset_cache_entry_t *entry) {
+    if (entry->is_vector) {
+        bitset_vector_free(entry->value.vector);
+    } else {
+        bitset_free(entry->value.bitset);
+    }
+    bitset_malloc_free(entry->key);
+    bitset_malloc_free(entry);
+}
+
+static void bitset_cache_unlink(bitset_cache_t *cache, bitset_cache_entry_t *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+static void bitset_cache_link(bitset_cache_t *cache, bitset_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void bitset_cache_evict(bitset_cache_t *cache, bitset_cache_entry_t *entry) {
+    bitset_cache_entry_t **bucket = &cache->buckets[entry->hash & (cache->size - 1)];
+    while (*bucket != entry) {
+        bucket = &(*bucket)->chain;
+    }
+    *bucket = entry->chain;
+    bitset_cache_unlink(cache, entry);
+    cache->stats.entries--;
+    cache->stats.bytes -= entry->bytes;
+    bitset_cache_entry_free(entry);
+}
+
+void bitset_cache_clear(bitset_cache_t *cache) {
+    BITSET_CACHE_LOCK(cache);
+    while (cache->tail) {
+        bitset_cache_evict(cache, cache->tail);
+    }
+    BITSET_CACHE_UNLOCK(cache);
+}
+
+void bitset_cache_free(bitset_cache_t *cache) {
+    bitset_cache_clear(cache);
+#ifndef BITSET_NO_THREADS
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    bitset_malloc_free(cache->buckets);
+    bitset_malloc_free(cache);
+}
+
+void bitset_cache_stats(bitset_cache_t *cache, bitset_cache_stats_t *stats) {
+    BITSET_CACHE_LOCK(cache);
+    *stats = cache->stats;
+    BITSET_CACHE_UNLOCK(cache);
+}
+
+/**
+ * Find a cached result and mark it as the most recently used. The cache must
+ * be locked.
+ */
+
+static bitset_cache_entry_t *bitset_cache_find(bitset_cache_t *cache,
+        const bitset_cache_key_t *key, bool is_vector) {
+    bitset_cache_entry_t *entry = cache->buckets[key->hash & (cache->size - 1)];
+    for (; entry; entry = entry->chain) {
+        if (entry->hash == key->hash && entry->is_vector == is_vector
+                && entry->key_length == key->length
+                && !memcmp(entry->key, key->words, sizeof(uint64_t) * key->length)) {
+            break;
+        }
+    }
+    if (entry) {
+        cache->stats.hits++;
+        if (entry != cache->head) {
+            bitset_cache_unlink(cache, entry);
+            bitset_cache_link(cache, entry);
+        }
+    } else {
+        cache->stats.misses++;
+    }
+    return entry;
+}
+
+static void bitset_cache_grow(bitset_cache_t *cache) {
+    size_t size = cache->size * 2;
+    bitset_cache_entry_t **buckets = bitset_calloc(1, sizeof(bitset_cache_entry_t *) * size);
+    bitset_cache_entry_t *entry, *chain;
+    if (!buckets) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < cache->size; i++) {
+        for (entry = cache->buckets[i]; entry; entry = chain) {
+            chain = entry->chain;
+            entry->chain = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+        }
+    }
+    bitset_malloc_free(cache->buckets);
+    cache->buckets = buckets;
+    cache->size = size;
+}
+
+/**
+ * Insert an entry unless the key was cached in the meantime, then evict the
+ * least recently used results until the cache is within its budget.
+ */
+
+static void bitset_cache_insert(bitset_cache_t *cache, bitset_cache_key_t *key,
+        bitset_cache_entry_t *entry) {
+    bitset_cache_entry_t **bucket, *existing;
+    entry->hash = key->hash;
+    entry->key = key->words;
+    entry->key_length = key->length;
+    key->words = NULL;
+    BITSET_CACHE_LOCK(cache);
+    bucket = &cache->buckets[entry->hash & (cache->size - 1)];
+    for (existing = *bucket; existing; existing = existing->chain) {
+        if (existing->hash == entry->hash && existing->is_vector == entry->is_vector
+                && existing->key_length == entry->key_length
+                && !memcmp(existing->key, entry->key, sizeof(uint64_t) * entry->key_length)) {
+            BITSET_CACHE_UNLOCK(cache);
+            bitset_cache_entry_free(entry);
+            return;
+        }
+    }
+    entry->chain = *bucket;
+    *bucket = entry;
+    bitset_cache_link(cache, entry);
+    cache->stats.entries++;
+    cache->stats.bytes += entry->bytes;
+    while (cache->stats.bytes > cache->budget) {
+        bitset_cache_evict(cache, cache->tail);
+        cache->stats.evictions++;
+    }
+    if (cache->stats.entries > cache->size) {
+        bitset_cache_grow(cache);
+    }
+    BITSET_CACHE_UNLOCK(cache);
+}
+
+/**
+ * Create an entry for a result of the specified size, or return NULL if the
+ * result is too large to be cached.
+ */
+
+static bitset_cache_entry_t *bitset_cache_entry_new(const bitset_cache_t *cache,
+        const bitset_cache_key_t *key, size_t bytes, bool is_vector) {
+    bitset_cache_entry_t *entry;
+    bytes += sizeof(bitset_cache_entry_t) + sizeof(uint64_t) * key->length;
+    if (bytes > cache->budget) {
+        return NULL;
+    }
+    entry = bitset_malloc(sizeof(bitset_cache_entry_t));
+    if (!entry) {
+        bitset_oom();
+    }
+    entry->is_vector = is_vector;
+    entry->bytes = bytes;
+    return entry;
+}
+
+bitset_t *bitset_cache_get(bitset_cache_t *cache, const bitset_cache_key_t *key) {
+    bitset_cache_entry_t *entry;
+    bitset_t *result = NULL;
+    BITSET_CACHE_LOCK(cache);
+    if ((entry = bitset_cache_find(cache, key, false))) {
+        result = bitset_copy(entry->value.bitset);
+    }
+    BITSET_CACHE_UNLOCK(cache);
+    return result;
+}
+
+bitset_vector_t *bitset_cache_get_vector(bitset_cache_t *cache, const bitset_cache_key_t *key) {
+    bitset_cache_entry_t *entry;
+    bitset_vector_t *result = NULL;
+    BITSET_CACHE_LOCK(cache);
+    if ((entry = bitset_cache_find(cache, key, true))) {
+        result = bitset_vector_copy(entry->value.vector);
+    }
+    BITSET_CACHE_UNLOCK(cache);
+    return result;
+}
+
+void bitset_cache_put(bitset_cache_t *cache, bitset_cache_key_t *key, const bitset_t *bitset) {
+    bitset_cache_entry_t *entry = bitset_cache_entry_new(cache, key, sizeof(bitset_t)
+        + sizeof(bitset_word) * bitset->length + (bitset->meta ? sizeof(bitset_meta_t) : 0), false);
+    if (entry) {
+        entry->value.bitset = bitset_copy(bitset);
+        bitset_cache_insert(cache, key, entry);
+    }
+}
+
+void bitset_cache_put_vector(bitset_cache_t *cache, bitset_cache_key_t *key,
+        const bitset_vector_t *vector) {
+    bitset_cache_entry_t *entry = bitset_cache_entry_new(cache, key,
+        sizeof(bitset_vector_t) + vector->length, true);
+    if (entry) {
+        entry->value.vector = bitset_vector_copy(vector);
+        bitset_cache_insert(cache, key, entry);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef BITSET_CACHE_H_
+#define BITSET_CACHE_H_
+
+#include "bitset/vector.h"
+
+/**
+ * Bitsets and vectors take a new version base when they're created and
+ * increment their version when they're modified, so that versions are unique
+ * across operands. A version of zero means that the operand isn't versioned,
+ * e.g. a buffer added to an operation directly, and can't be cached.
+ */
+
+#define BITSET_VERSION_SHIFT 32
+
+extern uint64_t bitset_version_base;
+
+static inline uint64_t bitset_version_new(void) {
+#ifdef BITSET_NO_THREADS
+    return ++bitset_version_base << BITSET_VERSION_SHIFT;
+#else
+    return __sync_add_and_fetch(&bitset_version_base, 1) << BITSET_VERSION_SHIFT;
+#endif
+}
+
+/**
+ * Cache keys describe the structure of an operation, i.e. the type of each
+ * step, and the identity and version of each operand.
+ */
+
+typedef struct bitset_cache_key_s {
+    uint64_t *words;
+    size_t length;
+    size_t size;
+    uint64_t hash;
+} bitset_cache_key_t;
+
+/**
+ * Build the key for an operation. Returns false if the operation can't
+ * be cached.
+ */
+
+bool bitset_cache_key_operation(bitset_cache_key_t *, const bitset_operation_t *);
+bool bitset_cache_key_vector_operation(bitset_cache_key_t *, const bitset_vector_operation_t *);
+
+void bitset_cache_key_free(bitset_cache_key_t *);
+
+/**
+ * Get a copy of a cached result, or NULL if the key isn't cached.
+ */
+
+bitset_t *bitset_cache_get(bitset_cache_t *, const bitset_cache_key_t *);
+bitset_vector_t *bitset_cache_get_vector(bitset_cache_t *, const bitset_cache_key_t *);
+
+/**
+ * Cache a copy of a result. The key's words are moved into the cache.
+ */
+
+void bitset_cache_put(bitset_cache_t *, bitset_cache_key_t *, const bitset_t *);
+void bitset_cache_put_vector(bitset_cache_t *, bitset_cache_key_t *, const bitset_vector_t *);
+
+#endif
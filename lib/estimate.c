@@ -4,6 +4,8 @@
 
 #include "bitset/malloc.h"
 #include "bitset/estimate.h"
+#include "kernel.h"
+#include "stream.h"
 
 bitset_linear_t *bitset_linear_new(size_t size) {
     bitset_linear_t *counter = bitset_malloc(sizeof(bitset_linear_t));
@@ -23,31 +25,19 @@ bitset_linear_t *bitset_linear_new(size_t size) {
 }
 
 void bitset_linear_add(bitset_linear_t *counter, const bitset_t *bitset) {
-    bitset_offset offset = 0;
-    bitset_word word, mask, tmp;
-    unsigned position;
+    bitset_word word, tmp;
     unsigned offset_mask = counter->size - 1;
-    for (size_t i = 0; i < bitset->length; i++) {
-        word = bitset->buffer[i];
-        if (BITSET_IS_FILL_WORD(word)) {
-            offset += BITSET_GET_LENGTH(word);
-            position = BITSET_GET_POSITION(word);
-            if (!position) {
-                continue;
-            }
-            mask = BITSET_CREATE_LITERAL(position - 1);
-            if ((counter->words[offset & offset_mask] & mask) == 0) {
-                counter->count++;
-                counter->words[offset & offset_mask] |= mask;
-            }
-        } else {
-            tmp = counter->words[offset & offset_mask];
-            counter->words[offset & offset_mask] |= word;
-            word &= ~tmp;
-            BITSET_POP_COUNT(counter->count, word);
-        }
-        offset++;
+    bitset_reader_t reader;
+    bitset_kernel_batch_t batch;
+    bitset_kernel_batch_init(&batch);
+    bitset_reader_init(&reader, bitset->buffer, bitset->length);
+    while (bitset_reader_next(&reader)) {
+        word = reader.word;
+        tmp = counter->words[reader.offset & offset_mask];
+        counter->words[reader.offset & offset_mask] |= word;
+        bitset_kernel_batch_push(&batch, word & ~tmp);
     }
+    counter->count += bitset_kernel_batch_count(&batch);
 }
 
 unsigned bitset_linear_count(const bitset_linear_t *counter) {
@@ -85,40 +75,25 @@ bitset_countn_t *bitset_countn_new(unsigned n, size_t size) {
 }
 
 void bitset_countn_add(bitset_countn_t *counter, const bitset_t *bitset) {
-    bitset_offset offset = 0;
     bitset_word word, tmp;
-    unsigned position;
     unsigned offset_mask = counter->size - 1;
-    for (size_t i = 0; i < bitset->length; i++) {
-        word = bitset->buffer[i];
-        if (BITSET_IS_FILL_WORD(word)) {
-            offset += BITSET_GET_LENGTH(word);
-            position = BITSET_GET_POSITION(word);
-            if (!position) {
-                continue;
-            }
-            word = BITSET_CREATE_LITERAL(position - 1);
-        }
+    bitset_reader_t reader;
+    bitset_reader_init(&reader, bitset->buffer, bitset->length);
+    while (bitset_reader_next(&reader)) {
+        word = reader.word;
         for (size_t n = 0; n <= counter->n; n++) {
-            tmp = word & counter->words[n][offset & offset_mask];
-            counter->words[n][offset & offset_mask] |= word;
+            tmp = word & counter->words[n][reader.offset & offset_mask];
+            counter->words[n][reader.offset & offset_mask] |= word;
             word = tmp;
         }
-        offset++;
     }
 }
 
 unsigned bitset_countn_count(const bitset_countn_t *counter) {
-    unsigned count = 0, nth = counter->n - 1, last = counter->n;
-    bitset_word word;
+    unsigned nth = counter->n - 1, last = counter->n;
     //Find bits that occur in the Nth bitset, but not the N+1th bitset
-    for (size_t offset = 0; offset < counter->size; offset++) {
-        word = counter->words[nth][offset] & ~counter->words[last][offset];
-        if (word) {
-            BITSET_POP_COUNT(count, word);
-        }
-    }
-    return count;
+    return bitset_kernel_popcount_andnot(counter->words[nth], counter->words[last],
+        NULL, counter->size);
 }
 
 unsigned *bitset_countn_count_all(const bitset_countn_t *counter) {
@@ -126,14 +101,9 @@ unsigned *bitset_countn_count_all(const bitset_countn_t *counter) {
     if (!counts) {
         bitset_oom();
     }
-    bitset_word word;
-    for (size_t offset = 0; offset < counter->size; offset++) {
-        for (size_t n = 1; n <= counter->n; n++) {
-            word = counter->words[n-1][offset] & ~counter->words[n][offset];
-            if (word) {
-                BITSET_POP_COUNT(counts[n-1], word);
-            }
-        }
+    for (size_t n = 1; n <= counter->n; n++) {
+        counts[n-1] = bitset_kernel_popcount_andnot(counter->words[n-1],
+            counter->words[n], NULL, counter->size);
     }
     return counts;
 }
@@ -143,38 +113,18 @@ unsigned *bitset_countn_count_mask(const bitset_countn_t *counter, const bitset_
     if (!mask_words) {
         bitset_oom();
     }
-    bitset_offset offset = 0;
-    bitset_word word, mask_word;
-    unsigned position;
-    for (size_t i = 0; i < mask->length; i++) {
-        mask_word = mask->buffer[i];
-        if (BITSET_IS_FILL_WORD(mask_word)) {
-            offset += BITSET_GET_LENGTH(mask_word);
-            if (offset >= counter->size) {
-                offset %= counter->size;
-            }
-            position = BITSET_GET_POSITION(mask_word);
-            if (!position) {
-                continue;
-            }
-            mask_word = BITSET_CREATE_LITERAL(position - 1);
-        }
-        mask_words[offset] |= mask_word;
-        offset++;
-        if (offset >= counter->size) {
-            offset -= counter->size;
-        }
+    bitset_reader_t reader;
+    bitset_reader_init(&reader, mask->buffer, mask->length);
+    while (bitset_reader_next(&reader)) {
+        mask_words[reader.offset % counter->size] |= reader.word;
     }
     unsigned *counts = bitset_calloc(1, sizeof(unsigned) * counter->n);
     if (!counts) {
         bitset_oom();
     }
-    for (size_t offset = 0; offset < counter->size; offset++) {
-        for (size_t n = 1; n <= counter->n; n++) {
-            word = counter->words[n-1][offset] & ~counter->words[n][offset];
-            word &= mask_words[offset];
-            BITSET_POP_COUNT(counts[n-1], word);
-        }
+    for (size_t n = 1; n <= counter->n; n++) {
+        counts[n-1] = bitset_kernel_popcount_andnot(counter->words[n-1],
+            counter->words[n], mask_words, counter->size);
     }
     bitset_malloc_free(mask_words);
     return counts;
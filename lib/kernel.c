@@ -0,0 +1,560 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef BITSET_NO_THREADS
+#  include <pthread.h>
+#endif
+
+#include "bitset/malloc.h"
+#include "kernel.h"
+#include "stream.h"
+
+#ifdef BITSET_KERNEL_X86
+#  include <immintrin.h>
+#endif
+
+/**
+ * Literal expansion writes a whole word's worth of offsets at a time, which
+ * may overshoot the bits that are actually set. Only expand a word when the
+ * caller's buffer has this much room left.
+ */
+
+#define BITSET_DECODE_SLACK BITSET_WORD_LENGTH
+
+static inline size_t bitset_kernel_expand_partial(bitset_cursor_t *cursor,
+        bitset_offset *offsets, size_t capacity) {
+    bitset_offset base = cursor->offset * BITSET_LITERAL_LENGTH;
+    size_t count = 0;
+    unsigned char bit;
+    while (cursor->word && count < capacity) {
+        bit = bitset_stream_fls(cursor->word);
+        cursor->word ^= BITSET_CREATE_LITERAL(bit);
+        offsets[count++] = base + bit;
+    }
+    return count;
+}
+
+static inline size_t bitset_kernel_expand(bitset_word word, bitset_offset base,
+        bitset_offset *offsets) {
+    size_t count = 0;
+    unsigned char bit;
+    while (word) {
+        bit = bitset_stream_fls(word);
+        word ^= BITSET_CREATE_LITERAL(bit);
+        offsets[count++] = base + bit;
+    }
+    return count;
+}
+
+#define BITSET_KERNEL_DECODE(name, expand, attr) \
+    static attr size_t name(bitset_cursor_t *cursor, bitset_offset *offsets, size_t capacity) { \
+        size_t count = 0; \
+        while (count < capacity && (cursor->word || bitset_cursor_load(cursor))) { \
+            if (capacity - count < BITSET_DECODE_SLACK) { \
+                count += bitset_kernel_expand_partial(cursor, offsets + count, capacity - count); \
+            } else { \
+                count += expand(cursor->word, cursor->offset * BITSET_LITERAL_LENGTH, \
+                    offsets + count); \
+                cursor->word = 0; \
+            } \
+        } \
+        return count; \
+    }
+
+BITSET_KERNEL_DECODE(bitset_kernel_decode_generic, bitset_kernel_expand, )
+
+#ifdef BITSET_KERNEL_X86
+
+/**
+ * Offsets are expanded 8 bits at a time using a table of the positions of
+ * the set bits in each byte, most significant bit first. Single-bit words,
+ * which are the norm in sparse bitsets, skip the table.
+ */
+
+static uint8_t bitset_decode_table[256][8];
+static uint8_t bitset_decode_count[256];
+
+static void bitset_decode_table_init(void) {
+    for (unsigned byte = 0; byte < 256; byte++) {
+        unsigned count = 0;
+        for (unsigned position = 0; position < 8; position++) {
+            if (byte & (0x80 >> position)) {
+                bitset_decode_table[byte][count++] = position;
+            }
+        }
+        bitset_decode_count[byte] = count;
+    }
+}
+
+static inline __attribute__((target("avx2")))
+size_t bitset_kernel_expand_avx2(bitset_word word, bitset_offset base, bitset_offset *offsets) {
+    size_t count = 0;
+    unsigned byte;
+    if (BITSET_IS_POW2(word)) {
+        offsets[0] = base + bitset_stream_fls(word);
+        return 1;
+    }
+    word <<= 1;
+    for (unsigned shift = BITSET_WORD_LENGTH - 8; ; shift -= 8, base += 8) {
+        byte = (word >> shift) & 0xFF;
+        if (byte) {
+#ifndef BITSET_64BIT_OFFSETS
+            __m256i positions = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i *)bitset_decode_table[byte]));
+            _mm256_storeu_si256((__m256i *)(offsets + count),
+                _mm256_add_epi32(positions, _mm256_set1_epi32(base)));
+#else
+            __m256i bases = _mm256_set1_epi64x(base);
+            __m128i positions = _mm_loadl_epi64((const __m128i *)bitset_decode_table[byte]);
+            _mm256_storeu_si256((__m256i *)(offsets + count),
+                _mm256_add_epi64(_mm256_cvtepu8_epi64(positions), bases));
+            _mm256_storeu_si256((__m256i *)(offsets + count + 4),
+                _mm256_add_epi64(_mm256_cvtepu8_epi64(_mm_srli_si128(positions, 4)), bases));
+#endif
+            count += bitset_decode_count[byte];
+        }
+        if (!shift) {
+            break;
+        }
+    }
+    return count;
+}
+
+BITSET_KERNEL_DECODE(bitset_kernel_decode_avx2, bitset_kernel_expand_avx2,
+    __attribute__((target("avx2"))))
+
+#endif
+
+/**
+ * Population counts. The compressed count treats literals as usual, counts
+ * one bit for each fill that carries a position and a full word of bits for
+ * each word spanned by a one-fill. Each loop is written branch-free so that
+ * mixed runs of fills and literals don't thrash the branch predictor.
+ */
+
+#define BITSET_KERNEL_FILL_MASK(word) \
+    ((bitset_word)0 - ((word) >> (BITSET_WORD_LENGTH - 1)))
+
+#define BITSET_KERNEL_ONES(word) ((bitset_offset)(BITSET_GET_LENGTH(word) \
+    & ((bitset_word)0 - BITSET_IS_ONE_FILL(word))) * BITSET_LITERAL_LENGTH)
+
+/**
+ * Count the bits in the one-fills of a compressed buffer. The vector kernels
+ * map one-fills to empty words and add this separately.
+ */
+
+static inline bitset_offset bitset_kernel_ones(const bitset_word *buffer, size_t length) {
+    bitset_offset count = 0;
+    for (size_t i = 0; i < length; i++) {
+        count += BITSET_KERNEL_ONES(buffer[i]);
+    }
+    return count;
+}
+
+#define BITSET_KERNEL_POPCOUNT(name, pop_count, attr) \
+    static attr bitset_offset name##_count(const bitset_word *buffer, size_t length) { \
+        bitset_offset count = 0; \
+        bitset_word word, mask; \
+        for (size_t i = 0; i < length; i++) { \
+            mask = BITSET_KERNEL_FILL_MASK(buffer[i]); \
+            count += (buffer[i] & mask & BITSET_POSITION_MASK) != 0; \
+            count += BITSET_KERNEL_ONES(buffer[i]); \
+            word = buffer[i] & ~mask; \
+            pop_count(count, word); \
+        } \
+        return count; \
+    } \
+    static attr bitset_offset name##_popcount(const bitset_word *words, size_t length) { \
+        bitset_offset count = 0; \
+        bitset_word word; \
+        for (size_t i = 0; i < length; i++) { \
+            word = words[i]; \
+            pop_count(count, word); \
+        } \
+        return count; \
+    } \
+    static attr bitset_offset name##_popcount_andnot(const bitset_word *a, \
+            const bitset_word *b, const bitset_word *mask, size_t length) { \
+        bitset_offset count = 0; \
+        bitset_word word; \
+        for (size_t i = 0; i < length; i++) { \
+            word = a[i] & ~b[i]; \
+            if (mask) { \
+                word &= mask[i]; \
+            } \
+            pop_count(count, word); \
+        } \
+        return count; \
+    }
+
+BITSET_KERNEL_POPCOUNT(bitset_kernel_generic, BITSET_POP_COUNT, )
+
+#ifdef BITSET_KERNEL_X86
+
+#ifndef BITSET_64BIT_WORDS
+#  define BITSET_KERNEL_POPCNT(c, w) c += __builtin_popcount(w)
+#else
+#  define BITSET_KERNEL_POPCNT(c, w) c += __builtin_popcountll(w)
+#endif
+
+BITSET_KERNEL_POPCOUNT(bitset_kernel_popcnt, BITSET_KERNEL_POPCNT, __attribute__((target("popcnt"))))
+
+/**
+ * The AVX2 kernels use the Harley-Seal carry-save adder network to reduce
+ * 16 vectors at a time into a handful of vector popcounts, which are done
+ * with a nibble lookup table.
+ */
+
+enum bitset_kernel_load {
+    BITSET_LOAD_COMPRESSED,
+    BITSET_LOAD_RAW,
+    BITSET_LOAD_ANDNOT,
+    BITSET_LOAD_ANDNOT_MASK
+};
+
+#define BITSET_AVX2 __attribute__((target("avx2"), always_inline))
+
+#ifndef BITSET_64BIT_WORDS
+#  define BITSET_AVX2_LANES 8
+#  define BITSET_AVX2_SET1(x) _mm256_set1_epi32(x)
+#  define BITSET_AVX2_SRLI(v, n) _mm256_srli_epi32(v, n)
+#  define BITSET_AVX2_CMPGT(a, b) _mm256_cmpgt_epi32(a, b)
+#else
+#  define BITSET_AVX2_LANES 4
+#  define BITSET_AVX2_SET1(x) _mm256_set1_epi64x(x)
+#  define BITSET_AVX2_SRLI(v, n) _mm256_srli_epi64(v, n)
+#  define BITSET_AVX2_CMPGT(a, b) _mm256_cmpgt_epi64(a, b)
+#endif
+
+static inline BITSET_AVX2 __m256i bitset_avx2_popcount(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+        _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+static inline BITSET_AVX2 void bitset_avx2_csa(__m256i *h, __m256i *l,
+        __m256i a, __m256i b, __m256i c) {
+    __m256i u = _mm256_xor_si256(a, b);
+    *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    *l = _mm256_xor_si256(u, c);
+}
+
+/**
+ * Load a vector of words. Compressed words are mapped so that each literal
+ * keeps its bits and each fill becomes a single bit if it carries a position.
+ * One-fills never carry a position, so they become empty words.
+ */
+
+static inline BITSET_AVX2 __m256i bitset_avx2_load(enum bitset_kernel_load load,
+        const bitset_word *a, const bitset_word *b, const bitset_word *mask, size_t i) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    switch (load) {
+        case BITSET_LOAD_COMPRESSED: {
+            __m256i zero = _mm256_setzero_si256();
+            __m256i fill = BITSET_AVX2_CMPGT(zero, v);
+            __m256i position = _mm256_and_si256(BITSET_AVX2_CMPGT(BITSET_AVX2_SRLI(
+                _mm256_and_si256(v, BITSET_AVX2_SET1(BITSET_POSITION_MASK)), BITSET_SPAN_LENGTH),
+                zero), BITSET_AVX2_SET1(1));
+            return _mm256_or_si256(_mm256_andnot_si256(fill, v), _mm256_and_si256(fill, position));
+        }
+        case BITSET_LOAD_ANDNOT:
+            return _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(b + i)), v);
+        case BITSET_LOAD_ANDNOT_MASK:
+            return _mm256_and_si256(_mm256_andnot_si256(
+                _mm256_loadu_si256((const __m256i *)(b + i)), v),
+                _mm256_loadu_si256((const __m256i *)(mask + i)));
+        default:
+            return v;
+    }
+}
+
+static inline BITSET_AVX2 bitset_offset bitset_avx2_harley_seal(enum bitset_kernel_load load,
+        const bitset_word *a, const bitset_word *b, const bitset_word *mask, size_t length) {
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256(), twos = ones, fours = ones, eights = ones, sixteens;
+    __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+    size_t i = 0, vectors = length / BITSET_AVX2_LANES;
+    for (; i + 16 <= vectors; i += 16) {
+#define BITSET_LOAD(n) bitset_avx2_load(load, a, b, mask, (i + n) * BITSET_AVX2_LANES)
+        bitset_avx2_csa(&twos_a, &ones, ones, BITSET_LOAD(0), BITSET_LOAD(1));
+        bitset_avx2_csa(&twos_b, &ones, ones, BITSET_LOAD(2), BITSET_LOAD(3));
+        bitset_avx2_csa(&fours_a, &twos, twos, twos_a, twos_b);
+        bitset_avx2_csa(&twos_a, &ones, ones, BITSET_LOAD(4), BITSET_LOAD(5));
+        bitset_avx2_csa(&twos_b, &ones, ones, BITSET_LOAD(6), BITSET_LOAD(7));
+        bitset_avx2_csa(&fours_b, &twos, twos, twos_a, twos_b);
+        bitset_avx2_csa(&eights_a, &fours, fours, fours_a, fours_b);
+        bitset_avx2_csa(&twos_a, &ones, ones, BITSET_LOAD(8), BITSET_LOAD(9));
+        bitset_avx2_csa(&twos_b, &ones, ones, BITSET_LOAD(10), BITSET_LOAD(11));
+        bitset_avx2_csa(&fours_a, &twos, twos, twos_a, twos_b);
+        bitset_avx2_csa(&twos_a, &ones, ones, BITSET_LOAD(12), BITSET_LOAD(13));
+        bitset_avx2_csa(&twos_b, &ones, ones, BITSET_LOAD(14), BITSET_LOAD(15));
+        bitset_avx2_csa(&fours_b, &twos, twos, twos_a, twos_b);
+        bitset_avx2_csa(&eights_b, &fours, fours, fours_a, fours_b);
+        bitset_avx2_csa(&sixteens, &eights, eights, eights_a, eights_b);
+#undef BITSET_LOAD
+        total = _mm256_add_epi64(total, bitset_avx2_popcount(sixteens));
+    }
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(bitset_avx2_popcount(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(bitset_avx2_popcount(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(bitset_avx2_popcount(twos), 1));
+    total = _mm256_add_epi64(total, bitset_avx2_popcount(ones));
+    for (; i < vectors; i++) {
+        total = _mm256_add_epi64(total, bitset_avx2_popcount(
+            bitset_avx2_load(load, a, b, mask, i * BITSET_AVX2_LANES)));
+    }
+    bitset_offset count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+        + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    i *= BITSET_AVX2_LANES;
+    switch (load) {
+        case BITSET_LOAD_COMPRESSED:
+            return count + bitset_kernel_ones(a, i) + bitset_kernel_popcnt_count(a + i, length - i);
+        case BITSET_LOAD_ANDNOT:
+        case BITSET_LOAD_ANDNOT_MASK:
+            return count + bitset_kernel_popcnt_popcount_andnot(a + i, b + i,
+                mask ? mask + i : NULL, length - i);
+        default:
+            return count + bitset_kernel_popcnt_popcount(a + i, length - i);
+    }
+}
+
+static __attribute__((target("avx2,popcnt")))
+bitset_offset bitset_kernel_avx2_count(const bitset_word *buffer, size_t length) {
+    return bitset_avx2_harley_seal(BITSET_LOAD_COMPRESSED, buffer, NULL, NULL, length);
+}
+
+static __attribute__((target("avx2,popcnt")))
+bitset_offset bitset_kernel_avx2_popcount(const bitset_word *words, size_t length) {
+    return bitset_avx2_harley_seal(BITSET_LOAD_RAW, words, NULL, NULL, length);
+}
+
+static __attribute__((target("avx2,popcnt")))
+bitset_offset bitset_kernel_avx2_popcount_andnot(const bitset_word *a,
+        const bitset_word *b, const bitset_word *mask, size_t length) {
+    if (mask) {
+        return bitset_avx2_harley_seal(BITSET_LOAD_ANDNOT_MASK, a, b, mask, length);
+    }
+    return bitset_avx2_harley_seal(BITSET_LOAD_ANDNOT, a, b, NULL, length);
+}
+
+#ifndef BITSET_NO_AVX512
+
+/**
+ * AVX-512 has a native vector popcount (VPOPCNTDQ). Tails are handled with
+ * masked loads.
+ */
+
+#define BITSET_AVX512 __attribute__((target("avx512f,avx512vpopcntdq"), always_inline))
+
+#ifndef BITSET_64BIT_WORDS
+#  define BITSET_AVX512_LANES 16
+#  define BITSET_AVX512_LOAD(m, p) _mm512_maskz_loadu_epi32(m, p)
+#  define BITSET_AVX512_SET1(x) _mm512_set1_epi32(x)
+#  define BITSET_AVX512_SRLI(v, n) _mm512_srli_epi32(v, n)
+#  define BITSET_AVX512_MIN(a, b) _mm512_min_epu32(a, b)
+#  define BITSET_AVX512_SIGNS(v) _mm512_cmplt_epi32_mask(v, _mm512_setzero_si512())
+#  define BITSET_AVX512_BLEND(m, a, b) _mm512_mask_blend_epi32(m, a, b)
+typedef __mmask16 bitset_avx512_mask;
+#else
+#  define BITSET_AVX512_LANES 8
+#  define BITSET_AVX512_LOAD(m, p) _mm512_maskz_loadu_epi64(m, p)
+#  define BITSET_AVX512_SET1(x) _mm512_set1_epi64(x)
+#  define BITSET_AVX512_SRLI(v, n) _mm512_srli_epi64(v, n)
+#  define BITSET_AVX512_MIN(a, b) _mm512_min_epu64(a, b)
+#  define BITSET_AVX512_SIGNS(v) _mm512_cmplt_epi64_mask(v, _mm512_setzero_si512())
+#  define BITSET_AVX512_BLEND(m, a, b) _mm512_mask_blend_epi64(m, a, b)
+typedef __mmask8 bitset_avx512_mask;
+#endif
+
+static inline BITSET_AVX512 __m512i bitset_avx512_load(enum bitset_kernel_load load,
+        const bitset_word *a, const bitset_word *b, const bitset_word *mask,
+        size_t i, bitset_avx512_mask lanes) {
+    __m512i v = BITSET_AVX512_LOAD(lanes, a + i);
+    switch (load) {
+        case BITSET_LOAD_COMPRESSED: {
+            __m512i position = BITSET_AVX512_MIN(BITSET_AVX512_SRLI(_mm512_and_si512(v,
+                BITSET_AVX512_SET1(BITSET_POSITION_MASK)), BITSET_SPAN_LENGTH), BITSET_AVX512_SET1(1));
+            return BITSET_AVX512_BLEND(BITSET_AVX512_SIGNS(v), v, position);
+        }
+        case BITSET_LOAD_ANDNOT:
+            return _mm512_andnot_si512(BITSET_AVX512_LOAD(lanes, b + i), v);
+        case BITSET_LOAD_ANDNOT_MASK:
+            return _mm512_and_si512(_mm512_andnot_si512(
+                BITSET_AVX512_LOAD(lanes, b + i), v),
+                BITSET_AVX512_LOAD(lanes, mask + i));
+        default:
+            return v;
+    }
+}
+
+static inline BITSET_AVX512 bitset_offset bitset_avx512_popcount(enum bitset_kernel_load load,
+        const bitset_word *a, const bitset_word *b, const bitset_word *mask, size_t length) {
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + BITSET_AVX512_LANES <= length; i += BITSET_AVX512_LANES) {
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(
+            bitset_avx512_load(load, a, b, mask, i, (bitset_avx512_mask)~0)));
+    }
+    if (i < length) {
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(bitset_avx512_load(load,
+            a, b, mask, i, (bitset_avx512_mask)((1U << (length - i)) - 1))));
+    }
+    return _mm512_reduce_add_epi64(total);
+}
+
+static __attribute__((target("avx512f,avx512vpopcntdq")))
+bitset_offset bitset_kernel_avx512_count(const bitset_word *buffer, size_t length) {
+    return bitset_avx512_popcount(BITSET_LOAD_COMPRESSED, buffer, NULL, NULL, length)
+        + bitset_kernel_ones(buffer, length);
+}
+
+static __attribute__((target("avx512f,avx512vpopcntdq")))
+bitset_offset bitset_kernel_avx512_popcount(const bitset_word *words, size_t length) {
+    return bitset_avx512_popcount(BITSET_LOAD_RAW, words, NULL, NULL, length);
+}
+
+static __attribute__((target("avx512f,avx512vpopcntdq")))
+bitset_offset bitset_kernel_avx512_popcount_andnot(const bitset_word *a,
+        const bitset_word *b, const bitset_word *mask, size_t length) {
+    if (mask) {
+        return bitset_avx512_popcount(BITSET_LOAD_ANDNOT_MASK, a, b, mask, length);
+    }
+    return bitset_avx512_popcount(BITSET_LOAD_ANDNOT, a, b, NULL, length);
+}
+
+#endif
+#endif
+
+static enum bitset_kernel bitset_kernel_supported(void) {
+#ifdef BITSET_KERNEL_X86
+    __builtin_cpu_init();
+#ifndef BITSET_NO_AVX512
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        return BITSET_KERNEL_AVX512;
+    }
+#endif
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return BITSET_KERNEL_AVX2;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return BITSET_KERNEL_POPCNT;
+    }
+#endif
+    return BITSET_KERNEL_GENERIC;
+}
+
+static enum bitset_kernel bitset_kernel_set(enum bitset_kernel kernel);
+
+/**
+ * The decode table is built and the best kernels are selected exactly once,
+ * even if several threads use a kernel for the first time at once.
+ */
+
+static void bitset_kernel_init(void) {
+#ifdef BITSET_KERNEL_X86
+    bitset_decode_table_init();
+#endif
+    bitset_kernel_set(BITSET_KERNEL_BEST);
+}
+
+#ifdef BITSET_NO_THREADS
+
+static bool bitset_kernel_ready = false;
+
+static inline void bitset_kernel_resolve(void) {
+    if (!bitset_kernel_ready) {
+        bitset_kernel_ready = true;
+        bitset_kernel_init();
+    }
+}
+
+#else
+
+static pthread_once_t bitset_kernel_once = PTHREAD_ONCE_INIT;
+
+static inline void bitset_kernel_resolve(void) {
+    pthread_once(&bitset_kernel_once, bitset_kernel_init);
+}
+
+#endif
+
+static size_t bitset_kernel_decode_resolve(bitset_cursor_t *cursor,
+        bitset_offset *offsets, size_t capacity) {
+    bitset_kernel_resolve();
+    return bitset_kernel_decode(cursor, offsets, capacity);
+}
+
+static bitset_offset bitset_kernel_count_resolve(const bitset_word *buffer, size_t length) {
+    bitset_kernel_resolve();
+    return bitset_kernel_count(buffer, length);
+}
+
+static bitset_offset bitset_kernel_popcount_resolve(const bitset_word *words, size_t length) {
+    bitset_kernel_resolve();
+    return bitset_kernel_popcount(words, length);
+}
+
+static bitset_offset bitset_kernel_popcount_andnot_resolve(const bitset_word *a,
+        const bitset_word *b, const bitset_word *mask, size_t length) {
+    bitset_kernel_resolve();
+    return bitset_kernel_popcount_andnot(a, b, mask, length);
+}
+
+size_t (*bitset_kernel_decode_fn)(bitset_cursor_t *, bitset_offset *, size_t)
+    = bitset_kernel_decode_resolve;
+
+bitset_offset (*bitset_kernel_count_fn)(const bitset_word *, size_t)
+    = bitset_kernel_count_resolve;
+
+bitset_offset (*bitset_kernel_popcount_fn)(const bitset_word *, size_t)
+    = bitset_kernel_popcount_resolve;
+
+bitset_offset (*bitset_kernel_popcount_andnot_fn)(const bitset_word *, const bitset_word *,
+    const bitset_word *, size_t) = bitset_kernel_popcount_andnot_resolve;
+
+enum bitset_kernel bitset_kernel_select(enum bitset_kernel kernel) {
+    bitset_kernel_resolve();
+    return bitset_kernel_set(kernel);
+}
+
+static enum bitset_kernel bitset_kernel_set(enum bitset_kernel kernel) {
+    enum bitset_kernel supported = bitset_kernel_supported();
+    if (kernel > supported) {
+        kernel = supported;
+    }
+    size_t (*decode)(bitset_cursor_t *, bitset_offset *, size_t) = bitset_kernel_decode_generic;
+    bitset_offset (*count)(const bitset_word *, size_t) = bitset_kernel_generic_count;
+    bitset_offset (*popcount)(const bitset_word *, size_t) = bitset_kernel_generic_popcount;
+    bitset_offset (*popcount_andnot)(const bitset_word *, const bitset_word *,
+        const bitset_word *, size_t) = bitset_kernel_generic_popcount_andnot;
+#ifdef BITSET_KERNEL_X86
+    if (kernel >= BITSET_KERNEL_POPCNT) {
+        count = bitset_kernel_popcnt_count;
+        popcount = bitset_kernel_popcnt_popcount;
+        popcount_andnot = bitset_kernel_popcnt_popcount_andnot;
+    }
+    if (kernel >= BITSET_KERNEL_AVX2) {
+        decode = bitset_kernel_decode_avx2;
+        count = bitset_kernel_avx2_count;
+        popcount = bitset_kernel_avx2_popcount;
+        popcount_andnot = bitset_kernel_avx2_popcount_andnot;
+    }
+#ifndef BITSET_NO_AVX512
+    if (kernel >= BITSET_KERNEL_AVX512) {
+        count = bitset_kernel_avx512_count;
+        popcount = bitset_kernel_avx512_popcount;
+        popcount_andnot = bitset_kernel_avx512_popcount_andnot;
+    }
+#endif
+#endif
+    BITSET_KERNEL_STORE(bitset_kernel_decode_fn, decode);
+    BITSET_KERNEL_STORE(bitset_kernel_count_fn, count);
+    BITSET_KERNEL_STORE(bitset_kernel_popcount_fn, popcount);
+    BITSET_KERNEL_STORE(bitset_kernel_popcount_andnot_fn, popcount_andnot);
+    return kernel;
+}
@@ -0,0 +1,103 @@
+#ifndef BITSET_KERNEL_H_
+#define BITSET_KERNEL_H_
+
+#include "bitset/bitset.h"
+
+/**
+ * Kernels are called through function pointers which are resolved once, the
+ * first time they're used (or by bitset_kernel_select()), based on the
+ * features of the CPU. The portable implementations are always available.
+ */
+
+#if !defined(BITSET_NO_SIMD) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#  define BITSET_KERNEL_X86
+#endif
+
+/**
+ * The selected kernels are swapped atomically, so a kernel can be selected
+ * while other threads are running kernels.
+ */
+
+#ifdef BITSET_NO_THREADS
+#  define BITSET_KERNEL_LOAD(fn) (fn)
+#  define BITSET_KERNEL_STORE(fn, value) ((fn) = (value))
+#else
+#  define BITSET_KERNEL_LOAD(fn) __atomic_load_n(&(fn), __ATOMIC_ACQUIRE)
+#  define BITSET_KERNEL_STORE(fn, value) __atomic_store_n(&(fn), value, __ATOMIC_RELEASE)
+#endif
+
+extern size_t (*bitset_kernel_decode_fn)(bitset_cursor_t *, bitset_offset *, size_t);
+extern bitset_offset (*bitset_kernel_count_fn)(const bitset_word *, size_t);
+extern bitset_offset (*bitset_kernel_popcount_fn)(const bitset_word *, size_t);
+extern bitset_offset (*bitset_kernel_popcount_andnot_fn)(const bitset_word *,
+    const bitset_word *, const bitset_word *, size_t);
+
+/**
+ * Decode set bits from the cursor into the offsets array.
+ */
+
+static inline size_t bitset_kernel_decode(bitset_cursor_t *cursor,
+        bitset_offset *offsets, size_t capacity) {
+    return BITSET_KERNEL_LOAD(bitset_kernel_decode_fn)(cursor, offsets, capacity);
+}
+
+/**
+ * Count the set bits in a compressed buffer.
+ */
+
+static inline bitset_offset bitset_kernel_count(const bitset_word *buffer, size_t length) {
+    return BITSET_KERNEL_LOAD(bitset_kernel_count_fn)(buffer, length);
+}
+
+/**
+ * Count the set bits in an array of uncompressed (literal) words.
+ */
+
+static inline bitset_offset bitset_kernel_popcount(const bitset_word *words, size_t length) {
+    return BITSET_KERNEL_LOAD(bitset_kernel_popcount_fn)(words, length);
+}
+
+/**
+ * Count the set bits in (a & ~b), or (a & ~b & mask) when a mask array is
+ * provided. All arrays are uncompressed and of the same length.
+ */
+
+static inline bitset_offset bitset_kernel_popcount_andnot(const bitset_word *a,
+        const bitset_word *b, const bitset_word *mask, size_t length) {
+    return BITSET_KERNEL_LOAD(bitset_kernel_popcount_andnot_fn)(a, b, mask, length);
+}
+
+/**
+ * Words produced one at a time (e.g. while walking a hash) can be counted
+ * by batching them up and passing each batch to the popcount kernel.
+ */
+
+#define BITSET_KERNEL_BATCH 256
+
+typedef struct bitset_kernel_batch_s {
+    bitset_word words[BITSET_KERNEL_BATCH];
+    size_t length;
+    bitset_offset count;
+} bitset_kernel_batch_t;
+
+static inline void bitset_kernel_batch_init(bitset_kernel_batch_t *batch) {
+    batch->length = 0;
+    batch->count = 0;
+}
+
+static inline void bitset_kernel_batch_push(bitset_kernel_batch_t *batch, bitset_word word) {
+    batch->words[batch->length++] = word;
+    if (batch->length == BITSET_KERNEL_BATCH) {
+        batch->count += bitset_kernel_popcount(batch->words, batch->length);
+        batch->length = 0;
+    }
+}
+
+static inline bitset_offset bitset_kernel_batch_count(bitset_kernel_batch_t *batch) {
+    batch->count += bitset_kernel_popcount(batch->words, batch->length);
+    batch->length = 0;
+    return batch->count;
+}
+
+#endif
@@ -1,8 +1,17 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#ifndef BITSET_NO_THREADS
+#include <pthread.h>
+#endif
 
 #include "bitset/malloc.h"
 #include "bitset/operation.h"
+#include "cache.h"
+#include "kernel.h"
+#include "stream.h"
 
 bitset_operation_t *bitset_operation_new(bitset_t *bitset) {
     bitset_operation_t *operation = bitset_malloc(sizeof(bitset_operation_t));
@@ -11,6 +20,8 @@ bitset_operation_t *bitset_operation_new(bitset_t *bitset) {
     }
     operation->length = 0;
     operation->steps = NULL;
+    operation->threads = 1;
+    operation->cache = NULL;
     if (bitset) {
         bitset_operation_add(operation, bitset, BITSET_OR);
     }
@@ -24,6 +35,7 @@ void bitset_operation_free(bitset_operation_t *operation) {
                 bitset_operation_free(operation->steps[i]->data.nested);
             } else {
                 bitset_malloc_free(operation->steps[i]->data.bitset.buffer);
+                bitset_malloc_free(operation->steps[i]->data.bitset.meta);
             }
         }
         bitset_malloc_free(operation->steps[i]);
@@ -66,12 +78,30 @@ void bitset_operation_add_buffer(bitset_operation_t *operation,
     step->is_operation = false;
     step->data.bitset.buffer = buffer;
     step->data.bitset.length = length;
+    step->data.bitset.index = NULL;
+    step->data.bitset.meta = NULL;
+    step->data.bitset.borrowed = true;
+    step->data.bitset.version = 0;
     step->type = type;
 }
 
 void bitset_operation_add(bitset_operation_t *operation,
         bitset_t *bitset, enum bitset_operation_type type) {
+    size_t length = operation->length;
     bitset_operation_add_buffer(operation, bitset->buffer, bitset->length, type);
+    if (operation->length > length) {
+        operation->steps[length]->data.bitset.index = bitset->index;
+        operation->steps[length]->data.bitset.meta = bitset->meta;
+        operation->steps[length]->data.bitset.version = bitset->version;
+    }
+}
+
+void bitset_operation_threads(bitset_operation_t *operation, unsigned threads) {
+    operation->threads = threads ? threads : 1;
+}
+
+void bitset_operation_cache(bitset_operation_t *operation, bitset_cache_t *cache) {
+    operation->cache = cache;
 }
 
 void bitset_operation_add_nested(bitset_operation_t *operation, bitset_operation_t *nested,
@@ -83,297 +113,217 @@ void bitset_operation_add_nested(bitset_operation_t *operation, bitset_operation
     step->type = type;
 }
 
+static inline void bitset_hash_alloc(bitset_hash_t *hash, size_t size) {
+    hash->size = size;
+    hash->shift = 64;
+    while (size > 1) {
+        hash->shift--;
+        size >>= 1;
+    }
+    hash->offsets = bitset_calloc(hash->size, sizeof(bitset_offset));
+    hash->words = bitset_calloc(hash->size, sizeof(bitset_word));
+    if (!hash->offsets || !hash->words) {
+        bitset_oom();
+    }
+}
+
 static inline bitset_hash_t *bitset_hash_new(size_t buckets) {
     bitset_hash_t *hash = bitset_malloc(sizeof(bitset_hash_t));
     if (!hash) {
         bitset_oom();
     }
     size_t size;
-    BITSET_NEXT_POW2(size, buckets);
-    hash->size = size;
+    BITSET_NEXT_POW2(size, buckets < 16 ? 16 : buckets);
+    bitset_hash_alloc(hash, size);
     hash->count = 0;
-    hash->buckets = bitset_calloc(1, sizeof(bitset_hash_bucket_t *) * hash->size);
-    hash->buffer = bitset_malloc(sizeof(bitset_word) * hash->size);
-    if (!hash->buckets || !hash->buffer) {
-        bitset_oom();
-    }
     return hash;
 }
 
 static inline void bitset_hash_free(bitset_hash_t *hash) {
-    bitset_hash_bucket_t *bucket, *tmp;
-    for (size_t i = 0; i < hash->size; i++) {
-        bucket = hash->buckets[i];
-        if (BITSET_IS_TAGGED_POINTER(bucket)) {
+    bitset_malloc_free(hash->offsets);
+    bitset_malloc_free(hash->words);
+    bitset_malloc_free(hash);
+}
+
+/**
+ * Map an offset to its home slot using Fibonacci hashing so that strided
+ * offsets don't pile up in the same run of slots.
+ */
+
+static inline size_t bitset_hash_slot(const bitset_hash_t *hash, bitset_offset offset) {
+    return (size_t)(((uint64_t)offset * UINT64_C(11400714819323198485)) >> hash->shift);
+}
+
+static inline void bitset_hash_grow(bitset_hash_t *hash) {
+    bitset_offset *offsets = hash->offsets;
+    bitset_word *words = hash->words;
+    size_t size = hash->size, slot;
+    bitset_hash_alloc(hash, size * 2);
+    for (size_t i = 0; i < size; i++) {
+        if (!offsets[i]) {
             continue;
         }
-        while (bucket) {
-            tmp = bucket;
-            bucket = bucket->next;
-            bitset_malloc_free(tmp);
+        slot = bitset_hash_slot(hash, offsets[i]);
+        while (hash->offsets[slot]) {
+            slot = (slot + 1) & (hash->size - 1);
         }
+        hash->offsets[slot] = offsets[i];
+        hash->words[slot] = words[i];
     }
-    bitset_malloc_free(hash->buckets);
-    bitset_malloc_free(hash->buffer);
-    bitset_malloc_free(hash);
+    bitset_malloc_free(offsets);
+    bitset_malloc_free(words);
 }
 
 static inline bool bitset_hash_insert(bitset_hash_t *hash, bitset_offset offset, bitset_word word) {
-    unsigned key = offset & (hash->size - 1);
-    bitset_hash_bucket_t *insert, *bucket = hash->buckets[key];
-    bitset_offset off;
-    if (BITSET_IS_TAGGED_POINTER(bucket)) {
-        off = BITSET_UINT_FROM_POINTER(bucket);
-        if (off == offset) {
-            return false;
-        }
-        insert = bitset_malloc(sizeof(bitset_hash_bucket_t));
-        if (!insert) {
-            bitset_oom();
-        }
-        insert->offset = off;
-        insert->word = (uintptr_t)hash->buffer[key];
-        bucket = hash->buckets[key] = insert;
-        insert = bitset_malloc(sizeof(bitset_hash_bucket_t));
-        if (!insert) {
-            bitset_oom();
-        }
-        insert->offset = offset;
-        insert->word = word;
-        insert->next = NULL;
-        bucket->next = insert;
-        hash->count++;
-        return true;
-    } else if (!bucket) {
-#if SIZEOF_VOID_P != BITSET_WORD_BYTES
-        hash->buckets[key] = (bitset_hash_bucket_t *) BITSET_UINT_IN_POINTER(offset);
-        hash->buffer[key] = word;
-        hash->count++;
-#else
-        if (BITSET_UINT_CAN_TAG(offset)) {
-            hash->buckets[key] = (bitset_hash_bucket_t *) BITSET_UINT_IN_POINTER(offset);
-            hash->buffer[key] = word;
-            hash->count++;
-        } else {
-            insert = bitset_malloc(sizeof(bitset_hash_bucket_t));
-            if (!insert) {
-                bitset_oom();
-            }
-            insert->offset = offset;
-            insert->word = word;
-            insert->next = NULL;
-            hash->buckets[key] = insert;
-        }
-#endif
-        return true;
+    size_t slot;
+    //Keep the load factor at or below 1/2
+    if ((hash->count + 1) * 2 > hash->size) {
+        bitset_hash_grow(hash);
     }
-    for (;;) {
-        if (bucket->offset == offset) {
+    slot = bitset_hash_slot(hash, offset);
+    while (hash->offsets[slot]) {
+        if (hash->offsets[slot] == offset) {
             return false;
         }
-        if (bucket->next == NULL) {
-            break;
-        }
-        bucket = bucket->next;
-    }
-    insert = bitset_malloc(sizeof(bitset_hash_bucket_t));
-    if (!insert) {
-        bitset_oom();
+        slot = (slot + 1) & (hash->size - 1);
     }
-    insert->offset = offset;
-    insert->word = word;
-    insert->next = NULL;
-    bucket->next = insert;
+    hash->offsets[slot] = offset;
+    hash->words[slot] = word;
     hash->count++;
     return true;
 }
 
 static inline bitset_word *bitset_hash_get(const bitset_hash_t *hash, bitset_offset offset) {
-    unsigned key = offset & (hash->size - 1);
-    bitset_hash_bucket_t *bucket = hash->buckets[key];
-    bitset_offset off;
-    while (bucket) {
-        if (BITSET_IS_TAGGED_POINTER(bucket)) {
-            off = BITSET_UINT_FROM_POINTER(bucket);
-            if (off != offset) {
-                return NULL;
-            }
-            return &hash->buffer[key];
+    size_t slot = bitset_hash_slot(hash, offset);
+    while (hash->offsets[slot]) {
+        if (hash->offsets[slot] == offset) {
+            return &hash->words[slot];
         }
-        if (bucket->offset == offset) {
-            return &bucket->word;
-        }
-        bucket = bucket->next;
+        slot = (slot + 1) & (hash->size - 1);
     }
     return NULL;
 }
 
-static inline bitset_hash_t *bitset_operation_iter(bitset_operation_t *operation) {
-    bitset_offset word_offset, max = 0, b_max, length, and_offset;
-    bitset_operation_step_t *step;
-    bitset_word word = 0, *hashed, and_word;
-    unsigned position, count = 0, k, j;
-    int last_k, last_j;
-    size_t size, start_at;
-    bitset_hash_t *words, *and_words = NULL;
-    bitset_t *tmp, *bitset, *and;
+/**
+ * Execute a nested operation, or copy its result from the cache.
+ */
 
-    //Recursively flatten nested operations
+static bitset_t *bitset_operation_exec_nested(bitset_operation_t *operation,
+        bitset_operation_t *nested) {
+    bitset_cache_key_t key;
+    bitset_t *result;
+    if (!operation->cache) {
+        return bitset_operation_exec(nested);
+    }
+    if (!nested->cache) {
+        nested->cache = operation->cache;
+    }
+    if (!bitset_cache_key_operation(&key, nested)) {
+        bitset_cache_key_free(&key);
+        return bitset_operation_exec(nested);
+    }
+    if (!(result = bitset_cache_get(operation->cache, &key))) {
+        result = bitset_operation_exec(nested);
+        bitset_cache_put(operation->cache, &key, result);
+    }
+    bitset_cache_key_free(&key);
+    return result;
+}
+
+/**
+ * Recursively flatten nested operations into their results.
+ */
+
+static void bitset_operation_flatten(bitset_operation_t *operation) {
+    bitset_t *tmp;
     for (size_t i = 0; i < operation->length; i++) {
         if (operation->steps[i]->is_operation) {
-            tmp = bitset_operation_exec(operation->steps[i]->data.nested);
+            tmp = bitset_operation_exec_nested(operation, operation->steps[i]->data.nested);
             bitset_operation_free(operation->steps[i]->data.nested);
             operation->steps[i]->data.bitset.buffer = tmp->buffer;
             operation->steps[i]->data.bitset.length = tmp->length;
+            operation->steps[i]->data.bitset.index = NULL;
+            operation->steps[i]->data.bitset.meta = tmp->meta;
+            operation->steps[i]->data.bitset.borrowed = false;
+            operation->steps[i]->data.bitset.version = tmp->version;
             operation->steps[i]->is_operation = false;
             bitset_malloc_free(tmp);
         }
-        count += operation->steps[i]->data.bitset.length;
-        b_max = bitset_max(&operation->steps[i]->data.bitset);
-        max = BITSET_MAX(max, b_max);
     }
+}
 
-    //Work out the number of hash buckets to allocate
-    if (count <= 8) {
-        size = 16;
-    } else if (count <= 8388608) {
-        size = count * 2;
-    } else {
-        size = max / BITSET_LITERAL_LENGTH + 2;
-        while (count < max / 64) {
-            size /= 2;
-            max /= 64;
-        }
-        size = size <= 16 ? 16 : size > 16777216 ? 16777216 : size;
-    }
+static inline bitset_hash_t *bitset_operation_iter(bitset_operation_t *operation, size_t count) {
+    bitset_operation_step_t *step;
+    bitset_word word, *hashed;
+    size_t size, start_at;
+    bitset_hash_t *words, *and_words = NULL;
+    bitset_t *bitset, *and;
+    bitset_reader_t reader, and_reader;
+    bool more, and_more;
+
+    //The hash grows as needed, so the initial size is capped
+    size = count * 2 < 1048576 ? count * 2 : 1048576;
     words = bitset_hash_new(size);
     start_at = 1;
     bitset = &operation->steps[0]->data.bitset;
-    word_offset = 0;
+    bitset_reader_init(&reader, bitset->buffer, bitset->length);
+    more = bitset_reader_next(&reader);
+
+    //Hash offsets are 1-based, i.e. reader offset + 1
 
     //Compute (0 OR (A AND B)) instead of the usual ((0 OR A) AND B)
     if (operation->length >= 2 && operation->steps[1]->type == BITSET_AND) {
         start_at = 2;
-        and_offset = 0;
-        and_word = 0;
         and = &operation->steps[1]->data.bitset;
-        k = 0;
-        j = 0;
-        last_k = -1;
-        last_j = -1;
-        while (1) {
-            if (last_j < (int)j && j < and->length) {
-                if (BITSET_IS_FILL_WORD(and->buffer[j])) {
-                    and_offset += BITSET_GET_LENGTH(and->buffer[j]);
-                    position = BITSET_GET_POSITION(and->buffer[j]);
-                    if (!position) {
-                        j++;
-                        continue;
-                    }
-                    and_word = BITSET_CREATE_LITERAL(position - 1);
-                } else {
-                    and_word = and->buffer[j];
-                }
-                and_offset++;
-                last_j = j;
-            }
-            if (last_k < (int)k && k < bitset->length) {
-                if (BITSET_IS_FILL_WORD(bitset->buffer[k])) {
-                    length = BITSET_GET_LENGTH(bitset->buffer[k]);
-                    word_offset += length;
-                    position = BITSET_GET_POSITION(bitset->buffer[k]);
-                    if (!position) {
-                        k++;
-                        continue;
-                    }
-                    word = BITSET_CREATE_LITERAL(position - 1);
-                } else {
-                    word = bitset->buffer[k];
-                }
-                word_offset++;
-                last_k = k;
-            }
-            if (and_offset < word_offset) {
-                if (j++ >= and->length) {
-                    break;
-                }
-            } else if (word_offset < and_offset) {
-                if (k++ >= bitset->length) {
-                    break;
-                }
+        bitset_reader_init(&and_reader, and->buffer, and->length);
+        and_more = bitset_reader_next(&and_reader);
+        while (more && and_more) {
+            if (reader.offset < and_reader.offset) {
+                more = bitset_reader_seek(&reader, and_reader.offset);
+            } else if (and_reader.offset < reader.offset) {
+                and_more = bitset_reader_seek(&and_reader, reader.offset);
             } else {
-                word &= and_word;
+                word = reader.word & and_reader.word;
                 if (word) {
-                    bitset_hash_insert(words, word_offset, word);
-                }
-                j++;
-                k++;
-                if (j >= and->length && k >= bitset->length) {
-                    break;
+                    bitset_hash_insert(words, reader.offset + 1, word);
                 }
+                more = bitset_reader_next(&reader);
+                and_more = bitset_reader_next(&and_reader);
             }
         }
     } else {
         //Populate the offset=>word hash (0 OR A)
-        for (size_t i = 0; i < bitset->length; i++) {
-            word = bitset->buffer[i];
-            if (BITSET_IS_FILL_WORD(word)) {
-                length = BITSET_GET_LENGTH(word);
-                word_offset += length;
-                position = BITSET_GET_POSITION(word);
-                if (!position) {
-                    continue;
-                }
-                word = BITSET_CREATE_LITERAL(position - 1);
-            }
-            word_offset++;
-            bitset_hash_insert(words, word_offset, word);
+        for (; more; more = bitset_reader_next(&reader)) {
+            bitset_hash_insert(words, reader.offset + 1, reader.word);
         }
     }
 
     //Apply the remaining steps in the operation
     for (size_t i = start_at; i < operation->length; i++) {
         step = operation->steps[i];
+        if (!words->count && (step->type == BITSET_AND || step->type == BITSET_ANDNOT)) {
+            //An intersection can't change an empty intermediate result
+            continue;
+        }
         bitset = &step->data.bitset;
-        word_offset = 0;
+        bitset_reader_init(&reader, bitset->buffer, bitset->length);
         if (step->type == BITSET_AND) {
-            and_words = bitset_hash_new(words->size);
-            for (size_t j = 0; j < bitset->length; j++) {
-                word = bitset->buffer[j];
-                if (BITSET_IS_FILL_WORD(word)) {
-                    length = BITSET_GET_LENGTH(word);
-                    word_offset += length;
-                    position = BITSET_GET_POSITION(word);
-                    if (!position) {
-                        continue;
-                    }
-                    word = BITSET_CREATE_LITERAL(position - 1);
-                }
-                word_offset++;
-                hashed = bitset_hash_get(words, word_offset);
+            and_words = bitset_hash_new(words->count * 2);
+            while (bitset_reader_next(&reader)) {
+                hashed = bitset_hash_get(words, reader.offset + 1);
                 if (hashed && *hashed) {
-                    word &= *hashed;
+                    word = reader.word & *hashed;
                     if (word) {
-                        bitset_hash_insert(and_words, word_offset, word);
+                        bitset_hash_insert(and_words, reader.offset + 1, word);
                     }
                 }
             }
             bitset_hash_free(words);
             words = and_words;
         } else {
-            for (size_t j = 0; j < bitset->length; j++) {
-                word = bitset->buffer[j];
-                if (BITSET_IS_FILL_WORD(word)) {
-                    length = BITSET_GET_LENGTH(word);
-                    word_offset += length;
-                    position = BITSET_GET_POSITION(word);
-                    if (!position) {
-                        continue;
-                    }
-                    word = BITSET_CREATE_LITERAL(position - 1);
-                }
-                word_offset++;
-                hashed = bitset_hash_get(words, word_offset);
+            while (bitset_reader_next(&reader)) {
+                word = reader.word;
+                hashed = bitset_hash_get(words, reader.offset + 1);
                 if (hashed) {
                     switch (step->type) {
                         case BITSET_OR:     *hashed |= word;  break;
@@ -382,7 +332,7 @@ static inline bitset_hash_t *bitset_operation_iter(bitset_operation_t *operation
                         default: break;
                     }
                 } else if (step->type != BITSET_ANDNOT) {
-                    bitset_hash_insert(words, word_offset, word);
+                    bitset_hash_insert(words, reader.offset + 1, word);
                 }
             }
         }
@@ -390,6 +340,78 @@ static inline bitset_hash_t *bitset_operation_iter(bitset_operation_t *operation
     return words;
 }
 
+/**
+ * Apply each step in the operation to a dense array of words indexed by word
+ * offset, relative to the lowest word offset of any operand. Runs of ones are
+ * applied as a single loop over the range.
+ */
+
+static bitset_word *bitset_operation_dense(bitset_operation_t *operation,
+        bitset_offset start, size_t words) {
+    bitset_word *dense = bitset_calloc(words, sizeof(bitset_word));
+    enum bitset_operation_type type;
+    bitset_offset offset, end, next;
+    bitset_reader_t reader;
+    bitset_word word;
+    bitset_t *bitset;
+    bool more;
+    if (!dense) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < operation->length; i++) {
+        bitset = &operation->steps[i]->data.bitset;
+        type = i ? operation->steps[i]->type : BITSET_OR;
+        bitset_reader_init(&reader, bitset->buffer, bitset->length);
+        more = bitset_reader_next(&reader);
+        next = 0;
+        while (more) {
+            if (!reader.word) {
+                //Empty words may sit below the lowest set bit
+                more = bitset_reader_next(&reader);
+                continue;
+            }
+            offset = reader.offset - start;
+            end = offset + reader.ones + 1;
+            word = reader.word;
+            switch (type) {
+                case BITSET_AND:
+                    //Words that aren't in the operand are cleared
+                    for (bitset_offset j = next; j < offset; j++) {
+                        dense[j] = 0;
+                    }
+                    for (bitset_offset j = offset; j < end; j++) {
+                        dense[j] &= word;
+                    }
+                    next = end;
+                    break;
+                case BITSET_OR:
+                    for (bitset_offset j = offset; j < end; j++) {
+                        dense[j] |= word;
+                    }
+                    break;
+                case BITSET_XOR:
+                    for (bitset_offset j = offset; j < end; j++) {
+                        dense[j] ^= word;
+                    }
+                    break;
+                case BITSET_ANDNOT:
+                    for (bitset_offset j = offset; j < end; j++) {
+                        dense[j] &= ~word;
+                    }
+                    break;
+            }
+            more = reader.ones ? bitset_reader_seek(&reader, reader.offset + reader.ones + 1)
+                : bitset_reader_next(&reader);
+        }
+        if (type == BITSET_AND) {
+            for (bitset_offset j = next; j < words; j++) {
+                dense[j] = 0;
+            }
+        }
+    }
+    return dense;
+}
+
 static int bitset_operation_quick_sort(const void *a, const void *b) {
     bitset_offset a_offset = *(bitset_offset *)a;
     bitset_offset b_offset = *(bitset_offset *)b;
@@ -427,94 +449,1726 @@ static inline unsigned char bitset_fls(bitset_word word) {
 }*/
 
 static inline unsigned char bitset_fls(bitset_word word) {
-    return (__builtin_clz(word)-1);
+    return (BITSET_CLZ(word)-1);
 }
 
-bitset_t *bitset_operation_exec(bitset_operation_t *operation) {
-    if (!operation->length) {
-        return bitset_new();
-    } else if (operation->length == 1 && !operation->steps[0]->is_operation) {
-        return bitset_copy(&operation->steps[0]->data.bitset);
+/**
+ * Merge two compressed buffers in a single pass. Words that only one side
+ * has are copied or skipped a compressed word at a time, and overlapping
+ * runs of ones are combined without being expanded, so the cost depends on
+ * the compressed length of the operands rather than the logical length.
+ */
+
+static void bitset_merge_stream(bitset_writer_t *writer, const bitset_t *a, const bitset_t *b,
+        enum bitset_operation_type type) {
+    bitset_reader_t ra, rb;
+    bitset_offset length, end;
+    bitset_word word;
+    bitset_reader_init(&ra, a->buffer, a->length);
+    bitset_reader_init(&rb, b->buffer, b->length);
+    bool more_a = bitset_reader_next(&ra), more_b = bitset_reader_next(&rb);
+    while (more_a || more_b) {
+        if (!more_b || (more_a && ra.offset < rb.offset)) {
+            //Words that only A has
+            if (type == BITSET_AND) {
+                if (!more_b) {
+                    break;
+                }
+                more_a = bitset_reader_seek(&ra, rb.offset);
+            } else {
+                more_a = bitset_stream_copy(&ra, writer, more_a,
+                    more_b ? rb.offset : BITSET_OFFSET_MAX);
+            }
+        } else if (!more_a || rb.offset < ra.offset) {
+            //Words that only B has
+            if (type == BITSET_AND || type == BITSET_ANDNOT) {
+                if (!more_a) {
+                    break;
+                }
+                more_b = bitset_reader_seek(&rb, ra.offset);
+            } else {
+                more_b = bitset_stream_copy(&rb, writer, more_b,
+                    more_a ? ra.offset : BITSET_OFFSET_MAX);
+            }
+        } else if (ra.ones && rb.ones) {
+            //Both sides are in a run of ones
+            length = (ra.ones < rb.ones ? ra.ones : rb.ones) + 1;
+            if (type == BITSET_AND || type == BITSET_OR) {
+                bitset_writer_append_ones(writer, ra.offset, length);
+            }
+            more_a = bitset_reader_seek(&ra, ra.offset + length);
+            more_b = bitset_reader_seek(&rb, rb.offset + length);
+        } else if (type == BITSET_OR && (ra.ones || rb.ones)) {
+            length = (ra.ones ? ra.ones : rb.ones) + 1;
+            bitset_writer_append_ones(writer, ra.offset, length);
+            more_a = bitset_reader_seek(&ra, ra.offset + length);
+            more_b = bitset_reader_seek(&rb, rb.offset + length);
+        } else if (type == BITSET_AND && (ra.ones || rb.ones)) {
+            //The other side is copied for the length of the run
+            if (ra.ones) {
+                end = ra.offset + ra.ones + 1;
+                more_b = bitset_stream_copy(&rb, writer, more_b, end);
+                more_a = bitset_reader_seek(&ra, end);
+            } else {
+                end = rb.offset + rb.ones + 1;
+                more_a = bitset_stream_copy(&ra, writer, more_a, end);
+                more_b = bitset_reader_seek(&rb, end);
+            }
+        } else if (type == BITSET_ANDNOT && rb.ones) {
+            end = rb.offset + rb.ones + 1;
+            more_a = bitset_reader_seek(&ra, end);
+            more_b = bitset_reader_seek(&rb, end);
+        } else {
+            switch (type) {
+                case BITSET_AND:    word = ra.word & rb.word;  break;
+                case BITSET_OR:     word = ra.word | rb.word;  break;
+                case BITSET_XOR:    word = ra.word ^ rb.word;  break;
+                default:            word = ra.word & ~rb.word; break;
+            }
+            bitset_writer_append(writer, ra.offset, word);
+            more_a = bitset_reader_next(&ra);
+            more_b = bitset_reader_next(&rb);
+        }
     }
-    bitset_hash_t *words = bitset_operation_iter(operation);
-    bitset_hash_bucket_t *bucket;
+}
+
+static bitset_t *bitset_merge(const bitset_t *a, const bitset_t *b,
+        enum bitset_operation_type type) {
     bitset_t *result = bitset_new();
-    bitset_offset word_offset = 0, fills, offset;
-    bitset_word word, *hashed, fill = BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH);
-    if (!words->count) {
-        bitset_hash_free(words);
-        return result;
+    bitset_writer_t writer;
+    bitset_writer_init(&writer, result);
+    bitset_merge_stream(&writer, a, b, type);
+    bitset_meta_build(result);
+    return result;
+}
+
+/**
+ * Restore the heap of readers, ordered by their current offset, after the
+ * reader at the specified index has moved forward.
+ */
+
+static inline void bitset_heap_down(bitset_reader_t **heap, size_t length, size_t i) {
+    bitset_reader_t *reader = heap[i];
+    size_t child;
+    while ((child = i * 2 + 1) < length) {
+        if (child + 1 < length && heap[child + 1]->offset < heap[child]->offset) {
+            child++;
+        }
+        if (reader->offset <= heap[child]->offset) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
     }
-    bitset_offset *offsets = bitset_malloc(sizeof(bitset_offset) * words->count);
-    if (!offsets) {
+    heap[i] = reader;
+}
+
+/**
+ * Re-order the heap after the reader at the top has moved, dropping the reader
+ * if it's exhausted.
+ */
+
+static inline void bitset_heap_update(bitset_reader_t **heap, size_t *length, bool more) {
+    if (!more) {
+        heap[0] = heap[--*length];
+    }
+    if (*length) {
+        bitset_heap_down(heap, *length, 0);
+    }
+}
+
+/**
+ * Check whether every step after the first is an OR, or every step is an XOR,
+ * in which case the steps can be applied in any order.
+ */
+
+static inline bool bitset_operation_is_union(const bitset_operation_t *operation,
+        enum bitset_operation_type *type) {
+    if (operation->length < 2) {
+        return false;
+    }
+    *type = operation->steps[1]->type;
+    if (*type != BITSET_OR && *type != BITSET_XOR) {
+        return false;
+    }
+    for (size_t i = 2; i < operation->length; i++) {
+        if (operation->steps[i]->type != *type) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Execute an OR or XOR of many bitsets with a k-way merge. Readers are kept in
+ * a heap ordered by their next word offset so that words are combined and
+ * written out in order, using O(k) memory on top of the result.
+ */
+
+static bitset_t *bitset_merge_many(bitset_operation_t *operation,
+        enum bitset_operation_type type) {
+    bitset_t *result = bitset_new(), *bitset;
+    bitset_reader_t *readers, **heap;
+    bitset_writer_t writer;
+    bitset_offset offset, end;
+    bitset_word word;
+    size_t length = 0;
+    readers = bitset_malloc(sizeof(bitset_reader_t) * operation->length);
+    heap = bitset_malloc(sizeof(bitset_reader_t *) * operation->length);
+    if (!readers || !heap) {
         bitset_oom();
     }
-    for (size_t i = 0, j = 0; i < words->size; i++) {
-        bucket = words->buckets[i];
-        if (BITSET_IS_TAGGED_POINTER(bucket)) {
-            offsets[j++] = BITSET_UINT_FROM_POINTER(bucket);
+    for (size_t i = 0; i < operation->length; i++) {
+        bitset = &operation->steps[i]->data.bitset;
+        bitset_reader_init(&readers[i], bitset->buffer, bitset->length);
+        if (bitset_reader_next(&readers[i])) {
+            heap[length++] = &readers[i];
+        }
+    }
+    for (size_t i = length / 2; i-- > 0;) {
+        bitset_heap_down(heap, length, i);
+    }
+    bitset_writer_init(&writer, result);
+    while (length) {
+        offset = heap[0]->offset;
+        if (type == BITSET_OR && heap[0]->ones) {
+            //Every other reader is skipped past the run of ones
+            end = offset + heap[0]->ones + 1;
+            bitset_writer_append_ones(&writer, offset, end - offset);
+            while (length && heap[0]->offset < end) {
+                bitset_heap_update(heap, &length, bitset_reader_seek(heap[0], end));
+            }
             continue;
         }
-        while (bucket) {
-            offsets[j++] = bucket->offset;
-            bucket = bucket->next;
+        word = 0;
+        while (length && heap[0]->offset == offset) {
+            word = type == BITSET_OR ? word | heap[0]->word : word ^ heap[0]->word;
+            bitset_heap_update(heap, &length, bitset_reader_next(heap[0]));
         }
+        bitset_writer_append(&writer, offset, word);
     }
-    if (words->count < 64) {
-        bitset_operation_insertion_sort(offsets, words->count);
-    } else {
-        qsort(offsets, words->count, sizeof(bitset_offset), bitset_operation_quick_sort);
+    bitset_malloc_free(readers);
+    bitset_malloc_free(heap);
+    bitset_meta_build(result);
+    return result;
+}
+
+bitset_t *bitset_and(const bitset_t *a, const bitset_t *b) {
+    return bitset_merge(a, b, BITSET_AND);
+}
+
+bitset_t *bitset_or(const bitset_t *a, const bitset_t *b) {
+    return bitset_merge(a, b, BITSET_OR);
+}
+
+bitset_t *bitset_xor(const bitset_t *a, const bitset_t *b) {
+    return bitset_merge(a, b, BITSET_XOR);
+}
+
+bitset_t *bitset_andnot(const bitset_t *a, const bitset_t *b) {
+    return bitset_merge(a, b, BITSET_ANDNOT);
+}
+
+/**
+ * Predicates only look at non-empty words, since a buffer may contain empty
+ * literals that other encodings of the same bits don't.
+ */
+
+static inline bool bitset_reader_skip_empty(bitset_reader_t *reader, bool more) {
+    while (more && !reader->word) {
+        more = bitset_reader_next(reader);
     }
-    for (size_t i = 0, pos = 0; i < words->count; i++) {
-        offset = offsets[i];
-        hashed = bitset_hash_get(words, offset);
-        word = *hashed;
-        if (!word) continue;
-        if (offset - word_offset == 1) {
-            bitset_resize(result, result->length + 1);
-            result->buffer[pos++] = word;
+    return more;
+}
+
+static inline bool bitset_reader_first(bitset_reader_t *reader, const bitset_t *bitset) {
+    bitset_reader_init(reader, bitset->buffer, bitset->length);
+    return bitset_reader_skip_empty(reader, bitset_reader_next(reader));
+}
+
+static inline bool bitset_reader_advance(bitset_reader_t *reader) {
+    return bitset_reader_skip_empty(reader, bitset_reader_next(reader));
+}
+
+static inline bool bitset_reader_skip(bitset_reader_t *reader, bitset_offset offset) {
+    return bitset_reader_skip_empty(reader, bitset_reader_seek(reader, offset));
+}
+
+bool bitset_intersects(const bitset_t *a, const bitset_t *b) {
+    bitset_reader_t ra, rb;
+    if (a->meta && b->meta && (!a->meta->count || !b->meta->count
+            || a->meta->min > b->meta->max || b->meta->min > a->meta->max)) {
+        return false;
+    }
+    bool more_a = bitset_reader_first(&ra, a), more_b = bitset_reader_first(&rb, b);
+    while (more_a && more_b) {
+        if (ra.offset < rb.offset) {
+            more_a = bitset_reader_skip(&ra, rb.offset);
+        } else if (rb.offset < ra.offset) {
+            more_b = bitset_reader_skip(&rb, ra.offset);
+        } else if (ra.word & rb.word) {
+            return true;
         } else {
-            if (offset - word_offset > BITSET_MAX_LENGTH) {
-                fills = (offset - word_offset) / BITSET_MAX_LENGTH;
-                bitset_resize(result, result->length + fills);
-                for (bitset_offset i = 0; i < fills; i++) {
-                    result->buffer[pos++] = fill;
-                }
-                word_offset += fills * BITSET_MAX_LENGTH;
-            }
-            if (BITSET_IS_POW2(word)) {
-                bitset_resize(result, result->length + 1);
-                result->buffer[pos++] = BITSET_CREATE_FILL(offset - word_offset - 1,
-                    bitset_fls(word));
-            } else {
-                bitset_resize(result, result->length + 2);
-                result->buffer[pos++] = BITSET_CREATE_EMPTY_FILL(offset - word_offset - 1);
-                result->buffer[pos++] = word;
-            }
+            more_a = bitset_reader_advance(&ra);
+            more_b = bitset_reader_advance(&rb);
         }
-        word_offset = offset;
     }
-    bitset_malloc_free(offsets);
-    bitset_hash_free(words);
-    return result;
+    return false;
 }
 
-bitset_offset bitset_operation_count(bitset_operation_t *operation) {
-    bitset_offset count = 0;
-    bitset_hash_t *words = bitset_operation_iter(operation);
-    for (size_t i = 0; i < words->size; i++) {
-        bitset_hash_bucket_t *bucket = words->buckets[i];
-        if (BITSET_IS_TAGGED_POINTER(bucket)) {
-            bitset_word word = words->buffer[i];
-            BITSET_POP_COUNT(count, word);
-            continue;
+bool bitset_is_subset(const bitset_t *a, const bitset_t *b) {
+    bitset_reader_t ra, rb;
+    bitset_offset length;
+    if (a->meta && b->meta && (a->meta->count > b->meta->count || (a->meta->count
+            && (a->meta->min < b->meta->min || a->meta->max > b->meta->max)))) {
+        return false;
+    }
+    bool more_a = bitset_reader_first(&ra, a), more_b = bitset_reader_first(&rb, b);
+    while (more_a) {
+        if (!more_b || ra.offset < rb.offset) {
+            return false;
+        } else if (rb.offset < ra.offset) {
+            more_b = bitset_reader_skip(&rb, ra.offset);
+        } else if (ra.ones && rb.ones) {
+            length = (ra.ones < rb.ones ? ra.ones : rb.ones) + 1;
+            more_a = bitset_reader_skip(&ra, ra.offset + length);
+            more_b = bitset_reader_skip(&rb, rb.offset + length);
+        } else if (ra.word & ~rb.word) {
+            return false;
+        } else {
+            more_a = bitset_reader_advance(&ra);
+            more_b = bitset_reader_advance(&rb);
+        }
+    }
+    return true;
+}
+
+bool bitset_equal(const bitset_t *a, const bitset_t *b) {
+    bitset_reader_t ra, rb;
+    bitset_offset length;
+    if (a == b) {
+        return true;
+    } else if (a->meta && b->meta && (a->meta->count != b->meta->count || (a->meta->count
+            && (a->meta->min != b->meta->min || a->meta->max != b->meta->max)))) {
+        return false;
+    }
+    bool more_a = bitset_reader_first(&ra, a), more_b = bitset_reader_first(&rb, b);
+    while (more_a && more_b) {
+        if (ra.offset != rb.offset) {
+            return false;
+        } else if (ra.ones && rb.ones) {
+            length = (ra.ones < rb.ones ? ra.ones : rb.ones) + 1;
+            more_a = bitset_reader_skip(&ra, ra.offset + length);
+            more_b = bitset_reader_skip(&rb, rb.offset + length);
+        } else if (ra.word != rb.word) {
+            return false;
+        } else {
+            more_a = bitset_reader_advance(&ra);
+            more_b = bitset_reader_advance(&rb);
         }
-        while (bucket) {
-            BITSET_POP_COUNT(count, bucket->word);
-            bucket = bucket->next;
+    }
+    return !more_a && !more_b;
+}
+
+int bitset_compare(const bitset_t *a, const bitset_t *b) {
+    bitset_reader_t ra, rb;
+    bitset_offset length;
+    bitset_word diff, later;
+    if (a == b) {
+        return 0;
+    }
+    bool more_a = bitset_reader_first(&ra, a), more_b = bitset_reader_first(&rb, b);
+    while (more_a && more_b) {
+        if (ra.offset == rb.offset && ra.ones && rb.ones) {
+            length = (ra.ones < rb.ones ? ra.ones : rb.ones) + 1;
+            more_a = bitset_reader_skip(&ra, ra.offset + length);
+            more_b = bitset_reader_skip(&rb, rb.offset + length);
+        } else if (ra.offset == rb.offset && ra.word == rb.word) {
+            more_a = bitset_reader_advance(&ra);
+            more_b = bitset_reader_advance(&rb);
+        } else if (ra.offset != rb.offset) {
+            //The first differing bit belongs to whichever side is behind, and
+            //the other side still has bits after it
+            return ra.offset < rb.offset ? -1 : 1;
+        } else {
+            //The side with the first differing bit sorts first unless the
+            //other side has no bits after it
+            diff = ra.word ^ rb.word;
+            diff = BITSET_CREATE_LITERAL(bitset_stream_fls(diff));
+            later = diff - 1;
+            if (ra.word & diff) {
+                return (rb.word & later) || bitset_reader_advance(&rb) ? -1 : 1;
+            }
+            return (ra.word & later) || bitset_reader_advance(&ra) ? 1 : -1;
         }
     }
-    bitset_hash_free(words);
-    return count;
+    return more_a ? 1 : more_b ? -1 : 0;
+}
+
+/**
+ * Count the bits set in both bitsets. Words that only one side has are
+ * skipped with a seek, overlapping runs of ones are counted without being
+ * expanded, and the remaining words are counted in batches.
+ */
+
+static bitset_offset bitset_and_count_stream(const bitset_t *a, const bitset_t *b) {
+    bitset_kernel_batch_t batch;
+    bitset_reader_t ra, rb;
+    bitset_offset length;
+    if (a->meta && b->meta && (!a->meta->count || !b->meta->count
+            || a->meta->min > b->meta->max || b->meta->min > a->meta->max)) {
+        return 0;
+    }
+    bitset_kernel_batch_init(&batch);
+    bitset_reader_init(&ra, a->buffer, a->length);
+    bitset_reader_init(&rb, b->buffer, b->length);
+    bool more_a = bitset_reader_next(&ra), more_b = bitset_reader_next(&rb);
+    while (more_a && more_b) {
+        if (ra.offset < rb.offset) {
+            more_a = bitset_reader_seek(&ra, rb.offset);
+        } else if (rb.offset < ra.offset) {
+            more_b = bitset_reader_seek(&rb, ra.offset);
+        } else if (ra.ones && rb.ones) {
+            length = (ra.ones < rb.ones ? ra.ones : rb.ones) + 1;
+            batch.count += length * BITSET_LITERAL_LENGTH;
+            more_a = bitset_reader_seek(&ra, ra.offset + length);
+            more_b = bitset_reader_seek(&rb, rb.offset + length);
+        } else {
+            bitset_kernel_batch_push(&batch, ra.word & rb.word);
+            more_a = bitset_reader_next(&ra);
+            more_b = bitset_reader_next(&rb);
+        }
+    }
+    return bitset_kernel_batch_count(&batch);
+}
+
+static bitset_offset bitset_merge_count(const bitset_t *a, const bitset_t *b,
+        enum bitset_operation_type type) {
+    bitset_offset count = bitset_and_count_stream(a, b);
+    switch (type) {
+        case BITSET_AND:
+            return count;
+        case BITSET_OR:
+            return bitset_count(a) + bitset_count(b) - count;
+        case BITSET_XOR:
+            return bitset_count(a) + bitset_count(b) - count * 2;
+        case BITSET_ANDNOT:
+            return bitset_count(a) - count;
+    }
+    return 0;
+}
+
+bitset_offset bitset_and_count(const bitset_t *a, const bitset_t *b) {
+    return bitset_merge_count(a, b, BITSET_AND);
+}
+
+bitset_offset bitset_or_count(const bitset_t *a, const bitset_t *b) {
+    return bitset_merge_count(a, b, BITSET_OR);
+}
+
+bitset_offset bitset_andnot_count(const bitset_t *a, const bitset_t *b) {
+    return bitset_merge_count(a, b, BITSET_ANDNOT);
+}
+
+double bitset_jaccard(const bitset_t *a, const bitset_t *b) {
+    bitset_offset intersection = bitset_and_count_stream(a, b);
+    bitset_offset total = bitset_count(a) + bitset_count(b) - intersection;
+    return total ? (double) intersection / total : 0;
+}
+
+/**
+ * In-place operations write to a scratch buffer which then swaps places with
+ * the destination's buffer. Each thread keeps its own scratch buffer. A buffer
+ * larger than BITSET_SCRATCH_MAX_WORDS is freed rather than kept, so that one
+ * large fold doesn't hold on to its memory for the life of the thread.
+ */
+
+#define BITSET_SCRATCH_MAX_WORDS 65536
+
+typedef struct bitset_scratch_s {
+    bitset_word *buffer;
+    size_t size;
+} bitset_scratch_t;
+
+#ifdef BITSET_NO_THREADS
+
+static bitset_scratch_t bitset_scratch;
+
+static inline bitset_scratch_t *bitset_scratch_get(void) {
+    return &bitset_scratch;
+}
+
+#else
+
+static pthread_key_t bitset_scratch_key;
+static pthread_once_t bitset_scratch_once = PTHREAD_ONCE_INIT;
+
+static void bitset_scratch_free(void *data) {
+    bitset_scratch_t *scratch = data;
+    if (scratch->buffer) {
+        bitset_malloc_free(scratch->buffer);
+    }
+    bitset_malloc_free(scratch);
 }
 
+static void bitset_scratch_init(void) {
+    if (pthread_key_create(&bitset_scratch_key, bitset_scratch_free)) {
+        BITSET_FATAL("failed to create the scratch buffer key");
+    }
+}
+
+static bitset_scratch_t *bitset_scratch_get(void) {
+    bitset_scratch_t *scratch;
+    pthread_once(&bitset_scratch_once, bitset_scratch_init);
+    if (!(scratch = pthread_getspecific(bitset_scratch_key))) {
+        scratch = bitset_calloc(1, sizeof(bitset_scratch_t));
+        if (!scratch) {
+            bitset_oom();
+        }
+        pthread_setspecific(bitset_scratch_key, scratch);
+    }
+    return scratch;
+}
+
+#endif
+
+static void bitset_merge_into(bitset_t *dst, const bitset_t *src,
+        enum bitset_operation_type type) {
+    bitset_scratch_t *scratch = bitset_scratch_get();
+    bitset_writer_t writer;
+    bitset_t result;
+    if (dst->borrowed) {
+        BITSET_FATAL("bitset views are read-only");
+    }
+    result.buffer = scratch->buffer;
+    result.length = 0;
+    result.index = NULL;
+    result.meta = NULL;
+    result.borrowed = false;
+    result.version = 0;
+    bitset_writer_init(&writer, &result);
+    writer.size = scratch->size;
+    bitset_merge_stream(&writer, dst, src, type);
+
+    //Owned buffers hold at least the next power of two of their length
+    scratch->buffer = dst->buffer;
+    BITSET_NEXT_POW2(scratch->size, dst->length);
+    if (scratch->size > BITSET_SCRATCH_MAX_WORDS) {
+        bitset_malloc_free(scratch->buffer);
+        scratch->buffer = NULL;
+        scratch->size = 0;
+    }
+    dst->buffer = result.buffer;
+    dst->length = result.length;
+    dst->version++;
+    if (dst->index) {
+        bitset_index_build(dst, dst->index->interval);
+    }
+    if (dst->meta) {
+        bitset_meta_build(dst);
+    }
+}
+
+void bitset_and_into(bitset_t *dst, const bitset_t *src) {
+    bitset_merge_into(dst, src, BITSET_AND);
+}
+
+void bitset_or_into(bitset_t *dst, const bitset_t *src) {
+    bitset_merge_into(dst, src, BITSET_OR);
+}
+
+void bitset_xor_into(bitset_t *dst, const bitset_t *src) {
+    bitset_merge_into(dst, src, BITSET_XOR);
+}
+
+void bitset_andnot_into(bitset_t *dst, const bitset_t *src) {
+    bitset_merge_into(dst, src, BITSET_ANDNOT);
+}
+
+static inline void bitset_heap_push(bitset_reader_t **heap, size_t *length,
+        bitset_reader_t *reader) {
+    size_t i = (*length)++, parent;
+    while (i && heap[parent = (i - 1) / 2]->offset > reader->offset) {
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = reader;
+}
+
+/**
+ * Get the mask of bits whose bit-sliced count is at least k, comparing from
+ * the most significant slice down.
+ */
+
+static inline bitset_word bitset_threshold_mask(const bitset_word *counters,
+        unsigned slices, unsigned k) {
+    bitset_word greater = 0, equal = ~(bitset_word) 0, bit;
+    for (unsigned j = slices; j-- > 0;) {
+        bit = (k >> j) & 1 ? ~(bitset_word) 0 : 0;
+        greater |= equal & counters[j] & ~bit;
+        equal &= ~(counters[j] ^ bit);
+    }
+    return greater | equal;
+}
+
+/**
+ * The threshold is computed with a k-way merge. The readers at the lowest
+ * offset are taken off the heap together and their words are added to
+ * bit-sliced counters, i.e. slice j holds bit j of the count for each bit
+ * position. When at least k of the readers are in a run of ones, the run is
+ * written out in one go up to the point where fewer than k remain.
+ */
+
+bitset_t *bitset_threshold(bitset_t *const *bitsets, size_t n, unsigned k) {
+    bitset_t *result = bitset_new();
+    bitset_reader_t *readers, **heap, **batch;
+    bitset_writer_t writer;
+    bitset_offset offset, end, *ends;
+    bitset_word counters[64], carry, tmp;
+    size_t length = 0, count, runs;
+    unsigned slices = 0;
+    k = k ? k : 1;
+    if (k > n) {
+        bitset_meta_build(result);
+        return result;
+    }
+    while (slices < 64 && ((uint64_t) 1 << slices) <= n) {
+        slices++;
+    }
+    readers = bitset_malloc(sizeof(bitset_reader_t) * n);
+    heap = bitset_malloc(sizeof(bitset_reader_t *) * n);
+    batch = bitset_malloc(sizeof(bitset_reader_t *) * n);
+    ends = bitset_malloc(sizeof(bitset_offset) * n);
+    if (!readers || !heap || !batch || !ends) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < n; i++) {
+        bitset_reader_init(&readers[i], bitsets[i]->buffer, bitsets[i]->length);
+        if (bitset_reader_next(&readers[i])) {
+            heap[length++] = &readers[i];
+        }
+    }
+    for (size_t i = length / 2; i-- > 0;) {
+        bitset_heap_down(heap, length, i);
+    }
+    bitset_writer_init(&writer, result);
+    while (length >= k) {
+        offset = heap[0]->offset;
+        count = runs = 0;
+        while (length && heap[0]->offset == offset) {
+            batch[count] = heap[0];
+            if (heap[0]->ones) {
+                ends[runs++] = offset + heap[0]->ones + 1;
+            }
+            count++;
+            heap[0] = heap[--length];
+            if (length) {
+                bitset_heap_down(heap, length, 0);
+            }
+        }
+        if (runs >= k) {
+            //Find the k-th latest end of the runs with a partial selection sort
+            for (size_t i = 0; i < k; i++) {
+                for (size_t j = i + 1; j < runs; j++) {
+                    if (ends[j] > ends[i]) {
+                        end = ends[i];
+                        ends[i] = ends[j];
+                        ends[j] = end;
+                    }
+                }
+            }
+            end = ends[k - 1];
+            bitset_writer_append_ones(&writer, offset, end - offset);
+            while (length && heap[0]->offset < end) {
+                bitset_heap_update(heap, &length, bitset_reader_seek(heap[0], end));
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (bitset_reader_seek(batch[i], end)) {
+                    bitset_heap_push(heap, &length, batch[i]);
+                }
+            }
+            continue;
+        }
+        if (count >= k) {
+            memset(counters, 0, sizeof(bitset_word) * slices);
+            for (size_t i = 0; i < count; i++) {
+                carry = batch[i]->word;
+                for (unsigned j = 0; carry && j < slices; j++) {
+                    tmp = counters[j] & carry;
+                    counters[j] ^= carry;
+                    carry = tmp;
+                }
+            }
+            bitset_writer_append(&writer, offset, bitset_threshold_mask(counters, slices, k));
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (bitset_reader_next(batch[i])) {
+                bitset_heap_push(heap, &length, batch[i]);
+            }
+        }
+    }
+    bitset_malloc_free(readers);
+    bitset_malloc_free(heap);
+    bitset_malloc_free(batch);
+    bitset_malloc_free(ends);
+    bitset_meta_build(result);
+    return result;
+}
+
+/**
+ * Operations are planned before they're executed. The planner flattens nested
+ * operations, drops the steps before the last point where the result is known
+ * to be empty, reorders runs of intersections so that the smallest operand is
+ * applied first and ANDNOTs are applied last, and then picks an executor.
+ */
+
+enum bitset_operation_executor {
+    BITSET_EXECUTOR_EMPTY,
+    BITSET_EXECUTOR_COPY,
+    BITSET_EXECUTOR_MERGE,
+    BITSET_EXECUTOR_DENSE,
+    BITSET_EXECUTOR_KWAY,
+    BITSET_EXECUTOR_HASH
+};
+
+typedef struct bitset_operation_plan_step_s {
+    bitset_operation_step_t step;
+    size_t index;
+    size_t words;
+    bitset_offset min;
+    bitset_offset max;
+} bitset_operation_plan_step_t;
+
+typedef struct bitset_operation_plan_s {
+    bitset_operation_t operation;
+    bitset_operation_plan_step_t *steps;
+    enum bitset_operation_executor executor;
+    enum bitset_operation_type type;
+    size_t skipped;
+    size_t words;
+    bitset_offset dense_start;
+    size_t dense_words;
+} bitset_operation_plan_t;
+
+/**
+ * A dense array needs a word for every word offset up to the largest offset,
+ * while the hash needs two slots (and a probe) for each distinct word, so the
+ * array is used when its length is within this factor of the operand words.
+ */
+
+#define BITSET_DENSE_RATIO 8
+
+static int bitset_operation_plan_compare(const void *a, const void *b) {
+    const bitset_operation_plan_step_t *x = a, *y = b;
+    if (x->step.type != y->step.type) {
+        return x->step.type == BITSET_AND ? -1 : 1;
+    } else if (x->words != y->words) {
+        return x->words < y->words ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Gather the statistics that the planner uses. The number of words is the
+ * number of buffer words, counting each word spanned by a one-fill, which is
+ * an upper bound on the number of words that the bitset hashes to. Without
+ * metadata, the words and the lowest and highest set bits are found in a
+ * single pass. With metadata, the words spanned by one-fills are bounded by
+ * the count instead, since each of them holds BITSET_LITERAL_LENGTH bits.
+ */
+
+static void bitset_operation_plan_stats(const bitset_t *bitset,
+        bitset_operation_plan_step_t *step) {
+    bitset_offset offset = 0;
+    bitset_word word;
+    unsigned position;
+    bool found = false;
+    step->words = bitset->length;
+    step->min = 0;
+    step->max = 0;
+    if (bitset->meta) {
+        if (bitset->meta->count) {
+            step->min = bitset->meta->min;
+            step->max = bitset->meta->max;
+        }
+        step->words += bitset->meta->count / BITSET_LITERAL_LENGTH;
+        if (step->words > bitset->meta->words) {
+            step->words = bitset->meta->words;
+        }
+        return;
+    }
+    for (size_t i = 0; i < bitset->length; i++) {
+        word = bitset->buffer[i];
+        if (BITSET_IS_ONE_FILL(word)) {
+            if (BITSET_GET_LENGTH(word)) {
+                if (!found) {
+                    step->min = offset * BITSET_LITERAL_LENGTH;
+                    found = true;
+                }
+                step->words += BITSET_GET_LENGTH(word) - 1;
+                offset += BITSET_GET_LENGTH(word);
+                step->max = offset * BITSET_LITERAL_LENGTH - 1;
+            }
+            continue;
+        } else if (BITSET_IS_FILL_WORD(word)) {
+            offset += BITSET_GET_LENGTH(word);
+            position = BITSET_GET_POSITION(word);
+            if (!position) {
+                continue;
+            }
+            word = BITSET_CREATE_LITERAL(position - 1);
+        }
+        if (word) {
+            if (!found) {
+                step->min = offset * BITSET_LITERAL_LENGTH + bitset_stream_fls(word);
+                found = true;
+            }
+            step->max = offset * BITSET_LITERAL_LENGTH + BITSET_LITERAL_LENGTH - 1 - BITSET_CTZ(word);
+        }
+        offset++;
+    }
+}
+
+static void bitset_operation_plan(bitset_operation_t *operation, bitset_operation_plan_t *plan) {
+    bitset_operation_plan_step_t *steps;
+    enum bitset_operation_type type;
+    bitset_offset min = BITSET_OFFSET_MAX, max = 0;
+    size_t start = 0, length, first, end;
+    bool empty = true, operand_empty, intersection = true;
+    bitset_t *bitset;
+
+    bitset_operation_flatten(operation);
+    plan->operation.steps = NULL;
+    plan->operation.length = 0;
+    plan->operation.threads = 1;
+    plan->operation.cache = NULL;
+    plan->steps = NULL;
+    plan->type = BITSET_OR;
+    plan->words = 0;
+    plan->dense_start = 0;
+    plan->dense_words = 0;
+
+    //Find the last point where the result so far is known to be empty
+    for (size_t i = 0; i < operation->length; i++) {
+        bitset = &operation->steps[i]->data.bitset;
+        operand_empty = !bitset->length || (bitset->meta && !bitset->meta->count);
+        type = i ? operation->steps[i]->type : BITSET_OR;
+        if (type == BITSET_AND) {
+            empty = empty || operand_empty;
+        } else if (type == BITSET_OR || type == BITSET_XOR) {
+            if (empty) {
+                start = i;
+            }
+            empty = empty && operand_empty;
+        }
+    }
+    if (empty) {
+        plan->skipped = operation->length;
+        plan->executor = BITSET_EXECUTOR_EMPTY;
+        return;
+    }
+    plan->skipped = start;
+    length = operation->length - start;
+    steps = plan->steps = bitset_malloc(sizeof(bitset_operation_plan_step_t) * length);
+    plan->operation.steps = bitset_malloc(sizeof(bitset_operation_step_t *) * length);
+    if (!steps || !plan->operation.steps) {
+        bitset_oom();
+    }
+    plan->operation.length = length;
+    for (size_t i = 0; i < length; i++) {
+        steps[i].step = *operation->steps[start + i];
+        steps[i].step.is_nested = false;
+        steps[i].index = start + i;
+        bitset = &steps[i].step.data.bitset;
+        bitset_operation_plan_stats(bitset, &steps[i]);
+        plan->words += steps[i].words;
+        if (bitset->length) {
+            min = BITSET_MIN(min, steps[i].min);
+            max = BITSET_MAX(max, steps[i].max);
+        }
+    }
+
+    //Sort each run of ANDs and ANDNOTs. A run that follows the first step
+    //includes it, so that the smallest operand is loaded first.
+    steps[0].step.type = BITSET_OR;
+    for (size_t i = 1; i < length; i = end) {
+        type = steps[i].step.type;
+        if (type != BITSET_AND && type != BITSET_ANDNOT) {
+            intersection = false;
+            end = i + 1;
+            continue;
+        }
+        for (end = i; end < length && (steps[end].step.type == BITSET_AND
+                || steps[end].step.type == BITSET_ANDNOT); end++);
+        first = i == 1 ? 0 : i;
+        steps[0].step.type = BITSET_AND;
+        qsort(steps + first, end - first, sizeof(bitset_operation_plan_step_t),
+            bitset_operation_plan_compare);
+        steps[0].step.type = BITSET_OR;
+    }
+    for (size_t i = 0; i < length; i++) {
+        plan->operation.steps[i] = &steps[i].step;
+    }
+
+    if (length == 1) {
+        plan->executor = BITSET_EXECUTOR_COPY;
+    } else if (length <= 3 || intersection) {
+        plan->executor = BITSET_EXECUTOR_MERGE;
+    } else if (max / BITSET_LITERAL_LENGTH - min / BITSET_LITERAL_LENGTH + 1
+            <= plan->words * BITSET_DENSE_RATIO) {
+        plan->executor = BITSET_EXECUTOR_DENSE;
+        plan->dense_start = min / BITSET_LITERAL_LENGTH;
+        plan->dense_words = max / BITSET_LITERAL_LENGTH - plan->dense_start + 1;
+    } else if (bitset_operation_is_union(&plan->operation, &plan->type)) {
+        plan->executor = BITSET_EXECUTOR_KWAY;
+    } else {
+        plan->executor = BITSET_EXECUTOR_HASH;
+    }
+}
+
+static inline void bitset_operation_plan_free(bitset_operation_plan_t *plan) {
+    if (plan->steps) {
+        bitset_malloc_free(plan->steps);
+        bitset_malloc_free(plan->operation.steps);
+    }
+}
+
+/**
+ * Merge each step into the result pairwise.
+ */
+
+static bitset_t *bitset_operation_merge(bitset_operation_t *operation) {
+    bitset_t *result, *tmp;
+    enum bitset_operation_type type;
+    result = bitset_merge(&operation->steps[0]->data.bitset,
+        &operation->steps[1]->data.bitset, operation->steps[1]->type);
+    for (size_t i = 2; i < operation->length; i++) {
+        type = operation->steps[i]->type;
+        if (!result->length && (type == BITSET_AND || type == BITSET_ANDNOT)) {
+            continue;
+        }
+        tmp = result;
+        result = bitset_merge(tmp, &operation->steps[i]->data.bitset, type);
+        bitset_free(tmp);
+    }
+    return result;
+}
+
+static bitset_t *bitset_operation_exec_dense(bitset_operation_t *operation,
+        bitset_offset start, size_t words) {
+    bitset_word *dense = bitset_operation_dense(operation, start, words);
+    bitset_t *result = bitset_new();
+    bitset_writer_t writer;
+    //Re-encode the dense result in one pass
+    bitset_writer_init(&writer, result);
+    for (size_t i = 0; i < words; i++) {
+        bitset_writer_append(&writer, start + i, dense[i]);
+    }
+    bitset_malloc_free(dense);
+    bitset_meta_build(result);
+    return result;
+}
+
+static bitset_t *bitset_operation_exec_hash(bitset_operation_t *operation, size_t count) {
+    bitset_t *result;
+    bitset_writer_t writer;
+    bitset_hash_t *words = bitset_operation_iter(operation, count);
+    bitset_offset word_offset = 0, offset, first = 0;
+    bitset_word word, *hashed;
+    bitset_word first_word = 0, last_word = 0;
+    bitset_kernel_batch_t batch;
+    bitset_kernel_batch_init(&batch);
+    result = bitset_new();
+    bitset_writer_init(&writer, result);
+    if (!words->count) {
+        bitset_hash_free(words);
+        bitset_meta_build(result);
+        return result;
+    }
+    bitset_offset *offsets = bitset_malloc(sizeof(bitset_offset) * words->count);
+    if (!offsets) {
+        bitset_oom();
+    }
+    for (size_t i = 0, j = 0; i < words->size; i++) {
+        if (words->offsets[i]) {
+            offsets[j++] = words->offsets[i];
+        }
+    }
+    if (words->count < 64) {
+        bitset_operation_insertion_sort(offsets, words->count);
+    } else {
+        qsort(offsets, words->count, sizeof(bitset_offset), bitset_operation_quick_sort);
+    }
+    for (size_t i = 0; i < words->count; i++) {
+        offset = offsets[i];
+        hashed = bitset_hash_get(words, offset);
+        word = *hashed;
+        if (!word) continue;
+        if (!first) {
+            first = offset;
+            first_word = word;
+        }
+        last_word = word;
+        bitset_kernel_batch_push(&batch, word);
+        bitset_writer_append(&writer, offset - 1, word);
+        word_offset = offset;
+    }
+    bitset_malloc_free(offsets);
+    bitset_hash_free(words);
+    //Hash offsets are 1-based, so word_offset is the number of logical words
+    result->meta = bitset_malloc(sizeof(bitset_meta_t));
+    if (!result->meta) {
+        bitset_oom();
+    }
+    result->meta->count = bitset_kernel_batch_count(&batch);
+    result->meta->min = first ? (first - 1) * BITSET_LITERAL_LENGTH + bitset_fls(first_word) : 0;
+    result->meta->max = first ? (word_offset - 1) * BITSET_LITERAL_LENGTH
+        + BITSET_LITERAL_LENGTH - 1 - BITSET_CTZ(last_word) : 0;
+    result->meta->words = word_offset;
+    return result;
+}
+
+static bitset_t *bitset_operation_run(bitset_operation_plan_t *plan) {
+    bitset_t *result, bitset;
+    switch (plan->executor) {
+        case BITSET_EXECUTOR_EMPTY:
+            result = bitset_new();
+            bitset_meta_build(result);
+            break;
+        case BITSET_EXECUTOR_COPY:
+            //The operand's index isn't copied along with it
+            bitset = plan->operation.steps[0]->data.bitset;
+            bitset.index = NULL;
+            result = bitset_copy(&bitset);
+            if (!result->meta) {
+                bitset_meta_build(result);
+            }
+            break;
+        case BITSET_EXECUTOR_MERGE:
+            result = bitset_operation_merge(&plan->operation);
+            break;
+        case BITSET_EXECUTOR_DENSE:
+            result = bitset_operation_exec_dense(&plan->operation,
+                plan->dense_start, plan->dense_words);
+            break;
+        case BITSET_EXECUTOR_KWAY:
+            result = bitset_merge_many(&plan->operation, plan->type);
+            break;
+        default:
+            result = bitset_operation_exec_hash(&plan->operation, plan->words);
+            break;
+    }
+    return result;
+}
+
+static bitset_offset bitset_operation_run_count(bitset_operation_plan_t *plan) {
+    bitset_kernel_batch_t batch;
+    bitset_hash_t *words;
+    bitset_word *dense;
+    bitset_offset count;
+    bitset_t *result;
+    if (plan->executor == BITSET_EXECUTOR_MERGE && plan->operation.length == 2) {
+        //A pair of operands is counted without materializing the result
+        return bitset_merge_count(&plan->operation.steps[0]->data.bitset,
+            &plan->operation.steps[1]->data.bitset, plan->operation.steps[1]->type);
+    }
+    switch (plan->executor) {
+        case BITSET_EXECUTOR_EMPTY:
+            count = 0;
+            break;
+        case BITSET_EXECUTOR_COPY:
+            count = bitset_count(&plan->operation.steps[0]->data.bitset);
+            break;
+        case BITSET_EXECUTOR_DENSE:
+            dense = bitset_operation_dense(&plan->operation, plan->dense_start, plan->dense_words);
+            count = bitset_kernel_popcount(dense, plan->dense_words);
+            bitset_malloc_free(dense);
+            break;
+        case BITSET_EXECUTOR_HASH:
+            bitset_kernel_batch_init(&batch);
+            words = bitset_operation_iter(&plan->operation, plan->words);
+            //Empty slots hold a zero word
+            for (size_t i = 0; i < words->size; i++) {
+                bitset_kernel_batch_push(&batch, words->words[i]);
+            }
+            bitset_hash_free(words);
+            count = bitset_kernel_batch_count(&batch);
+            break;
+        default:
+            result = bitset_operation_run(plan);
+            count = bitset_count(result);
+            bitset_free(result);
+            break;
+    }
+    return count;
+}
+
+/**
+ * Operations with fewer operand words than this aren't split across threads.
+ */
+
+#define BITSET_PARALLEL_MIN_WORDS 65536
+
+typedef struct bitset_operation_worker_s {
+    const bitset_operation_t *operation;
+    bitset_offset start;
+    bitset_offset end;
+    bool build;
+    bitset_t *result;
+    bitset_offset count;
+#ifndef BITSET_NO_THREADS
+    pthread_t thread;
+    bool threaded;
+#endif
+} bitset_operation_worker_t;
+
+static inline bool bitset_operation_is_parallel(const bitset_operation_t *operation,
+        const bitset_operation_plan_t *plan) {
+#ifdef BITSET_NO_THREADS
+    return false;
+#else
+    return operation->threads > 1 && plan->words >= BITSET_PARALLEL_MIN_WORDS
+        && plan->executor != BITSET_EXECUTOR_EMPTY && plan->executor != BITSET_EXECUTOR_COPY;
+#endif
+}
+
+/**
+ * Execute the operation over a range of word offsets. Each operand is sliced
+ * to the range by seeking to the start of the range and copying words up to
+ * the end, and the slices are then planned and executed as usual.
+ */
+
+static void *bitset_operation_worker(void *data) {
+    bitset_operation_worker_t *worker = data;
+    const bitset_operation_t *operation = worker->operation;
+    bitset_operation_t *slice = bitset_operation_new(NULL);
+    bitset_operation_step_t *step;
+    const bitset_t *operand;
+    bitset_reader_t reader;
+    bitset_writer_t writer;
+    bitset_t *bitset;
+    bool more;
+    for (size_t i = 0; i < operation->length; i++) {
+        operand = &operation->steps[i]->data.bitset;
+        bitset = bitset_new();
+        bitset_writer_init(&writer, bitset);
+        more = bitset_reader_start(&reader, operand, worker->start);
+        bitset_stream_copy_raw(&reader, &writer, more, worker->end);
+        bitset_writer_finish(&writer);
+        step = bitset_operation_add_step(slice);
+        step->is_nested = true;
+        step->is_operation = false;
+        step->data.bitset = *bitset;
+        step->type = operation->steps[i]->type;
+        bitset_malloc_free(bitset);
+    }
+    if (worker->build) {
+        worker->result = bitset_operation_exec(slice);
+    } else {
+        worker->count = bitset_operation_count(slice);
+    }
+    bitset_operation_free(slice);
+    return NULL;
+}
+
+/**
+ * Split the word offsets spanned by the planned operation into a range per
+ * thread and execute each range.
+ */
+
+static bitset_operation_worker_t *bitset_operation_run_parallel(bitset_operation_plan_t *plan,
+        unsigned threads, bool build) {
+    bitset_operation_worker_t *workers = bitset_malloc(sizeof(bitset_operation_worker_t) * threads);
+    bitset_offset max = 0, width;
+    if (!workers) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < plan->operation.length; i++) {
+        max = BITSET_MAX(max, plan->steps[i].max);
+    }
+    width = max / BITSET_LITERAL_LENGTH / threads + 1;
+    for (unsigned i = 0; i < threads; i++) {
+        workers[i].operation = &plan->operation;
+        workers[i].start = width * i;
+        workers[i].end = i == threads - 1 ? BITSET_OFFSET_MAX : width * (i + 1);
+        workers[i].build = build;
+        workers[i].result = NULL;
+        workers[i].count = 0;
+    }
+#ifndef BITSET_NO_THREADS
+    //Resolve the kernels before any worker uses them
+    bitset_kernel_count(NULL, 0);
+    for (unsigned i = 1; i < threads; i++) {
+        workers[i].threaded = !pthread_create(&workers[i].thread, NULL,
+            bitset_operation_worker, &workers[i]);
+    }
+    bitset_operation_worker(&workers[0]);
+    for (unsigned i = 1; i < threads; i++) {
+        if (workers[i].threaded) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            bitset_operation_worker(&workers[i]);
+        }
+    }
+#else
+    for (unsigned i = 0; i < threads; i++) {
+        bitset_operation_worker(&workers[i]);
+    }
+#endif
+    return workers;
+}
+
+/**
+ * Stitch the results of each range together. The first word of each result
+ * is re-encoded relative to the end of the previous result, so that the gap
+ * between them becomes a single fill (or runs of ones are joined), and the
+ * rest of the result is copied as is.
+ */
+
+static bitset_t *bitset_operation_stitch(bitset_operation_worker_t *workers, unsigned threads) {
+    bitset_t *result = bitset_new(), *part;
+    bitset_reader_t reader;
+    bitset_writer_t writer;
+    size_t rest;
+    result->meta = bitset_calloc(1, sizeof(bitset_meta_t));
+    if (!result->meta) {
+        bitset_oom();
+    }
+    bitset_writer_init(&writer, result);
+    for (unsigned i = 0; i < threads; i++) {
+        part = workers[i].result;
+        if (part->length) {
+            bitset_reader_init(&reader, part->buffer, part->length);
+            bitset_reader_next(&reader);
+            if (reader.ones) {
+                bitset_writer_append_ones(&writer, reader.offset, reader.ones + 1);
+            } else {
+                bitset_writer_append(&writer, reader.offset, reader.word);
+            }
+            rest = part->buffer + part->length - reader.buffer;
+            if (rest) {
+                memcpy(bitset_writer_extend(&writer, rest), reader.buffer, sizeof(bitset_word) * rest);
+                writer.next = part->meta->words;
+            }
+            if (!result->meta->count) {
+                result->meta->min = part->meta->min;
+            }
+            result->meta->count += part->meta->count;
+            result->meta->max = part->meta->max;
+            result->meta->words = part->meta->words;
+        }
+        bitset_free(part);
+    }
+    bitset_writer_finish(&writer);
+    return result;
+}
+
+bitset_t *bitset_operation_exec(bitset_operation_t *operation) {
+    bitset_operation_plan_t plan;
+    bitset_operation_worker_t *workers;
+    bitset_t *result;
+    bitset_operation_plan(operation, &plan);
+    if (bitset_operation_is_parallel(operation, &plan)) {
+        workers = bitset_operation_run_parallel(&plan, operation->threads, true);
+        result = bitset_operation_stitch(workers, operation->threads);
+        bitset_malloc_free(workers);
+    } else {
+        result = bitset_operation_run(&plan);
+    }
+    bitset_operation_plan_free(&plan);
+    return result;
+}
+
+bitset_offset bitset_operation_count(bitset_operation_t *operation) {
+    bitset_operation_plan_t plan;
+    bitset_operation_worker_t *workers;
+    bitset_offset count = 0;
+    bitset_operation_plan(operation, &plan);
+    if (bitset_operation_is_parallel(operation, &plan)) {
+        workers = bitset_operation_run_parallel(&plan, operation->threads, false);
+        for (unsigned i = 0; i < operation->threads; i++) {
+            count += workers[i].count;
+        }
+        bitset_malloc_free(workers);
+    } else {
+        count = bitset_operation_run_count(&plan);
+    }
+    bitset_operation_plan_free(&plan);
+    return count;
+}
+
+/**
+ * Streamed results are written to a small chunk which is passed to the sink
+ * whenever it fills up. The last word is kept back since the writer may still
+ * extend it, e.g. into a longer run of ones. Without a sink the chunk simply
+ * grows into the result.
+ */
+
+#define BITSET_SINK_WORDS 1024
+#define BITSET_SINK_OFFSETS 256
+
+typedef struct bitset_sink_state_s {
+    const bitset_sink_t *sink;
+    void *context;
+    bitset_t chunk;
+    bitset_writer_t writer;
+    bitset_offset base;
+    bitset_offset start;
+    bitset_offset end;
+    bitset_offset limit;
+} bitset_sink_state_t;
+
+static void bitset_sink_init(bitset_sink_state_t *state, const bitset_sink_t *sink,
+        void *context, bitset_offset start, bitset_offset end, bitset_offset limit) {
+    state->sink = sink;
+    state->context = context;
+    state->base = 0;
+    state->start = start;
+    state->end = end;
+    state->limit = limit;
+    state->chunk.buffer = NULL;
+    state->chunk.length = 0;
+    state->chunk.index = NULL;
+    state->chunk.meta = NULL;
+    state->chunk.borrowed = false;
+    state->chunk.version = 0;
+    bitset_writer_init(&state->writer, &state->chunk);
+    if (sink) {
+        bitset_writer_reserve(&state->writer, BITSET_SINK_WORDS * 2);
+    }
+}
+
+static bool bitset_sink_flush(bitset_sink_state_t *state, size_t words) {
+    const bitset_sink_t *sink = state->sink;
+    bitset_offset offsets[BITSET_SINK_OFFSETS], bit = state->base * BITSET_LITERAL_LENGTH;
+    bitset_word *buffer = state->chunk.buffer;
+    bitset_cursor_t cursor;
+    bitset_t view;
+    size_t decoded;
+    if (!sink || !words) {
+        return true;
+    }
+    if (sink->words && !sink->words(buffer, words, state->context)) {
+        return false;
+    }
+    if (sink->offsets) {
+        view.buffer = buffer;
+        view.length = words;
+        view.index = NULL;
+        view.meta = NULL;
+        view.borrowed = true;
+        view.version = 0;
+        bitset_cursor_init(&cursor, &view);
+        while ((decoded = bitset_decode(&view, &cursor, offsets, BITSET_SINK_OFFSETS))) {
+            for (size_t i = 0; i < decoded; i++) {
+                offsets[i] += bit;
+            }
+            if (!sink->offsets(offsets, decoded, state->context)) {
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < words; i++) {
+        state->base += bitset_word_span(buffer[i]);
+    }
+    memmove(buffer, buffer + words, sizeof(bitset_word) * (state->chunk.length - words));
+    state->chunk.length -= words;
+    return true;
+}
+
+/**
+ * Append a run of ones to a streamed result, or as much of the run as the
+ * limit allows.
+ */
+
+static inline void bitset_sink_append_ones(bitset_sink_state_t *state,
+        bitset_offset offset, bitset_offset length) {
+    bitset_offset bits;
+    if (length <= state->limit / BITSET_LITERAL_LENGTH) {
+        bitset_writer_append_ones(&state->writer, offset, length);
+        state->limit -= length * BITSET_LITERAL_LENGTH;
+        return;
+    }
+    length = state->limit / BITSET_LITERAL_LENGTH;
+    bits = state->limit % BITSET_LITERAL_LENGTH;
+    bitset_writer_append_ones(&state->writer, offset, length);
+    if (bits) {
+        bitset_writer_append(&state->writer, offset + length,
+            BITSET_ONES_LITERAL & ~(BITSET_ONES_LITERAL >> bits));
+    }
+    state->limit = 0;
+}
+
+/**
+ * Append a word to a streamed result, dropping the last bits in the word if
+ * it would go over the limit.
+ */
+
+static inline void bitset_sink_append(bitset_sink_state_t *state,
+        bitset_offset offset, bitset_word word) {
+    bitset_offset count = 0;
+    bitset_word tmp = word;
+    BITSET_POP_COUNT(count, tmp);
+    for (; count > state->limit; count--) {
+        word &= word - 1;
+    }
+    bitset_writer_append(&state->writer, offset, word);
+    state->limit -= count;
+}
+
+/**
+ * Stream any operation with a k-way merge. The words of every operand at an
+ * offset are folded in step order, with operands that have no word there
+ * contributing an empty word. When every operand at an offset is in a run of
+ * ones, the folded word holds for the rest of the runs (up to the next offset
+ * of another operand), so the span is written out in one go.
+ *
+ * Only bits in the window [start, end) are streamed, and streaming stops once
+ * the limit is reached. Each operand is started at the window with its index
+ * if it has one, so the cost is proportional to the slice rather than to the
+ * whole bitset.
+ */
+
+static bool bitset_operation_stream(const bitset_operation_t *operation,
+        bitset_sink_state_t *state) {
+    size_t n = operation->length, length = 0, count, index;
+    bitset_reader_t *readers, **heap, **batch;
+    bitset_word *words, word, operand;
+    bitset_offset offset, end, first, last;
+    bool *present, runs, ok = true;
+    first = state->start / BITSET_LITERAL_LENGTH;
+    last = (state->end - 1) / BITSET_LITERAL_LENGTH;
+    readers = bitset_malloc(sizeof(bitset_reader_t) * n);
+    heap = bitset_malloc(sizeof(bitset_reader_t *) * n);
+    batch = bitset_malloc(sizeof(bitset_reader_t *) * n);
+    words = bitset_malloc(sizeof(bitset_word) * n);
+    present = bitset_calloc(n, sizeof(bool));
+    if (!readers || !heap || !batch || !words || !present) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (bitset_reader_start(&readers[i], &operation->steps[i]->data.bitset, first)) {
+            heap[length++] = &readers[i];
+        }
+    }
+    for (size_t i = length / 2; i-- > 0;) {
+        bitset_heap_down(heap, length, i);
+    }
+    while (ok && length && state->limit && heap[0]->offset <= last) {
+        offset = heap[0]->offset;
+        end = last + 1;
+        count = 0;
+        runs = true;
+        while (length && heap[0]->offset == offset) {
+            batch[count++] = heap[0];
+            index = heap[0] - readers;
+            present[index] = true;
+            words[index] = heap[0]->word;
+            if (heap[0]->ones) {
+                end = BITSET_MIN(end, offset + heap[0]->ones + 1);
+            } else {
+                runs = false;
+            }
+            heap[0] = heap[--length];
+            if (length) {
+                bitset_heap_down(heap, length, 0);
+            }
+        }
+        word = 0;
+        for (size_t i = 0; i < n; i++) {
+            operand = present[i] ? words[i] : 0;
+            switch (i ? operation->steps[i]->type : BITSET_OR) {
+                case BITSET_AND:    word &= operand;  break;
+                case BITSET_OR:     word |= operand;  break;
+                case BITSET_XOR:    word ^= operand;  break;
+                case BITSET_ANDNOT: word &= ~operand; break;
+            }
+        }
+        if (runs && length) {
+            end = BITSET_MIN(end, heap[0]->offset);
+        }
+        //Words that are cut by the window are masked one at a time
+        if (offset == first && state->start % BITSET_LITERAL_LENGTH) {
+            runs = false;
+            word &= BITSET_ONES_LITERAL >> (state->start % BITSET_LITERAL_LENGTH);
+        }
+        if (end > last && state->end % BITSET_LITERAL_LENGTH) {
+            if (offset == last) {
+                runs = false;
+                word &= ~(BITSET_ONES_LITERAL >> (state->end % BITSET_LITERAL_LENGTH));
+            } else {
+                end = last;
+            }
+        }
+        if (runs && end > offset + 1) {
+            if (word) {
+                bitset_sink_append_ones(state, offset, end - offset);
+            }
+        } else {
+            end = offset + 1;
+            bitset_sink_append(state, offset, word);
+        }
+        for (size_t i = 0; i < count; i++) {
+            present[batch[i] - readers] = false;
+            if (batch[i]->ones || end > offset + 1 ? bitset_reader_seek(batch[i], end)
+                    : bitset_reader_next(batch[i])) {
+                bitset_heap_push(heap, &length, batch[i]);
+            }
+        }
+        if (state->sink && state->chunk.length > BITSET_SINK_WORDS) {
+            ok = bitset_sink_flush(state, state->chunk.length - 1);
+        }
+    }
+    bitset_malloc_free(readers);
+    bitset_malloc_free(heap);
+    bitset_malloc_free(batch);
+    bitset_malloc_free(words);
+    bitset_malloc_free(present);
+    return ok && bitset_sink_flush(state, state->chunk.length);
+}
+
+bool bitset_operation_exec_to(bitset_operation_t *operation, const bitset_sink_t *sink,
+        void *context) {
+    bitset_operation_plan_t plan;
+    bitset_sink_state_t state;
+    bool ok = true;
+    bitset_operation_plan(operation, &plan);
+    if (plan.executor != BITSET_EXECUTOR_EMPTY) {
+        bitset_sink_init(&state, sink, context, 0, BITSET_OFFSET_MAX, BITSET_OFFSET_MAX);
+        ok = bitset_operation_stream(&plan.operation, &state);
+        bitset_malloc_free(state.chunk.buffer);
+    }
+    bitset_operation_plan_free(&plan);
+    return ok;
+}
+
+/**
+ * Execute the operation over a window of bits, stopping at the limit.
+ */
+
+static bitset_t *bitset_operation_exec_window(bitset_operation_t *operation,
+        bitset_offset start, bitset_offset end, bitset_offset limit) {
+    bitset_operation_plan_t plan;
+    bitset_sink_state_t state;
+    bitset_t *result = bitset_new();
+    bitset_operation_plan(operation, &plan);
+    if (plan.executor != BITSET_EXECUTOR_EMPTY && start < end && limit) {
+        bitset_sink_init(&state, NULL, NULL, start, end, limit);
+        bitset_operation_stream(&plan.operation, &state);
+        result->buffer = state.chunk.buffer;
+        result->length = state.chunk.length;
+    }
+    bitset_operation_plan_free(&plan);
+    bitset_meta_build(result);
+    return result;
+}
+
+bitset_t *bitset_operation_exec_range(bitset_operation_t *operation,
+        bitset_offset start, bitset_offset end) {
+    return bitset_operation_exec_window(operation, start, end, BITSET_OFFSET_MAX);
+}
+
+bitset_t *bitset_operation_exec_limit(bitset_operation_t *operation,
+        bitset_offset start, bitset_offset limit) {
+    return bitset_operation_exec_window(operation, start, BITSET_OFFSET_MAX, limit);
+}
+
+void bitset_operation_explain(bitset_operation_t *operation, FILE *stream) {
+    static const char *executors[] = { "empty", "copy", "merge", "dense", "k-way merge", "hash" };
+    static const char *types[] = { "and", "or", "xor", "andnot" };
+    bitset_operation_plan_t plan;
+    bitset_operation_plan_step_t *step;
+    bitset_operation_plan(operation, &plan);
+    fprintf(stream, "executor: %s\n", executors[plan.executor]);
+    if (plan.skipped) {
+        fprintf(stream, "skipped: %zu steps before an empty result\n", plan.skipped);
+    }
+    if (plan.executor == BITSET_EXECUTOR_DENSE) {
+        fprintf(stream, "dense words: %zu from " bitset_format "\n",
+            plan.dense_words, plan.dense_start);
+    }
+    for (size_t i = 0; i < plan.operation.length; i++) {
+        step = &plan.steps[i];
+        fprintf(stream, "%zu: %-6s step %zu, %zu words, min " bitset_format ", max "
+            bitset_format "\n", i, i ? types[step->step.type] : "load", step->index,
+            step->words, step->min, step->max);
+    }
+    bitset_operation_plan_free(&plan);
+}
+
+/**
+ * A compiled operation is a list of nodes, one for each operation in the
+ * tree, where nodes come before the node that they're nested in. Each node
+ * keeps a view of its steps that's refilled from the bound slots and the
+ * results of nested nodes on every execution, so that nothing is consumed.
+ */
+
+typedef struct bitset_compiled_input_s {
+    bool is_node;
+    size_t index;
+} bitset_compiled_input_t;
+
+typedef struct bitset_compiled_node_s {
+    bitset_operation_t operation;
+    bitset_operation_step_t *steps;
+    bitset_compiled_input_t *inputs;
+    bitset_t *result;
+} bitset_compiled_node_t;
+
+struct bitset_compiled_s {
+    bitset_compiled_node_t *nodes;
+    size_t length;
+    const bitset_t **slots;
+    size_t slot_count;
+};
+
+static size_t bitset_compile_node(bitset_compiled_t *compiled, const bitset_operation_t *operation) {
+    bitset_compiled_input_t *inputs = NULL;
+    bitset_compiled_node_t *node;
+    bitset_operation_step_t *step;
+    if (operation->length) {
+        inputs = bitset_malloc(sizeof(bitset_compiled_input_t) * operation->length);
+        if (!inputs) {
+            bitset_oom();
+        }
+    }
+    for (size_t i = 0; i < operation->length; i++) {
+        step = operation->steps[i];
+        if (step->is_operation) {
+            inputs[i].is_node = true;
+            inputs[i].index = bitset_compile_node(compiled, step->data.nested);
+            continue;
+        }
+        if (compiled->slot_count % 8 == 0) {
+            compiled->slots = bitset_realloc(compiled->slots,
+                sizeof(const bitset_t *) * (compiled->slot_count + 8));
+            if (!compiled->slots) {
+                bitset_oom();
+            }
+        }
+        inputs[i].is_node = false;
+        inputs[i].index = compiled->slot_count;
+        compiled->slots[compiled->slot_count++] = &step->data.bitset;
+    }
+    if (compiled->length % 8 == 0) {
+        compiled->nodes = bitset_realloc(compiled->nodes,
+            sizeof(bitset_compiled_node_t) * (compiled->length + 8));
+        if (!compiled->nodes) {
+            bitset_oom();
+        }
+    }
+    node = &compiled->nodes[compiled->length];
+    node->inputs = inputs;
+    node->result = NULL;
+    node->steps = NULL;
+    node->operation.steps = NULL;
+    node->operation.length = operation->length;
+    node->operation.threads = operation->threads;
+    node->operation.cache = NULL;
+    if (operation->length) {
+        node->steps = bitset_malloc(sizeof(bitset_operation_step_t) * operation->length);
+        node->operation.steps = bitset_malloc(sizeof(bitset_operation_step_t *) * operation->length);
+        if (!node->steps || !node->operation.steps) {
+            bitset_oom();
+        }
+    }
+    for (size_t i = 0; i < operation->length; i++) {
+        node->steps[i].is_nested = false;
+        node->steps[i].is_operation = false;
+        node->steps[i].type = operation->steps[i]->type;
+        node->operation.steps[i] = &node->steps[i];
+    }
+    return compiled->length++;
+}
+
+bitset_compiled_t *bitset_operation_compile(const bitset_operation_t *operation) {
+    bitset_compiled_t *compiled = bitset_malloc(sizeof(bitset_compiled_t));
+    if (!compiled) {
+        bitset_oom();
+    }
+    compiled->nodes = NULL;
+    compiled->length = 0;
+    compiled->slots = NULL;
+    compiled->slot_count = 0;
+    bitset_compile_node(compiled, operation);
+    return compiled;
+}
+
+size_t bitset_compiled_slots(const bitset_compiled_t *compiled) {
+    return compiled->slot_count;
+}
+
+void bitset_compiled_bind(bitset_compiled_t *compiled, size_t slot, const bitset_t *bitset) {
+    assert(slot < compiled->slot_count);
+    compiled->slots[slot] = bitset;
+}
+
+/**
+ * Execute each nested node and fill in the steps of the root node.
+ */
+
+static bitset_operation_t *bitset_compiled_prepare(bitset_compiled_t *compiled) {
+    bitset_compiled_node_t *node;
+    bitset_t *bitset;
+    for (size_t n = 0; n < compiled->length; n++) {
+        node = &compiled->nodes[n];
+        for (size_t i = 0; i < node->operation.length; i++) {
+            if (node->inputs[i].is_node) {
+                bitset = compiled->nodes[node->inputs[i].index].result;
+            } else {
+                bitset = (bitset_t *) compiled->slots[node->inputs[i].index];
+            }
+            node->steps[i].data.bitset = *bitset;
+            node->steps[i].data.bitset.index = NULL;
+            node->steps[i].data.bitset.borrowed = true;
+        }
+        if (n + 1 == compiled->length) {
+            break;
+        }
+        node->result = bitset_operation_exec(&node->operation);
+        //Nested results are only needed by the node they're nested in
+        for (size_t i = 0; i < node->operation.length; i++) {
+            if (node->inputs[i].is_node) {
+                bitset_free(compiled->nodes[node->inputs[i].index].result);
+                compiled->nodes[node->inputs[i].index].result = NULL;
+            }
+        }
+    }
+    return &compiled->nodes[compiled->length - 1].operation;
+}
+
+/**
+ * Free the results of the nodes nested in the root node.
+ */
+
+static void bitset_compiled_finish(bitset_compiled_t *compiled) {
+    for (size_t n = 0; n < compiled->length; n++) {
+        if (compiled->nodes[n].result) {
+            bitset_free(compiled->nodes[n].result);
+            compiled->nodes[n].result = NULL;
+        }
+    }
+}
+
+bitset_t *bitset_compiled_exec(bitset_compiled_t *compiled) {
+    bitset_t *result = bitset_operation_exec(bitset_compiled_prepare(compiled));
+    bitset_compiled_finish(compiled);
+    return result;
+}
+
+bitset_offset bitset_compiled_count(bitset_compiled_t *compiled) {
+    bitset_offset count = bitset_operation_count(bitset_compiled_prepare(compiled));
+    bitset_compiled_finish(compiled);
+    return count;
+}
+
+void bitset_compiled_free(bitset_compiled_t *compiled) {
+    for (size_t n = 0; n < compiled->length; n++) {
+        bitset_malloc_free(compiled->nodes[n].steps);
+        bitset_malloc_free(compiled->nodes[n].operation.steps);
+        bitset_malloc_free(compiled->nodes[n].inputs);
+    }
+    bitset_malloc_free(compiled->nodes);
+    bitset_malloc_free(compiled->slots);
+    bitset_malloc_free(compiled);
+}
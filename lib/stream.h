@@ -0,0 +1,469 @@
+#ifndef BITSET_STREAM_H_
+#define BITSET_STREAM_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitset/bitset.h"
+#include "bitset/malloc.h"
+
+/**
+ * Word streams are used internally to walk a compressed buffer one
+ * uncompressed word at a time and to write canonically compressed buffers.
+ *
+ * Offsets in a stream are logical word offsets, i.e. the word at offset N
+ * holds bits N * BITSET_LITERAL_LENGTH through (N + 1) * BITSET_LITERAL_LENGTH - 1.
+ */
+
+typedef struct bitset_reader_s {
+    const bitset_word *buffer;
+    const bitset_word *end;
+    bitset_offset next;
+    bitset_offset offset;
+    bitset_offset ones;
+    bitset_word word;
+} bitset_reader_t;
+
+typedef struct bitset_writer_s {
+    bitset_t *bitset;
+    bitset_offset next;
+    size_t size;
+} bitset_writer_t;
+
+static inline unsigned char bitset_stream_fls(bitset_word word) {
+    return (BITSET_CLZ(word)-1);
+}
+
+/**
+ * Get the number of logical words that a compressed word spans.
+ */
+
+static inline bitset_offset bitset_word_span(bitset_word word) {
+    if (BITSET_IS_FILL_WORD(word)) {
+        return BITSET_GET_LENGTH(word) + (BITSET_GET_POSITION(word) ? 1 : 0);
+    }
+    return 1;
+}
+
+static inline void bitset_reader_init(bitset_reader_t *reader,
+        const bitset_word *buffer, size_t length) {
+    reader->buffer = buffer;
+    reader->end = buffer + length;
+    reader->next = 0;
+    reader->offset = 0;
+    reader->ones = 0;
+    reader->word = 0;
+}
+
+/**
+ * Advance to the next uncompressed word. Runs of empty words are skipped
+ * over, and fills with a position are returned as a single-bit literal. A
+ * run of ones is returned one word at a time, with `ones` holding the number
+ * of words left in the run after the current one.
+ */
+
+static inline bool bitset_reader_next(bitset_reader_t *reader) {
+    bitset_word word;
+    unsigned position;
+    if (reader->ones) {
+        reader->ones--;
+        reader->offset = reader->next++;
+        return true;
+    }
+    while (reader->buffer < reader->end) {
+        word = *reader->buffer++;
+        if (BITSET_IS_ONE_FILL(word)) {
+            if (!BITSET_GET_LENGTH(word)) {
+                continue;
+            }
+            reader->ones = BITSET_GET_LENGTH(word) - 1;
+            word = BITSET_ONES_LITERAL;
+        } else if (BITSET_IS_FILL_WORD(word)) {
+            reader->next += BITSET_GET_LENGTH(word);
+            position = BITSET_GET_POSITION(word);
+            if (!position) {
+                continue;
+            }
+            word = BITSET_CREATE_LITERAL(position - 1);
+        }
+        reader->offset = reader->next++;
+        reader->word = word;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Advance from the current word to the first non-empty word at or after the
+ * specified offset without expanding the words in between. Returns false once
+ * the buffer is exhausted.
+ */
+
+static inline bool bitset_reader_seek(bitset_reader_t *reader, bitset_offset offset) {
+    if (reader->offset >= offset) {
+        return true;
+    }
+    if (offset - reader->offset > reader->ones) {
+        reader->next += reader->ones;
+        reader->ones = 0;
+        bitset_offset span;
+        while (reader->buffer < reader->end) {
+            span = bitset_word_span(*reader->buffer);
+            if (reader->next + span > offset) {
+                break;
+            }
+            reader->next += span;
+            reader->buffer++;
+        }
+        if (!bitset_reader_next(reader)) {
+            return false;
+        } else if (reader->offset >= offset) {
+            return true;
+        }
+    }
+    //The offset is inside the current run of ones
+    reader->ones -= offset - reader->offset;
+    reader->offset = offset;
+    reader->next = offset + 1;
+    return true;
+}
+
+/**
+ * Find the last sample that starts at or before the logical word offset.
+ */
+
+static inline const bitset_index_sample_t *bitset_index_lookup(const bitset_index_t *index,
+        bitset_offset word_offset) {
+    if (!index || !index->length) {
+        return NULL;
+    }
+    size_t low = 0, high = index->length, mid;
+    while (high - low > 1) {
+        mid = low + (high - low) / 2;
+        if (index->samples[mid].offset <= word_offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return &index->samples[low];
+}
+
+/**
+ * Start a reader at the first non-empty word at or after the specified offset.
+ * If the bitset has an index, the reader starts from the last sample at or
+ * before the offset rather than from the start of the buffer. Returns false if
+ * there are no words at or after the offset.
+ */
+
+static inline bool bitset_reader_start(bitset_reader_t *reader, const bitset_t *bitset,
+        bitset_offset offset) {
+    const bitset_index_sample_t *sample = bitset_index_lookup(bitset->index, offset);
+    size_t word = sample ? sample->word : 0;
+    bitset_reader_init(reader, bitset->buffer + word, bitset->length - word);
+    reader->next = sample ? sample->offset : 0;
+    return bitset_reader_next(reader) && bitset_reader_seek(reader, offset);
+}
+
+/**
+ * Version 1 buffers use the one-fill bit as the top bit of the fill length.
+ * Such a fill can be detected if it carries a position, since one-fills never
+ * do, but without a position it can't be told apart from a one-fill. Unless
+ * the encoding has been stated, buffers with either kind of word are rejected
+ * as ambiguous. Words are copied out since imported buffers may not be word
+ * aligned.
+ */
+
+static inline bool bitset_encoding_check(const char *buffer, size_t words, bool stated) {
+    bitset_word word;
+    for (size_t i = 0; i < words; i++) {
+        memcpy(&word, buffer + i * sizeof(bitset_word), sizeof(bitset_word));
+        if (BITSET_IS_ONE_FILL(word) && (!stated || BITSET_GET_POSITION(word))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Convert version 1 words to the current encoding, splitting fills that are
+ * too long for the current length field. Returns the number of words written,
+ * or the number that would be written if the output is NULL.
+ */
+
+static inline size_t bitset_encoding_upgrade(const char *buffer, size_t words,
+        bitset_word *output) {
+    bitset_word word, length;
+    size_t count = 0;
+    for (size_t i = 0; i < words; i++) {
+        memcpy(&word, buffer + i * sizeof(bitset_word), sizeof(bitset_word));
+        if (BITSET_IS_FILL_WORD(word) && (word & BITSET_ONES_BIT)) {
+            length = word & (BITSET_ONES_BIT | BITSET_LENGTH_MASK);
+            for (; length > BITSET_MAX_LENGTH; length -= BITSET_MAX_LENGTH) {
+                if (output) {
+                    output[count] = BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH);
+                }
+                count++;
+            }
+            //The position follows the whole span, so it stays on the last fill
+            word = (word & (BITSET_FILL_BIT | BITSET_POSITION_MASK)) | length;
+        }
+        if (output) {
+            output[count] = word;
+        }
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Load the next non-empty word into a cursor. Returns false once the cursor's
+ * buffer is exhausted.
+ */
+
+static inline bool bitset_cursor_load(bitset_cursor_t *cursor) {
+    bitset_word word;
+    unsigned position;
+    if (cursor->ones) {
+        cursor->ones--;
+        cursor->offset = cursor->next++;
+        cursor->word = BITSET_ONES_LITERAL;
+        return true;
+    }
+    while (cursor->buffer < cursor->end) {
+        word = *cursor->buffer++;
+        if (BITSET_IS_ONE_FILL(word)) {
+            if (!BITSET_GET_LENGTH(word)) {
+                continue;
+            }
+            cursor->ones = BITSET_GET_LENGTH(word) - 1;
+            word = BITSET_ONES_LITERAL;
+        } else if (BITSET_IS_FILL_WORD(word)) {
+            cursor->next += BITSET_GET_LENGTH(word);
+            position = BITSET_GET_POSITION(word);
+            if (!position) {
+                continue;
+            }
+            word = BITSET_CREATE_LITERAL(position - 1);
+        }
+        cursor->offset = cursor->next++;
+        if (word) {
+            cursor->word = word;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void bitset_writer_init(bitset_writer_t *writer, bitset_t *bitset) {
+    writer->bitset = bitset;
+    writer->next = 0;
+    writer->size = 0;
+    if (bitset->length) {
+        BITSET_NEXT_POW2(writer->size, bitset->length);
+    }
+}
+
+/**
+ * Make room for at least `words` more words so that the buffer doesn't have
+ * to grow while writing, e.g. when an upper bound on the output is known.
+ */
+
+static inline void bitset_writer_reserve(bitset_writer_t *writer, size_t words) {
+    bitset_t *bitset = writer->bitset;
+    size_t size;
+    BITSET_NEXT_POW2(size, bitset->length + words);
+    if (size > writer->size) {
+        bitset->buffer = bitset_realloc(bitset->buffer, sizeof(bitset_word) * size);
+        if (!bitset->buffer) {
+            bitset_oom();
+        }
+        writer->size = size;
+    }
+}
+
+/**
+ * Release any reserved space that wasn't written to.
+ */
+
+static inline void bitset_writer_finish(bitset_writer_t *writer) {
+    bitset_t *bitset = writer->bitset;
+    size_t size;
+    if (!bitset->length) {
+        return;
+    }
+    BITSET_NEXT_POW2(size, bitset->length);
+    if (size < writer->size) {
+        bitset->buffer = bitset_realloc(bitset->buffer, sizeof(bitset_word) * size);
+        if (!bitset->buffer) {
+            bitset_oom();
+        }
+        writer->size = size;
+    }
+}
+
+/**
+ * Add words to the end of the buffer and return a pointer to the first one.
+ */
+
+static inline bitset_word *bitset_writer_extend(bitset_writer_t *writer, size_t words) {
+    bitset_t *bitset = writer->bitset;
+    size_t length = bitset->length;
+    if (length + words > writer->size) {
+        bitset_resize(bitset, length + words);
+        BITSET_NEXT_POW2(writer->size, bitset->length);
+    } else {
+        bitset->length += words;
+    }
+    return bitset->buffer + length;
+}
+
+/**
+ * Append an uncompressed word at the specified offset. Offsets must be
+ * strictly increasing. Empty words are dropped, gaps are encoded as fills,
+ * single-bit words following a gap are folded into the fill and consecutive
+ * words with every bit set are merged into a one-fill.
+ */
+
+static inline void bitset_writer_append(bitset_writer_t *writer,
+        bitset_offset offset, bitset_word word) {
+    if (!word) {
+        return;
+    }
+    bitset_t *bitset = writer->bitset;
+    bitset_offset gap = offset - writer->next;
+    bitset_word *out;
+    if (gap > BITSET_MAX_LENGTH) {
+        bitset_offset fills = gap / BITSET_MAX_LENGTH;
+        out = bitset_writer_extend(writer, fills);
+        for (bitset_offset i = 0; i < fills; i++) {
+            out[i] = BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH);
+        }
+        gap -= fills * BITSET_MAX_LENGTH;
+    }
+    if (!gap && word == BITSET_ONES_LITERAL && bitset->length) {
+        bitset_word *last = bitset->buffer + bitset->length - 1;
+        if (*last == BITSET_ONES_LITERAL) {
+            *last = BITSET_CREATE_ONE_FILL(2);
+            writer->next = offset + 1;
+            return;
+        } else if (BITSET_IS_ONE_FILL(*last) && BITSET_GET_LENGTH(*last) < BITSET_MAX_LENGTH) {
+            (*last)++;
+            writer->next = offset + 1;
+            return;
+        }
+    }
+    if (!gap) {
+        *bitset_writer_extend(writer, 1) = word;
+    } else if (BITSET_IS_POW2(word)) {
+        *bitset_writer_extend(writer, 1) = BITSET_CREATE_FILL(gap, bitset_stream_fls(word));
+    } else {
+        out = bitset_writer_extend(writer, 2);
+        out[0] = BITSET_CREATE_EMPTY_FILL(gap);
+        out[1] = word;
+    }
+    writer->next = offset + 1;
+}
+
+/**
+ * Append a run of words with every bit set, starting at the specified offset.
+ */
+
+static inline void bitset_writer_append_ones(bitset_writer_t *writer,
+        bitset_offset offset, bitset_offset length) {
+    if (!length) {
+        return;
+    }
+    bitset_t *bitset = writer->bitset;
+    bitset_offset span, step;
+    bitset_word *last;
+    bitset_writer_append(writer, offset, BITSET_ONES_LITERAL);
+    writer->next = offset + length;
+    length--;
+    while (length) {
+        last = bitset->buffer + bitset->length - 1;
+        span = BITSET_IS_ONE_FILL(*last) ? BITSET_GET_LENGTH(*last) : 1;
+        if (span == BITSET_MAX_LENGTH) {
+            *bitset_writer_extend(writer, 1) = BITSET_ONES_LITERAL;
+            length--;
+            continue;
+        }
+        step = BITSET_MAX_LENGTH - span < length ? BITSET_MAX_LENGTH - span : length;
+        *last = BITSET_CREATE_ONE_FILL(span + step);
+        length -= step;
+    }
+}
+
+/**
+ * Copy words from a reader to a writer until the reader reaches the specified
+ * offset. Runs of ones are copied without being expanded. Returns false once
+ * the reader is exhausted.
+ */
+
+static inline bool bitset_stream_copy(bitset_reader_t *reader, bitset_writer_t *writer,
+        bool more, bitset_offset until) {
+    bitset_offset length;
+    while (more && reader->offset < until) {
+        if (reader->ones) {
+            length = reader->ones + 1;
+            if (length > until - reader->offset) {
+                length = until - reader->offset;
+            }
+            bitset_writer_append_ones(writer, reader->offset, length);
+            more = bitset_reader_seek(reader, reader->offset + length);
+        } else {
+            bitset_writer_append(writer, reader->offset, reader->word);
+            more = bitset_reader_next(reader);
+        }
+    }
+    return more;
+}
+
+/**
+ * Copy words from a reader to a writer like bitset_stream_copy(), except that
+ * compressed words which end before the offset are copied as is rather than
+ * re-encoded. The output is only canonical if the input is.
+ */
+
+static inline bool bitset_stream_copy_raw(bitset_reader_t *reader, bitset_writer_t *writer,
+        bool more, bitset_offset until) {
+    bitset_offset length, next;
+    const bitset_word *end;
+    while (more && reader->offset < until) {
+        if (reader->ones) {
+            length = reader->ones + 1;
+            if (length > until - reader->offset) {
+                length = until - reader->offset;
+            }
+            bitset_writer_append_ones(writer, reader->offset, length);
+            more = bitset_reader_seek(reader, reader->offset + length);
+            continue;
+        }
+        if (!reader->word) {
+            //Empty literals aren't written, so the writer would lag behind the
+            //reader and the raw words that follow would land too early
+            more = bitset_reader_next(reader);
+            continue;
+        }
+        bitset_writer_append(writer, reader->offset, reader->word);
+        next = reader->next;
+        for (end = reader->buffer; end < reader->end; end++) {
+            if (next + bitset_word_span(*end) > until) {
+                break;
+            }
+            next += bitset_word_span(*end);
+        }
+        if (end > reader->buffer) {
+            memcpy(bitset_writer_extend(writer, end - reader->buffer), reader->buffer,
+                sizeof(bitset_word) * (end - reader->buffer));
+            writer->next = next;
+            reader->next = next;
+            reader->buffer = end;
+        }
+        more = bitset_reader_next(reader);
+    }
+    return more;
+}
+
+#endif
@@ -6,6 +6,8 @@
 
 #include "bitset/malloc.h"
 #include "bitset/vector.h"
+#include "cache.h"
+#include "stream.h"
 
 bitset_vector_t *bitset_vector_new() {
     bitset_vector_t *vector = bitset_malloc(sizeof(bitset_vector_t));
@@ -19,6 +21,7 @@ bitset_vector_t *bitset_vector_new() {
     vector->tail_offset = 0;
     vector->size = 1;
     vector->length = 0;
+    vector->version = bitset_version_new();
     return vector;
 }
 
@@ -54,6 +57,7 @@ void bitset_vector_resize(bitset_vector_t *vector, size_t length) {
         vector->size = new_size;
     }
     vector->length = length;
+    vector->version++;
 }
 
 char *bitset_vector_export(const bitset_vector_t *vector) {
@@ -73,18 +77,62 @@ void bitset_vector_init(bitset_vector_t *vector) {
     }
 }
 
-bitset_vector_t *bitset_vector_import(const char *buffer, size_t length) {
+/**
+ * Rebuild a vector of version 1 bitsets in the current encoding. Converting a
+ * bitset may change its length, so each bitset is pushed to a new vector.
+ */
+
+static bitset_vector_t *bitset_vector_upgrade(bitset_vector_t *vector) {
+    bitset_vector_t *upgraded = bitset_vector_new();
+    bitset_t bitset, *copy;
+    unsigned offset = 0;
+    char *buffer = vector->buffer;
+    while (buffer < vector->buffer + vector->length) {
+        buffer = bitset_vector_advance(buffer, &bitset, &offset);
+        copy = bitset_new_encoded_buffer((const char *) bitset.buffer,
+            bitset.length * sizeof(bitset_word), BITSET_ENCODING_V1);
+        bitset_vector_push(upgraded, copy, offset);
+        bitset_free(copy);
+    }
+    bitset_vector_free(vector);
+    return upgraded;
+}
+
+static bitset_vector_t *bitset_vector_import_checked(const char *buffer, size_t length,
+        enum bitset_encoding encoding, bool stated) {
     bitset_vector_t *vector = bitset_vector_new();
+    bitset_t bitset;
+    unsigned offset = 0;
+    char *next;
     if (length) {
         bitset_vector_resize(vector, length);
         if (buffer) {
             memcpy(vector->buffer, buffer, length);
             bitset_vector_init(vector);
+            if (encoding != BITSET_ENCODING_CURRENT) {
+                return bitset_vector_upgrade(vector);
+            }
+            for (next = vector->buffer; next < vector->buffer + vector->length;) {
+                next = bitset_vector_advance(next, &bitset, &offset);
+                if (!bitset_encoding_check((const char *) bitset.buffer, bitset.length, stated)) {
+                    bitset_vector_free(vector);
+                    return NULL;
+                }
+            }
         }
     }
     return vector;
 }
 
+bitset_vector_t *bitset_vector_import(const char *buffer, size_t length) {
+    return bitset_vector_import_checked(buffer, length, BITSET_ENCODING_CURRENT, false);
+}
+
+bitset_vector_t *bitset_vector_import_encoded(const char *buffer, size_t length,
+        enum bitset_encoding encoding) {
+    return bitset_vector_import_checked(buffer, length, encoding, true);
+}
+
 static inline size_t bitset_encoded_length_required_bytes(size_t length) {
     return (length >= (1 << 15)) * 2 + 2;
 }
@@ -125,6 +173,10 @@ char *bitset_vector_advance(char *buffer, bitset_t *bitset, unsigned *offset) {
     bitset->length = bitset_encoded_length(buffer);
     buffer += bitset_encoded_length_size(buffer);
     bitset->buffer = (bitset_word *) buffer;
+    bitset->index = NULL;
+    bitset->meta = NULL;
+    bitset->borrowed = true;
+    bitset->version = 0;
     return buffer + bitset->length * sizeof(bitset_word);
 }
 
@@ -255,6 +307,7 @@ bitset_vector_operation_t *bitset_vector_operation_new(bitset_vector_t *vector)
     }
     operation->length = operation->max = 0;
     operation->min = UINT_MAX;
+    operation->cache = NULL;
     if (vector) {
         bitset_vector_operation_add(operation, vector, BITSET_OR);
     }
@@ -342,6 +395,36 @@ void bitset_vector_operation_add_nested(bitset_vector_operation_t *operation,
     operation->max = BITSET_MAX(operation->max, nested->max);
 }
 
+void bitset_vector_operation_cache(bitset_vector_operation_t *operation, bitset_cache_t *cache) {
+    operation->cache = cache;
+}
+
+/**
+ * Execute a nested operation, or copy its result from the cache.
+ */
+
+static bitset_vector_t *bitset_vector_operation_exec_nested(bitset_vector_operation_t *operation,
+        bitset_vector_operation_t *nested) {
+    bitset_cache_key_t key;
+    bitset_vector_t *vector;
+    if (!operation->cache) {
+        return bitset_vector_operation_exec(nested);
+    }
+    if (!nested->cache) {
+        nested->cache = operation->cache;
+    }
+    if (!bitset_cache_key_vector_operation(&key, nested)) {
+        bitset_cache_key_free(&key);
+        return bitset_vector_operation_exec(nested);
+    }
+    if (!(vector = bitset_cache_get_vector(operation->cache, &key))) {
+        vector = bitset_vector_operation_exec(nested);
+        bitset_cache_put_vector(operation->cache, &key, vector);
+    }
+    bitset_cache_key_free(&key);
+    return vector;
+}
+
 void bitset_vector_operation_add_data(bitset_vector_operation_t *operation,
         void *data, enum bitset_operation_type type) {
     bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
@@ -405,7 +488,7 @@ bitset_vector_t *bitset_vector_operation_exec(bitset_vector_operation_t *operati
     //Recursively flatten nested operations
     for (size_t i = 0; i < operation->length; i++) {
         if (operation->steps[i]->is_operation) {
-            vector = bitset_vector_operation_exec(operation->steps[i]->data.operation);
+            vector = bitset_vector_operation_exec_nested(operation, operation->steps[i]->data.operation);
             bitset_vector_operation_free(operation->steps[i]->data.operation);
             operation->steps[i]->data.vector = vector;
             operation->steps[i]->is_operation = false;
@@ -167,7 +167,95 @@ void stress_exec(unsigned bitsets, unsigned bits, unsigned max) {
     bitset_malloc_free(offsets);
 }
 
+void stress_decode(unsigned bits, unsigned max, unsigned count) {
+    float start, end;
+    bitset_offset offset, sum, decoded, chunk[1024];
+    bitset_offset *offsets = bitset_malloc(sizeof(bitset_offset) * bits);
+    for (size_t j = 0; j < bits; j++) {
+        offsets[j] = bitset_rand() % max;
+    }
+    bitset_t *b = bitset_new_bits(offsets, bits);
+    bitset_malloc_free(offsets);
+
+    //Materialise the offsets using an iterator
+    start = (float) clock();
+    sum = 0;
+    for (size_t j = 0; j < count; j++) {
+        bitset_iterator_t *i = bitset_iterator_new(b);
+        BITSET_FOREACH(i, offset) {
+            sum += offset;
+        }
+        bitset_iterator_free(i);
+    }
+    end = ((float) clock() - start) / CLOCKS_PER_SEC;
+    printf("Iterated bits (checksum " bitset_format ") using an iterator in %.2fs\n", sum, end);
+
+    //Decode in chunks using each kernel
+    const char *kernels[] = { "generic", "popcnt", "avx2", "avx512" };
+    for (int k = BITSET_KERNEL_GENERIC; k < BITSET_KERNEL_BEST; k++) {
+        if (bitset_kernel_select(k) != k) {
+            break;
+        }
+        start = (float) clock();
+        sum = 0;
+        for (size_t j = 0; j < count; j++) {
+            bitset_cursor_t cursor;
+            bitset_cursor_init(&cursor, b);
+            while ((decoded = bitset_decode(b, &cursor, chunk, 1024))) {
+                for (size_t x = 0; x < decoded; x++) {
+                    sum += chunk[x];
+                }
+            }
+        }
+        end = ((float) clock() - start) / CLOCKS_PER_SEC;
+        printf("Iterated bits (checksum " bitset_format ") using %s decode in %.2fs\n", sum, kernels[k], end);
+    }
+    bitset_kernel_select(BITSET_KERNEL_BEST);
+    bitset_free(b);
+}
+
+void stress_count(unsigned bits, unsigned max, unsigned count) {
+    float start, end;
+    bitset_offset sum;
+    bitset_offset *offsets = bitset_malloc(sizeof(bitset_offset) * bits);
+    for (size_t j = 0; j < bits; j++) {
+        offsets[j] = bitset_rand() % max;
+    }
+    bitset_t *b = bitset_new_bits(offsets, bits);
+    bitset_malloc_free(offsets);
+    bitset_countn_t *countn = bitset_countn_new(2, max);
+    bitset_countn_add(countn, b);
+
+    const char *kernels[] = { "generic", "popcnt", "avx2", "avx512" };
+    for (int k = BITSET_KERNEL_GENERIC; k < BITSET_KERNEL_BEST; k++) {
+        if (bitset_kernel_select(k) != k) {
+            break;
+        }
+        start = (float) clock();
+        sum = 0;
+        for (size_t j = 0; j < count; j++) {
+            sum += bitset_count(b);
+            sum += bitset_countn_count(countn);
+        }
+        end = ((float) clock() - start) / CLOCKS_PER_SEC;
+        printf("Counted bits (checksum " bitset_format ") using %s popcount in %.2fs\n", sum, kernels[k], end);
+    }
+    bitset_kernel_select(BITSET_KERNEL_BEST);
+    bitset_countn_free(countn);
+    bitset_free(b);
+}
+
 int main(int argc, char **argv) {
+    printf("Decoding a sparse bitset with 1M bits between 1->100M\n");
+    stress_decode(1000000, 100000000, 20);
+
+    printf("\nDecoding a dense bitset with 1M bits between 1->2M\n");
+    stress_decode(1000000, 2000000, 20);
+
+    printf("\nCounting a dense bitset with 10M bits between 1->20M\n");
+    stress_count(10000000, 20000000, 200);
+
+    printf("\n");
     printf("Testing 100k small operations\n");
     stress_small(10, 1000000, 100000);
 
@@ -11,7 +11,7 @@
 void bitset_dump(bitset_t *b) {
     printf("\x1B[33mDumping bitset of size %u\x1B[0m\n", (unsigned)b->length);
     for (size_t i = 0; i < b->length; i++) {
-        printf("\x1B[36m%3zu.\x1B[0m %-8x\n", i, b->buffer[i]);
+        printf("\x1B[36m%3zu.\x1B[0m %-8llx\n", i, (unsigned long long)b->buffer[i]);
     }
 }
 
@@ -30,7 +30,7 @@ TEST_DEFINE(bool, bool, "%d")
 TEST_DEFINE(str, char *, "%s")
 TEST_DEFINE(hex, int, "%#x")
 
-bool test_bitset(char *title, bitset_t *b, unsigned length, uint32_t *expected) {
+bool test_bitset(char *title, bitset_t *b, unsigned length, bitset_word *expected) {
     bool mismatch = length != b->length;
     if (!mismatch) {
         for (size_t i = 0; i < length; i++) {
@@ -46,12 +46,12 @@ bool test_bitset(char *title, bitset_t *b, unsigned length, uint32_t *expected)
         for (size_t i = 0; i < length_max; i++) {
             printf("  \x1B[36m%3zu.\x1B[0m ", i);
             if (i < b->length) {
-                printf("%-8x ", b->buffer[i]);
+                printf("%-8llx ", (unsigned long long)b->buffer[i]);
             } else {
                 printf("         ");
             }
             if (i < length) {
-                printf("\x1B[32m%-8x\x1B[0m", expected[i]);
+                printf("\x1B[32m%-8llx\x1B[0m", (unsigned long long)expected[i]);
             }
             putchar('\n');
         }
@@ -77,6 +77,50 @@ int main(int argc, char **argv) {
     test_suite_vector_operation();
     printf("Testing estimate algorithms\n");
     test_suite_estimate();
+    printf("Testing skip index\n");
+    test_suite_index();
+    printf("Testing set many\n");
+    test_suite_set_many();
+    printf("Testing cursor\n");
+    test_suite_cursor();
+    printf("Testing decode\n");
+    test_suite_decode();
+    printf("Testing popcount kernels\n");
+    test_suite_popcount();
+    printf("Testing rank / select\n");
+    test_suite_rank();
+    printf("Testing metadata\n");
+    test_suite_meta();
+    printf("Testing views\n");
+    test_suite_view();
+    printf("Testing encodings\n");
+    test_suite_encoding();
+    printf("Testing ranges\n");
+    test_suite_range();
+    printf("Testing new bits\n");
+    test_suite_new_bits();
+    printf("Testing merge kernels\n");
+    test_suite_merge();
+    printf("Testing operation plans\n");
+    test_suite_plan();
+    printf("Testing parallel operations\n");
+    test_suite_parallel();
+    printf("Testing compiled operations\n");
+    test_suite_compiled();
+    printf("Testing operation caches\n");
+    test_suite_cache();
+    printf("Testing thresholds\n");
+    test_suite_threshold();
+    printf("Testing in-place operations\n");
+    test_suite_into();
+    printf("Testing operation sinks\n");
+    test_suite_sink();
+    printf("Testing windowed operations\n");
+    test_suite_window();
+    printf("Testing predicates\n");
+    test_suite_predicates();
+    printf("Testing cardinality\n");
+    test_suite_cardinality();
     printf("Testing stress\n");
     test_suite_stress();
     printf("OK\n");
@@ -88,25 +132,26 @@ void test_suite_get() {
         test_bool("Testing initial bits are unset\n", false, bitset_get(b, i));
     bitset_free(b);
 
-    uint32_t p1[] = { BITSET_CREATE_EMPTY_FILL(0), BITSET_CREATE_LITERAL(30) };
+#ifndef BITSET_64BIT_WORDS
+    bitset_word p1[] = { BITSET_CREATE_EMPTY_FILL(0), BITSET_CREATE_LITERAL(30) };
     b = bitset_new_buffer((const char *)p1, 8);
     test_bool("Testing get in the first literal 1\n", true, bitset_get(b, 30));
     test_bool("Testing get in the first literal 2\n", false, bitset_get(b, 31));
     bitset_free(b);
 
-    uint32_t p2[] = { BITSET_CREATE_EMPTY_FILL(0), BITSET_CREATE_LITERAL(0) };
+    bitset_word p2[] = { BITSET_CREATE_EMPTY_FILL(0), BITSET_CREATE_LITERAL(0) };
     b = bitset_new_buffer((const char *)p2, 8);
     test_bool("Testing get in the first literal 3\n", true, bitset_get(b, 0));
     test_bool("Testing get in the first literal 4\n", false, bitset_get(b, 1));
     bitset_free(b);
 
-    uint32_t p3[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0) };
+    bitset_word p3[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0) };
     b = bitset_new_buffer((const char *)p3, 8);
     test_bool("Testing get in the first literal with offset 1\n", false, bitset_get(b, 1));
     test_bool("Testing get in the first literal with offset 2\n", true, bitset_get(b, 31));
     bitset_free(b);
 
-    uint32_t p4[] = {
+    bitset_word p4[] = {
         BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0)
     };
     b = bitset_new_buffer((const char *)p4, 12);
@@ -115,12 +160,13 @@ void test_suite_get() {
     test_bool("Testing get in the first literal with offset 6\n", true, bitset_get(b, 62));
     bitset_free(b);
 
-    uint32_t p5[] = { BITSET_CREATE_FILL(1, 0) };
+    bitset_word p5[] = { BITSET_CREATE_FILL(1, 0) };
     b = bitset_new_buffer((const char *)p5, 4);
     test_bool("Testing get with position following a fill 1\n", false, bitset_get(b, 0));
     test_bool("Testing get with position following a fill 2\n", true, bitset_get(b, 31));
     test_bool("Testing get with position following a fill 3\n", false, bitset_get(b, 32));
     bitset_free(b);
+#endif
 
     BITSET_NEW(b2, 1, 10, 100);
     test_int("Testing BITSET_NEW macro 1\n", 3, bitset_count(b2));
@@ -157,25 +203,27 @@ void test_suite_count() {
     test_ulong("Testing pop count of empty set\n", 0, bitset_count(b));
     bitset_free(b);
 
-    uint32_t p1[] = { BITSET_CREATE_EMPTY_FILL(0), BITSET_CREATE_LITERAL(0) };
+#ifndef BITSET_64BIT_WORDS
+    bitset_word p1[] = { BITSET_CREATE_EMPTY_FILL(0), BITSET_CREATE_LITERAL(0) };
     b = bitset_new_buffer((const char *)p1, 8);
     test_ulong("Testing pop count of single literal 1\n", 1, bitset_count(b));
     bitset_free(b);
 
-    uint32_t p2[] = { BITSET_CREATE_EMPTY_FILL(0), 0x11111111 };
+    bitset_word p2[] = { BITSET_CREATE_EMPTY_FILL(0), 0x11111111 };
     b = bitset_new_buffer((const char *)p2, 8);
     test_ulong("Testing pop count of single literal 2\n", 8, bitset_count(b));
     bitset_free(b);
 
-    uint32_t p3[] = { BITSET_CREATE_EMPTY_FILL(1) };
+    bitset_word p3[] = { BITSET_CREATE_EMPTY_FILL(1) };
     b = bitset_new_buffer((const char *)p3, 4);
     test_ulong("Testing pop count of single fill 1\n", 0, bitset_count(b));
     bitset_free(b);
 
-    uint32_t p8[] = { BITSET_CREATE_FILL(3, 4) };
+    bitset_word p8[] = { BITSET_CREATE_FILL(3, 4) };
     b = bitset_new_buffer((const char *)p8, 4);
     test_ulong("Testing pop count of fill with position 1\n", 1, bitset_count(b));
     bitset_free(b);
+#endif
 }
 
 void test_suite_min() {
@@ -237,93 +285,111 @@ void test_suite_set() {
     test_bool("Testing set on empty set 5\n", true, bitset_get(b, 31));
     bitset_free(b);
 
-    uint32_t p1[] = { BITSET_CREATE_EMPTY_FILL(1) };
+#ifndef BITSET_64BIT_WORDS
+    bitset_word p1[] = { BITSET_CREATE_EMPTY_FILL(1) };
     b = bitset_new_buffer((const char *)p1, 4);
     test_bool("Testing append after fill 1\n", false, bitset_set_to(b, 93, true));
-    uint32_t e1[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_FILL(2, 0) };
+    bitset_word e1[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_FILL(2, 0) };
     test_bitset("Testing append after fill 2", b, 2, e1);
     bitset_free(b);
 
-    uint32_t p2[] = { BITSET_CREATE_FILL(1, 0) };
+    bitset_word p2[] = { BITSET_CREATE_FILL(1, 0) };
     b = bitset_new_buffer((const char *)p2, 4);
     test_bool("Testing append after fill 3\n", false, bitset_set_to(b, 93, true));
-    uint32_t e2[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 0) };
+    bitset_word e2[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 0) };
     test_bitset("Testing append after fill 4", b, 2, e2);
     bitset_free(b);
 
-    uint32_t p3[] = { BITSET_CREATE_EMPTY_FILL(1), 0 };
+    bitset_word p3[] = { BITSET_CREATE_EMPTY_FILL(1), 0 };
     b = bitset_new_buffer((const char *)p3, 8);
     test_bool("Testing set in literal 1\n", false, bitset_set_to(b, 32, true));
     test_bool("Testing set in literal 2\n", false, bitset_set_to(b, 38, true));
     test_bool("Testing set in literal 3\n", false, bitset_set_to(b, 45, true));
     test_bool("Testing set in literal 4\n", false, bitset_set_to(b, 55, true));
     test_bool("Testing set in literal 5\n", false, bitset_set_to(b, 61, true));
-    uint32_t e3[] = { BITSET_CREATE_EMPTY_FILL(1), 0x20810041 };
+    bitset_word e3[] = { BITSET_CREATE_EMPTY_FILL(1), 0x20810041 };
     test_bitset("Testing set in literal 6", b, 2, e3);
     test_bool("Testing set in literal 7\n", true, bitset_set_to(b, 61, false));
-    uint32_t e4[] = { BITSET_CREATE_EMPTY_FILL(1), 0x20810040 };
+    bitset_word e4[] = { BITSET_CREATE_EMPTY_FILL(1), 0x20810040 };
     test_bitset("Testing set in literal 8", b, 2, e4);
     bitset_free(b);
 
-    uint32_t p5[] = { BITSET_CREATE_FILL(1, 0) };
+    bitset_word p5[] = { BITSET_CREATE_FILL(1, 0) };
     b = bitset_new_buffer((const char *)p5, 4);
     test_bool("Testing partition of fill 1\n", false, bitset_set_to(b, 32, true));
-    uint32_t e5[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1) };
+    bitset_word e5[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1) };
     test_bitset("Testing partition of fill 2", b, 2, e5);
     bitset_free(b);
 
-    uint32_t p6[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 0) };
+    bitset_word p6[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 0) };
     b = bitset_new_buffer((const char *)p6, 8);
     test_bool("Testing partition of fill 3\n", false, bitset_set_to(b, 32, true));
-    uint32_t e6[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1), BITSET_CREATE_FILL(1, 0) };
+    bitset_word e6[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1), BITSET_CREATE_FILL(1, 0) };
     test_bitset("Testing partition of fill 4", b, 3, e6);
     bitset_free(b);
 
-    uint32_t p7[] = { BITSET_CREATE_EMPTY_FILL(1) };
+    bitset_word p7[] = { BITSET_CREATE_EMPTY_FILL(1) };
     b = bitset_new_buffer((const char *)p7, 4);
     test_bool("Testing partition of fill 5\n", false, bitset_set_to(b, 31, true));
-    uint32_t e7[] = { BITSET_CREATE_FILL(1, 0) };
+    bitset_word e7[] = { BITSET_CREATE_FILL(1, 0) };
     test_bitset("Testing partition of fill 6", b, 1, e7);
     bitset_free(b);
 
-    uint32_t p8[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 2) };
+    bitset_word p8[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 2) };
     b = bitset_new_buffer((const char *)p8, 8);
     test_bool("Testing partition of fill 7\n", false, bitset_set_to(b, 0, true));
-    uint32_t e8[] = { BITSET_CREATE_LITERAL(0), BITSET_CREATE_LITERAL(0), BITSET_CREATE_FILL(1, 2) };
+    bitset_word e8[] = { BITSET_CREATE_LITERAL(0), BITSET_CREATE_LITERAL(0), BITSET_CREATE_FILL(1, 2) };
     test_bitset("Testing partition of fill 7", b, 3, e8);
     bitset_free(b);
 
-    uint32_t p8b[] = { BITSET_CREATE_FILL(2, 0), BITSET_CREATE_FILL(1, 2) };
+    bitset_word p8b[] = { BITSET_CREATE_FILL(2, 0), BITSET_CREATE_FILL(1, 2) };
     b = bitset_new_buffer((const char *)p8b, 8);
     test_bool("Testing partition of fill 7b\n", false, bitset_set_to(b, 32, true));
-    uint32_t e8b[] = { BITSET_CREATE_FILL(1, 1), BITSET_CREATE_LITERAL(0), BITSET_CREATE_FILL(1, 2) };
+    bitset_word e8b[] = { BITSET_CREATE_FILL(1, 1), BITSET_CREATE_LITERAL(0), BITSET_CREATE_FILL(1, 2) };
     test_bitset("Testing partition of fill 7b - 3", b, 3, e8b);
     test_bool("Testing partition of fill 7b - 1\n", true, bitset_get(b, 32));
     test_bool("Testing partition of fill 7b - 2\n", true, bitset_get(b, 62));
     bitset_free(b);
 
-    uint32_t p9[] = { BITSET_CREATE_FILL(3, 0), BITSET_CREATE_FILL(1, 2) };
+    bitset_word p9[] = { BITSET_CREATE_FILL(3, 0), BITSET_CREATE_FILL(1, 2) };
     b = bitset_new_buffer((const char *)p9, 8);
     test_bool("Testing partition of fill 8\n", false, bitset_set_to(b, 32, true));
-    uint32_t e9[] = { BITSET_CREATE_FILL(1, 1), BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 2) };
+    bitset_word e9[] = { BITSET_CREATE_FILL(1, 1), BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 2) };
     test_bitset("Testing partition of fill 9", b, 3, e9);
     bitset_free(b);
 
-    uint32_t p10[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_FILL(1, 0) };
+    bitset_word p10[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_FILL(1, 0) };
     b = bitset_new_buffer((const char *)p10, 8);
     test_bool("Testing partition of fill 10\n", false, bitset_set_to(b, 1, true));
-    uint32_t e10[] = { BITSET_CREATE_LITERAL(1), BITSET_CREATE_FILL(1, 0) };
+    bitset_word e10[] = { BITSET_CREATE_LITERAL(1), BITSET_CREATE_FILL(1, 0) };
     test_bitset("Testing partition of fill 11", b, 2, e10);
     bitset_free(b);
 
-    uint32_t p11[] = { BITSET_CREATE_FILL(1, 0) };
+    bitset_word p10b[] = { BITSET_CREATE_FILL(2, 0) };
+    b = bitset_new_buffer((const char *)p10b, 4);
+    test_bool("Testing unset inside a fill 1\n", false, bitset_set_to(b, 31, false));
+    test_bitset("Testing unset inside a fill 2", b, 1, p10b);
+    test_bool("Testing unset inside a fill 3\n", false, bitset_set_to(b, 63, false));
+    test_bitset("Testing unset inside a fill 4", b, 1, p10b);
+    bitset_free(b);
+
+    bitset_word p10c[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 2) };
+    b = bitset_new_buffer((const char *)p10c, 8);
+    test_bool("Testing unset position before another word 1\n", true, bitset_set_to(b, 31, false));
+    bitset_word e10c[] = { BITSET_CREATE_EMPTY_FILL(2), BITSET_CREATE_FILL(1, 2) };
+    test_bitset("Testing unset position before another word 2", b, 2, e10c);
+    test_bool("Testing unset position before another word 3\n", true, bitset_get(b, 95));
+    bitset_free(b);
+
+    bitset_word p11[] = { BITSET_CREATE_FILL(1, 0) };
     b = bitset_new_buffer((const char *)p11, 4);
     test_bool("Testing setting position bit 1\n", true, bitset_set_to(b, 31, true));
     test_bitset("Testing setting position bit 2", b, 1, p11);
-    uint32_t e11[] = { BITSET_CREATE_EMPTY_FILL(1) };
+    bitset_word e11[] = { BITSET_CREATE_EMPTY_FILL(1) };
     test_bool("Testing setting position bit 3\n", true, bitset_set_to(b, 31, false));
     test_bitset("Testing setting position bit 4", b, 1, e11);
     bitset_free(b);
+#endif
 
     b = bitset_new();
     test_bool("Testing random set/get 1\n", false, bitset_set_to(b, 0, true));
@@ -478,6 +544,1751 @@ void test_suite_set() {
 #endif
 }
 
+void test_suite_index() {
+    bitset_t *b = bitset_new(), *r = bitset_new();
+    bitset_offset bit;
+    bool value;
+    for (size_t i = 0; i < 5000; i++) {
+        bitset_set_to(b, rand() % 1000000, true);
+    }
+    bitset_index_build(b, 4);
+    test_bool("Testing skip index is sampled\n", true, b->index->length > 1);
+    test_ulong("Testing skip index first sample\n", 0, b->index->samples[0].word);
+    bitset_index_drop(b);
+    test_bool("Testing skip index can be dropped\n", true, b->index == NULL);
+    bitset_clear(b);
+
+    bitset_index_build(b, 4);
+    for (size_t i = 0; i < 20000; i++) {
+        bit = rand() % 200000;
+        value = rand() % 4 != 0;
+        test_bool("Testing set with a skip index\n",
+            bitset_set_to(r, bit, value), bitset_set_to(b, bit, value));
+    }
+    for (size_t i = 1; i < b->index->length; i++) {
+        test_bool("Testing skip index samples are ordered\n", true,
+            b->index->samples[i].word > b->index->samples[i-1].word &&
+            b->index->samples[i].offset >= b->index->samples[i-1].offset);
+        test_bool("Testing skip index gaps are bounded\n", true,
+            b->index->samples[i].word - b->index->samples[i-1].word <= 8);
+    }
+    for (bit = 0; bit < 200100; bit++) {
+        test_bool("Testing get with a skip index\n", bitset_get(r, bit), bitset_get(b, bit));
+    }
+    test_ulong("Testing count with a skip index\n", bitset_count(r), bitset_count(b));
+    test_ulong("Testing max with a skip index\n", bitset_max(r), bitset_max(b));
+
+    bitset_t *c = bitset_copy(b);
+    test_bool("Testing skip index is copied\n", true, c->index != NULL);
+    test_bool("Testing get on a copy with a skip index\n", true, bitset_get(c, bitset_max(r)));
+    bitset_clear(c);
+    test_bool("Testing get on a cleared bitset with a skip index\n", false, bitset_get(c, bitset_max(r)));
+    bitset_set(c, 5000000);
+    test_bool("Testing set on a cleared bitset with a skip index\n", true, bitset_get(c, 5000000));
+    bitset_free(c);
+    bitset_free(b);
+    bitset_free(r);
+}
+
+static bool test_canonical(bitset_t *b) {
+    for (size_t i = 0; i < b->length; i++) {
+        if (!b->buffer[i]) {
+            return false;
+        }
+        if (i && BITSET_IS_FILL_WORD(b->buffer[i]) && BITSET_IS_FILL_WORD(b->buffer[i-1])
+                && BITSET_IS_ONE_FILL(b->buffer[i]) == BITSET_IS_ONE_FILL(b->buffer[i-1])
+                && !BITSET_GET_POSITION(b->buffer[i-1])
+                && BITSET_GET_LENGTH(b->buffer[i-1]) != BITSET_MAX_LENGTH) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_suite_set_many() {
+    bitset_t *b = bitset_new();
+    bitset_offset p1[] = { 3000, 1, 100, 0, 1 };
+    bitset_set_many(b, p1, 5);
+#ifndef BITSET_64BIT_WORDS
+    bitset_word e1[] = { BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1),
+        BITSET_CREATE_FILL(2, 7), BITSET_CREATE_FILL(92, 24) };
+    test_bool("Testing set many 1", true, test_bitset("Testing set many 1", b, 3, e1));
+#endif
+    bitset_offset p2[] = { 1, 100, 5000 };
+    bitset_unset_many(b, p2, 3);
+#ifndef BITSET_64BIT_WORDS
+    bitset_word e2[] = { BITSET_CREATE_LITERAL(0), BITSET_CREATE_FILL(95, 24) };
+    test_bool("Testing unset many 1", true, test_bitset("Testing unset many 1", b, 2, e2));
+#endif
+    bitset_offset p3[] = { 0, 3000 };
+    bitset_unset_many(b, p3, 2);
+    test_ulong("Testing unset many 2\n", 0, b->length);
+    bitset_free(b);
+
+    unsigned max = 300000, batch = 2000;
+    bool *expected = bitset_calloc(1, sizeof(bool) * max);
+    bitset_offset *bits = bitset_malloc(sizeof(bitset_offset) * batch);
+    b = bitset_new();
+    bitset_index_build(b, 8);
+    for (size_t i = 0; i < 1000; i++) {
+        bitset_set(b, rand() % max);
+    }
+    for (bitset_offset bit = 0; bit < max; bit++) {
+        expected[bit] = bitset_get(b, bit);
+    }
+    for (size_t round = 0; round < 20; round++) {
+        bool value = round % 3 != 2;
+        size_t count = rand() % batch;
+        for (size_t i = 0; i < count; i++) {
+            bits[i] = rand() % (round < 10 ? max : max / 100);
+            expected[bits[i]] = value;
+        }
+        bitset_set_many_to(b, bits, count, value);
+        test_bool("Testing set many produces canonical output\n", true, test_canonical(b));
+    }
+    unsigned count = 0;
+    for (bitset_offset bit = 0; bit < max; bit++) {
+        test_bool("Testing set many against single bit set\n", expected[bit], bitset_get(b, bit));
+        count += expected[bit];
+    }
+    test_ulong("Testing set many count\n", count, bitset_count(b));
+    bitset_malloc_free(expected);
+    bitset_malloc_free(bits);
+    bitset_free(b);
+}
+
+void test_suite_cursor() {
+    bitset_offset offset, iters = 0;
+    bitset_cursor_t cursor;
+
+    bitset_t *b = bitset_new();
+    bitset_cursor_init(&cursor, b);
+    test_bool("Testing cursor on empty set\n", false, bitset_cursor_next(&cursor, &offset));
+    bitset_free(b);
+
+    BITSET_NEW(b1, 100, 300, 302, 305, 1000, 1001);
+    bitset_offset e1[] = { 100, 300, 302, 305, 1000, 1001 };
+    BITSET_CURSOR_FOREACH(b1, offset) {
+        test_ulong("Testing cursor foreach\n", e1[iters++], offset);
+    }
+    test_ulong("Testing cursor foreach 2\n", 6, iters);
+    iters = 0;
+    if (iters)
+        BITSET_CURSOR_FOREACH(b1, offset) iters = 0;
+    else
+        BITSET_CURSOR_FOREACH(b1, offset) iters++;
+    test_ulong("Testing cursor foreach as an unbraced statement\n", 6, iters);
+
+    bitset_cursor_init(&cursor, b1);
+    test_bool("Testing cursor seek 1\n", true, bitset_cursor_seek(&cursor, 301, &offset));
+    test_ulong("Testing cursor seek 2\n", 302, offset);
+    test_bool("Testing cursor seek 3\n", true, bitset_cursor_seek(&cursor, 305, &offset));
+    test_ulong("Testing cursor seek 4\n", 305, offset);
+    test_bool("Testing cursor seek 5\n", true, bitset_cursor_seek(&cursor, 0, &offset));
+    test_ulong("Testing cursor seek behind the cursor\n", 1000, offset);
+    test_bool("Testing cursor next after seek 1\n", true, bitset_cursor_next(&cursor, &offset));
+    test_ulong("Testing cursor next after seek 2\n", 1001, offset);
+    test_bool("Testing cursor next after seek 3\n", false, bitset_cursor_next(&cursor, &offset));
+    bitset_cursor_init(&cursor, b1);
+    test_bool("Testing cursor seek past the end\n", false, bitset_cursor_seek(&cursor, 1002, &offset));
+    bitset_free(b1);
+
+    b = bitset_new();
+    for (size_t i = 0; i < 10000; i++) {
+        bitset_set(b, rand() % 1000000);
+    }
+    bitset_iterator_t *iterator = bitset_iterator_new(b);
+    bitset_cursor_init(&cursor, b);
+    for (size_t i = 0; i < iterator->length; i++) {
+        test_bool("Testing cursor against iterator 1\n", true, bitset_cursor_next(&cursor, &offset));
+        test_ulong("Testing cursor against iterator 2\n", iterator->offsets[i], offset);
+    }
+    test_bool("Testing cursor against iterator 3\n", false, bitset_cursor_next(&cursor, &offset));
+    for (size_t indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            bitset_index_build(b, 4);
+        }
+        bitset_cursor_init(&cursor, b);
+        for (size_t i = 0, target = 0; ; ) {
+            target += rand() % 1000;
+            while (i < iterator->length && iterator->offsets[i] < target) {
+                i++;
+            }
+            if (i == iterator->length) {
+                test_bool("Testing cursor seek against iterator 1\n", false,
+                    bitset_cursor_seek(&cursor, target, &offset));
+                break;
+            }
+            test_bool("Testing cursor seek against iterator 2\n", true,
+                bitset_cursor_seek(&cursor, target, &offset));
+            test_ulong("Testing cursor seek against iterator 3\n", iterator->offsets[i++], offset);
+            target = offset + 1;
+        }
+    }
+    bitset_iterator_free(iterator);
+    bitset_free(b);
+}
+
+void test_suite_decode() {
+    size_t chunks[] = { 1, 7, 31, 32, 100, 4096 };
+    bitset_offset *offsets = bitset_malloc(sizeof(bitset_offset) * 4096);
+    bitset_cursor_t cursor;
+    bitset_t *b = bitset_new();
+    test_ulong("Testing decode of an empty bitset\n", 0, bitset_decode(b, NULL, offsets, 4096));
+    for (size_t i = 0; i < 20000; i++) {
+        bitset_set(b, rand() % (i < 10000 ? 1000000 : 20000));
+    }
+    bitset_iterator_t *iterator = bitset_iterator_new(b);
+    for (int kernel = BITSET_KERNEL_GENERIC; kernel <= BITSET_KERNEL_BEST; kernel++) {
+        bitset_kernel_select(kernel);
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            size_t decoded, total = 0;
+            bitset_cursor_init(&cursor, b);
+            while ((decoded = bitset_decode(b, &cursor, offsets, chunks[c]))) {
+                test_bool("Testing decode respects capacity\n", true, decoded <= chunks[c]);
+                for (size_t i = 0; i < decoded; i++) {
+                    test_ulong("Testing decode against iterator\n",
+                        iterator->offsets[total++], offsets[i]);
+                }
+            }
+            test_ulong("Testing decode count\n", iterator->length, total);
+        }
+        test_ulong("Testing decode without a cursor\n", 4096, bitset_decode(b, NULL, offsets, 4096));
+        test_ulong("Testing decode without a cursor 2\n", iterator->offsets[4095], offsets[4095]);
+    }
+    bitset_kernel_select(BITSET_KERNEL_BEST);
+    bitset_iterator_free(iterator);
+    bitset_free(b);
+    bitset_malloc_free(offsets);
+}
+
+void test_suite_popcount() {
+    bitset_t *b, *c;
+    bitset_operation_t *op;
+    bitset_linear_t *linear;
+    bitset_countn_t *countn;
+    unsigned *counts, *expected;
+    for (size_t length = 0; length < 300; length += 7) {
+        b = bitset_new();
+        c = bitset_new();
+        for (size_t i = 0; i < length * 4; i++) {
+            bitset_set(b, rand() % (length * 40 + 1));
+            bitset_set(c, rand() % (length * 400 + 1));
+        }
+        bitset_iterator_t *iterator = bitset_iterator_new(b);
+        op = bitset_operation_new(b);
+        bitset_operation_add(op, c, BITSET_OR);
+        bitset_t *or = bitset_operation_exec(op);
+        countn = bitset_countn_new(3, length * 400 + 1);
+        bitset_countn_add(countn, b);
+        bitset_countn_add(countn, c);
+        bitset_countn_add(countn, or);
+        bitset_kernel_select(BITSET_KERNEL_GENERIC);
+        expected = bitset_countn_count_mask(countn, b);
+        for (int kernel = BITSET_KERNEL_GENERIC; kernel <= BITSET_KERNEL_BEST; kernel++) {
+            bitset_kernel_select(kernel);
+            test_ulong("Testing count kernel\n", iterator->length, bitset_count(b));
+            test_ulong("Testing operation count kernel\n", bitset_count(or),
+                bitset_operation_count(op));
+            linear = bitset_linear_new(length * 400 + 1);
+            bitset_linear_add(linear, b);
+            bitset_linear_add(linear, c);
+            test_ulong("Testing linear count kernel\n", bitset_count(or), bitset_linear_count(linear));
+            bitset_linear_free(linear);
+            counts = bitset_countn_count_all(countn);
+            test_ulong("Testing countn kernel 1\n", 0, counts[0]);
+            test_ulong("Testing countn kernel 2\n", bitset_count(or) - counts[2], counts[1]);
+            test_ulong("Testing countn kernel 3\n", bitset_count(b) + bitset_count(c)
+                - bitset_count(or), counts[2]);
+            test_ulong("Testing countn kernel 4\n", counts[2], bitset_countn_count(countn));
+            bitset_countn_count_free(counts);
+            counts = bitset_countn_count_mask(countn, b);
+            for (size_t n = 0; n < 3; n++) {
+                test_ulong("Testing countn mask kernel\n", expected[n], counts[n]);
+            }
+            bitset_countn_count_free(counts);
+        }
+        bitset_countn_count_free(expected);
+        bitset_countn_free(countn);
+        bitset_free(or);
+        bitset_operation_free(op);
+        bitset_iterator_free(iterator);
+        bitset_free(b);
+        bitset_free(c);
+    }
+    bitset_kernel_select(BITSET_KERNEL_BEST);
+}
+
+void test_suite_rank() {
+    bitset_t *b = bitset_new(), *r = bitset_new();
+    bitset_offset offset, bit;
+    bool value;
+    test_ulong("Testing rank of an empty bitset\n", 0, bitset_rank(b, 100));
+    test_bool("Testing select on an empty bitset\n", false, bitset_select(b, 0, &offset));
+    BITSET_NEW(b2, 3, 62, 1000, 1001, 1000000);
+    test_ulong("Testing rank 1\n", 0, bitset_rank(b2, 3));
+    test_ulong("Testing rank 2\n", 1, bitset_rank(b2, 4));
+    test_ulong("Testing rank 3\n", 2, bitset_rank(b2, 1000));
+    test_ulong("Testing rank 4\n", 4, bitset_rank(b2, 1002));
+    test_ulong("Testing rank 5\n", 5, bitset_rank(b2, 4000000000));
+    test_bool("Testing select 1\n", true, bitset_select(b2, 3, &offset));
+    test_ulong("Testing select 2\n", 1001, offset);
+    test_bool("Testing select 3\n", true, bitset_select(b2, 4, &offset));
+    test_ulong("Testing select 4\n", 1000000, offset);
+    test_bool("Testing select 5\n", false, bitset_select(b2, 5, &offset));
+    bitset_free(b2);
+
+    for (size_t i = 0; i < 3000; i++) {
+        bitset_set(b, rand() % (i % 2 ? 100000 : 3000));
+    }
+    for (unsigned interval = 0; interval <= 4; interval += 4) {
+        if (interval) {
+            bitset_index_build(b, interval);
+        }
+        bitset_iterator_t *iterator = bitset_iterator_new(b);
+        for (size_t i = 0; i < iterator->length; i++) {
+            test_bool("Testing select against iterator 1\n", true, bitset_select(b, i, &offset));
+            test_ulong("Testing select against iterator 2\n", iterator->offsets[i], offset);
+            test_ulong("Testing rank against iterator 1\n", i, bitset_rank(b, iterator->offsets[i]));
+            test_ulong("Testing rank against iterator 2\n", i + 1, bitset_rank(b, iterator->offsets[i] + 1));
+        }
+        test_bool("Testing select past the end\n", false, bitset_select(b, iterator->length, &offset));
+        for (size_t i = 0, j = 0; i < 100100; i += 7) {
+            while (j < iterator->length && iterator->offsets[j] < i) {
+                j++;
+            }
+            test_ulong("Testing rank against iterator 3\n", j, bitset_rank(b, i));
+        }
+        bitset_iterator_free(iterator);
+    }
+    bitset_clear(b);
+
+    bitset_index_build(b, 4);
+    for (size_t i = 0; i < 20000; i++) {
+        bit = rand() % 200000;
+        value = rand() % 4 != 0;
+        bitset_set_to(r, bit, value);
+        bitset_set_to(b, bit, value);
+    }
+    for (size_t i = 0; i < b->index->length; i++) {
+        test_ulong("Testing skip index ranks are maintained\n",
+            bitset_rank(r, b->index->samples[i].offset * BITSET_LITERAL_LENGTH),
+            b->index->samples[i].rank);
+    }
+    for (bit = 0; bit < 200100; bit += 3) {
+        test_ulong("Testing rank with a skip index\n", bitset_rank(r, bit), bitset_rank(b, bit));
+    }
+    bitset_offset expected, count = bitset_count(r);
+    for (bitset_offset n = 0; n <= count; n++) {
+        test_bool("Testing select with a skip index 1\n",
+            bitset_select(r, n, &expected), bitset_select(b, n, &offset));
+        if (n < count) {
+            test_ulong("Testing select with a skip index 2\n", expected, offset);
+        }
+    }
+    bitset_free(b);
+    bitset_free(r);
+}
+
+static void test_meta(char *name, bitset_t *b, bitset_t *r) {
+    test_bool(name, true, b->meta != NULL && r->meta == NULL);
+    test_ulong(name, bitset_count(r), b->meta->count);
+    test_ulong(name, bitset_min(r), b->meta->min);
+    test_ulong(name, bitset_max(r), b->meta->max);
+    test_ulong(name, bitset_words(r), b->meta->words);
+}
+
+void test_suite_meta() {
+    bitset_t *b = bitset_new(), *r = bitset_new();
+    bitset_offset bit;
+    bool value;
+    bitset_meta_build(b);
+    test_meta("Testing metadata of an empty bitset\n", b, r);
+    for (size_t i = 0; i < 20000; i++) {
+        bit = rand() % (i % 3 ? 200000 : 2000);
+        value = rand() % 3 != 0;
+        test_bool("Testing set with metadata\n",
+            bitset_set_to(r, bit, value), bitset_set_to(b, bit, value));
+        if (i % 97 == 0) {
+            test_meta("Testing metadata is maintained by set\n", b, r);
+        }
+    }
+    test_meta("Testing metadata is maintained by set\n", b, r);
+    BITSET_NEW(b1, 5, 62);
+    BITSET_NEW(b2, 5, 62);
+    bitset_meta_drop(b2);
+    bitset_unset(b1, 62);
+    bitset_unset(b2, 62);
+    test_meta("Testing metadata after unsetting the last bit\n", b1, b2);
+    bitset_unset(b1, 5);
+    bitset_unset(b2, 5);
+    test_meta("Testing metadata after unsetting every bit\n", b1, b2);
+    bitset_free(b1);
+    bitset_free(b2);
+
+    bitset_offset *bits = bitset_malloc(sizeof(bitset_offset) * 1000);
+    for (size_t i = 0; i < 1000; i++) {
+        bits[i] = rand() % 100000;
+    }
+    bitset_t *c = bitset_new_bits(bits, 1000), *d = bitset_copy(c);
+    bitset_meta_drop(d);
+    test_meta("Testing metadata of new bits\n", c, d);
+    bitset_operation_t *op = bitset_operation_new(b);
+    bitset_operation_add(op, c, BITSET_XOR);
+    bitset_t *e = bitset_operation_exec(op), *f = bitset_copy(e);
+    bitset_meta_drop(f);
+    test_meta("Testing metadata of an operation result\n", e, f);
+    bitset_operation_free(op);
+    bitset_t *g = bitset_copy(e);
+    test_meta("Testing metadata is copied\n", g, f);
+    bitset_clear(g);
+    bitset_clear(f);
+    test_meta("Testing metadata of a cleared bitset\n", g, f);
+    bitset_malloc_free(bits);
+    bitset_free(b);
+    bitset_free(r);
+    bitset_free(c);
+    bitset_free(d);
+    bitset_free(e);
+    bitset_free(f);
+    bitset_free(g);
+}
+
+void test_suite_view() {
+    bitset_t *b = bitset_new();
+    bitset_offset offset;
+    for (size_t i = 0; i < 5000; i++) {
+        bitset_set(b, rand() % 1000000);
+    }
+    const char *buffer = (const char *)b->buffer;
+    size_t length = bitset_length(b);
+    test_bool("Testing view of a misaligned buffer\n", true, bitset_new_view(buffer + 1, length - 1) == NULL);
+    test_bool("Testing view with a partial word\n", true, bitset_new_view(buffer, length - 1) == NULL);
+    bitset_t *v = bitset_new_view(buffer, length);
+    test_bool("Testing view borrows the buffer\n", true, v->buffer == b->buffer && v->borrowed);
+    test_ulong("Testing count of a view\n", bitset_count(b), bitset_count(v));
+    test_ulong("Testing max of a view\n", bitset_max(b), bitset_max(v));
+    bitset_iterator_t *i1 = bitset_iterator_new(b), *i2 = bitset_iterator_new(v);
+    test_ulong("Testing iterator over a view\n", i1->length, i2->length);
+    for (size_t i = 0; i < i1->length; i++) {
+        test_bool("Testing get on a view\n", true, bitset_get(v, i1->offsets[i]));
+        test_ulong("Testing iterator over a view\n", i1->offsets[i], i2->offsets[i]);
+    }
+    bitset_index_build(v, 0);
+    BITSET_CURSOR_FOREACH(v, offset) {
+        test_bool("Testing cursor over a view\n", true, bitset_get(b, offset));
+    }
+    bitset_operation_t *op = bitset_operation_new(v);
+    bitset_operation_add(op, b, BITSET_XOR);
+    test_ulong("Testing operation with a view\n", 0, bitset_operation_count(op));
+    bitset_operation_free(op);
+
+    bitset_view_own(v);
+    test_bool("Testing view can be upgraded\n", true, v->buffer != b->buffer && !v->borrowed);
+    bitset_set(v, 5000000);
+    test_bool("Testing upgraded view can be mutated\n", true, bitset_get(v, 5000000));
+    test_bool("Testing view source is unchanged\n", false, bitset_get(b, 5000000));
+    test_ulong("Testing upgraded view keeps its bits\n", i1->length + 1, bitset_count(v));
+    bitset_free(v);
+
+    v = bitset_new_view(buffer, length);
+    bitset_clear(v);
+    test_bool("Testing cleared view no longer borrows\n", true, v->buffer == NULL && !v->borrowed);
+    bitset_set(v, 10);
+    test_ulong("Testing cleared view can be mutated\n", 1, bitset_count(v));
+    bitset_free(v);
+
+    bitset_iterator_free(i1);
+    bitset_iterator_free(i2);
+    bitset_free(b);
+}
+
+void test_suite_encoding() {
+    //Version 1 fills use the one-fill bit as the top bit of their length
+    bitset_word p1[] = { BITSET_CREATE_FILL(BITSET_ONES_BIT | 5, 2) };
+    bitset_word p2[] = { BITSET_CREATE_EMPTY_FILL(BITSET_ONES_BIT + 1), BITSET_CREATE_LITERAL(0) };
+    bitset_word p3[] = { BITSET_CREATE_ONE_FILL(5), BITSET_CREATE_LITERAL(0) };
+    bitset_t *b, view;
+    bitset_vector_t *v;
+    unsigned offset;
+    test_bool("Testing a version 1 fill with a position is rejected\n", true,
+        bitset_new_buffer((const char *)p1, sizeof(p1)) == NULL);
+    test_bool("Testing a view of a version 1 fill with a position is rejected\n", true,
+        bitset_new_view((const char *)p1, sizeof(p1)) == NULL);
+    test_bool("Testing a stated version 1 fill with a position is rejected\n", true,
+        bitset_new_encoded_buffer((const char *)p1, sizeof(p1), BITSET_ENCODING_CURRENT) == NULL);
+
+    //Long version 1 fills without a position read like one-fills
+    test_bool("Testing a version 1 fill without a position is rejected\n", true,
+        bitset_new_buffer((const char *)p2, sizeof(p2)) == NULL);
+    test_bool("Testing a view of a version 1 fill without a position is rejected\n", true,
+        bitset_new_view((const char *)p2, sizeof(p2)) == NULL);
+    test_bool("Testing a one-fill is rejected unless the encoding is stated\n", true,
+        bitset_new_buffer((const char *)p3, sizeof(p3)) == NULL);
+    test_bool("Testing a view of a one-fill is rejected unless the encoding is stated\n", true,
+        bitset_new_view((const char *)p3, sizeof(p3)) == NULL);
+    test_bool("Testing a view of a one-fill as version 1 is rejected\n", true,
+        bitset_new_encoded_view((const char *)p3, sizeof(p3), BITSET_ENCODING_V1) == NULL);
+    b = bitset_new_encoded_buffer((const char *)p3, sizeof(p3), BITSET_ENCODING_CURRENT);
+    test_ulong("Testing a stated one-fill is imported\n", 5 * BITSET_LITERAL_LENGTH + 1, bitset_count(b));
+    bitset_free(b);
+    b = bitset_new_encoded_view((const char *)p3, sizeof(p3), BITSET_ENCODING_CURRENT);
+    test_ulong("Testing a view of a stated one-fill\n", 5 * BITSET_LITERAL_LENGTH + 1, bitset_count(b));
+    bitset_free(b);
+    b = bitset_new_encoded_view((const char *)(p3 + 1), sizeof(bitset_word), BITSET_ENCODING_V1);
+    test_ulong("Testing a view of version 1 words that read the same\n", 1, bitset_count(b));
+    bitset_free(b);
+
+    b = bitset_new_encoded_buffer((const char *)p1, sizeof(p1), BITSET_ENCODING_V1);
+    test_ulong("Testing a converted version 1 fill 1\n", 1, bitset_count(b));
+    test_ulong("Testing a converted version 1 fill 2\n", 2, b->length);
+    test_bool("Testing a converted version 1 fill 3\n", true, b->buffer[0]
+        == BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH) && !BITSET_IS_ONE_FILL(b->buffer[1]));
+#ifndef BITSET_64BIT_WORDS
+    test_ulong("Testing a converted version 1 fill 4\n",
+        (BITSET_ONES_BIT + 5) * BITSET_LITERAL_LENGTH + 2, bitset_min(b));
+#endif
+    bitset_free(b);
+
+    b = bitset_new_encoded_buffer((const char *)p2, sizeof(p2), BITSET_ENCODING_V1);
+    test_ulong("Testing a converted version 1 fill 5\n", 1, bitset_count(b));
+#ifndef BITSET_64BIT_WORDS
+    test_bool("Testing a converted version 1 fill 6\n", true,
+        bitset_get(b, (BITSET_ONES_BIT + 1) * BITSET_LITERAL_LENGTH));
+#endif
+    bitset_free(b);
+
+    b = bitset_new_encoded_buffer((const char *)p2, sizeof(p2), BITSET_ENCODING_CURRENT);
+    test_bool("Testing a current buffer is imported as is\n", true,
+        b->length == 2 && b->buffer[0] == p2[0] && b->buffer[1] == p2[1]);
+    bitset_free(b);
+
+    //Vectors hold their bitsets' words as is
+    view.buffer = p1;
+    view.length = 1;
+    view.index = NULL;
+    view.meta = NULL;
+    view.borrowed = true;
+    view.version = 0;
+    v = bitset_vector_new();
+    bitset_vector_push(v, &view, 3);
+    view.buffer = p2;
+    view.length = 2;
+    bitset_vector_push(v, &view, 7);
+    test_bool("Testing a vector of version 1 bitsets is rejected\n", true,
+        bitset_vector_import(bitset_vector_export(v), bitset_vector_length(v)) == NULL);
+    test_bool("Testing a stated vector of version 1 bitsets is rejected\n", true,
+        bitset_vector_import_encoded(bitset_vector_export(v), bitset_vector_length(v),
+            BITSET_ENCODING_CURRENT) == NULL);
+    bitset_vector_t *u = bitset_vector_import_encoded(bitset_vector_export(v),
+        bitset_vector_length(v), BITSET_ENCODING_V1);
+    test_ulong("Testing a converted vector 1\n", 2, bitset_vector_bitsets(u));
+    test_ulong("Testing a converted vector 2\n", 7, u->tail_offset);
+    bitset_t *bp;
+    BITSET_VECTOR_FOREACH(u, bp, offset) {
+        test_ulong("Testing a converted vector 3\n", 1, bitset_count(bp));
+        test_bool("Testing a converted vector 4\n", true, offset == 3 || offset == 7);
+        test_ulong("Testing a converted vector 5\n", offset == 3 ? 2 : 3, bp->length);
+    }
+    bitset_vector_free(u);
+    bitset_vector_free(v);
+
+    view.buffer = p3;
+    view.length = 2;
+    v = bitset_vector_new();
+    bitset_vector_push(v, &view, 3);
+    test_bool("Testing a vector with a one-fill is rejected unless the encoding is stated\n", true,
+        bitset_vector_import(bitset_vector_export(v), bitset_vector_length(v)) == NULL);
+    u = bitset_vector_import_encoded(bitset_vector_export(v), bitset_vector_length(v),
+        BITSET_ENCODING_CURRENT);
+    test_ulong("Testing a stated vector with a one-fill\n", 1, bitset_vector_bitsets(u));
+    bitset_vector_free(u);
+    bitset_vector_free(v);
+}
+
+static void test_range(char *name, bitset_t *b, const bool *expected, size_t max) {
+    bitset_offset count = 0, offset, n = 0;
+    for (size_t bit = 0; bit < max; bit++) {
+        test_bool(name, expected[bit], bitset_get(b, bit));
+        if (expected[bit]) {
+            test_ulong(name, count, bitset_rank(b, bit));
+            test_bool(name, true, bitset_select(b, count, &offset));
+            test_ulong(name, bit, offset);
+            count++;
+        }
+    }
+    test_ulong(name, count, bitset_count(b));
+    BITSET_CURSOR_FOREACH(b, offset) {
+        test_bool(name, true, offset < max && expected[offset]);
+        n++;
+    }
+    test_ulong(name, count, n);
+    test_bool(name, true, test_canonical(b));
+}
+
+void test_suite_range() {
+    bitset_t *b = bitset_new();
+    bitset_set_range(b, 0, BITSET_LITERAL_LENGTH * 4);
+    bitset_word e1[] = { BITSET_CREATE_ONE_FILL(4) };
+    test_bool("Testing set range 1", true, test_bitset("Testing set range 1", b, 1, e1));
+    test_ulong("Testing count of a one-fill\n", BITSET_LITERAL_LENGTH * 4, bitset_count(b));
+    bitset_clear(b);
+    bitset_set_range(b, BITSET_LITERAL_LENGTH, BITSET_LITERAL_LENGTH * 3 + 5);
+    bitset_word e2[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_ONE_FILL(2),
+        BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1) | BITSET_CREATE_LITERAL(2)
+        | BITSET_CREATE_LITERAL(3) | BITSET_CREATE_LITERAL(4) };
+    test_bool("Testing set range 2", true, test_bitset("Testing set range 2", b, 3, e2));
+    bitset_unset(b, BITSET_LITERAL_LENGTH + 3);
+    bitset_word e3[] = { BITSET_CREATE_EMPTY_FILL(1),
+        BITSET_ONES_LITERAL & ~BITSET_CREATE_LITERAL(3), BITSET_ONES_LITERAL, e2[2] };
+    test_bool("Testing unset in a one-fill", true, test_bitset("Testing unset in a one-fill", b, 4, e3));
+    bitset_clear_range(b, 0, BITSET_LITERAL_LENGTH * 4);
+    test_ulong("Testing clear range\n", 0, bitset_count(b));
+    bitset_clear(b);
+    bitset_set_range(b, 0, 1000000);
+    test_bool("Testing a range is compressed\n", true, b->length <= 2);
+    test_ulong("Testing count of a range\n", 1000000, bitset_count(b));
+    test_ulong("Testing min of a range\n", 0, bitset_min(b));
+    test_ulong("Testing max of a range\n", 999999, bitset_max(b));
+    bitset_clear(b);
+
+    //Compare random ranges and bits against an uncompressed bitset
+    size_t max = 20000;
+    bool *expected = bitset_calloc(1, sizeof(bool) * max);
+    bitset_offset start, end;
+    bitset_cursor_t cursor;
+    bitset_index_build(b, 4);
+    bitset_meta_build(b);
+    for (size_t i = 0; i < 200; i++) {
+        start = rand() % max;
+        end = start + rand() % (i % 2 ? 2000 : 100);
+        end = end > max ? max : end;
+        bool value = rand() % 3 != 0;
+        if (i % 5 == 4) {
+            test_bool("Testing set in a range\n", expected[start], bitset_set_to(b, start, value));
+            expected[start] = value;
+        } else {
+            bitset_set_range_to(b, start, end, value);
+            for (bitset_offset bit = start; bit < end; bit++) {
+                expected[bit] = value;
+            }
+        }
+        if (i % 10 == 9) {
+            test_range("Testing random ranges\n", b, expected, max);
+            bitset_t *c = bitset_copy(b);
+            bitset_meta_drop(c);
+            test_meta("Testing metadata of random ranges\n", b, c);
+            bitset_free(c);
+        }
+    }
+    bitset_offset chunk[64], decoded, expected_count = 0;
+    for (size_t bit = 0; bit < max; bit++) {
+        expected_count += expected[bit];
+    }
+    bitset_t *c = bitset_copy(b);
+    bitset_meta_drop(c);
+    for (int k = BITSET_KERNEL_GENERIC; k < BITSET_KERNEL_BEST; k++) {
+        if (bitset_kernel_select(k) != k) {
+            break;
+        }
+        test_ulong("Testing ranges with each popcount kernel\n", expected_count, bitset_count(c));
+        bitset_cursor_init(&cursor, c);
+        while ((decoded = bitset_decode(c, &cursor, chunk, 64))) {
+            for (size_t x = 0; x < decoded; x++) {
+                test_bool("Testing ranges with each decode kernel\n", true, expected[chunk[x]]);
+            }
+            expected_count -= decoded;
+        }
+        test_ulong("Testing ranges with each decode kernel\n", 0, expected_count);
+        expected_count = bitset_count(c);
+    }
+    bitset_kernel_select(BITSET_KERNEL_BEST);
+    bitset_free(c);
+    bitset_offset bits[] = { 5, 7000, 15000 };
+    bitset_unset_many(b, bits, 3);
+    expected[5] = expected[7000] = expected[15000] = false;
+    test_range("Testing unset many in ranges\n", b, expected, max);
+    bitset_offset sought;
+    bitset_cursor_init(&cursor, b);
+    for (bitset_offset bit = 0; bit < max; bit += 1 + rand() % 500) {
+        bool found = bitset_cursor_seek(&cursor, bit, &sought);
+        bitset_offset next = bit;
+        while (next < max && !expected[next]) {
+            next++;
+        }
+        test_bool("Testing cursor seek in ranges\n", next < max, found);
+        if (found) {
+            test_ulong("Testing cursor seek in ranges\n", next, sought);
+            bit = sought;
+        }
+    }
+
+    //Operations between ranges
+    bitset_t *r = bitset_new();
+    bool *other = bitset_calloc(1, sizeof(bool) * max);
+    bool *result = bitset_malloc(sizeof(bool) * max);
+    for (size_t i = 0; i < 20; i++) {
+        start = rand() % max;
+        end = start + rand() % 3000;
+        end = end > max ? max : end;
+        bitset_set_range(r, start, end);
+        for (bitset_offset bit = start; bit < end; bit++) {
+            other[bit] = true;
+        }
+    }
+    enum bitset_operation_type types[] = { BITSET_AND, BITSET_OR, BITSET_XOR, BITSET_ANDNOT };
+    for (size_t t = 0; t < 4; t++) {
+        bitset_operation_t *op = bitset_operation_new(b);
+        bitset_operation_add(op, r, types[t]);
+        bitset_t *o = bitset_operation_exec(op);
+        for (size_t bit = 0; bit < max; bit++) {
+            switch (types[t]) {
+                case BITSET_AND:    result[bit] = expected[bit] && other[bit]; break;
+                case BITSET_OR:     result[bit] = expected[bit] || other[bit]; break;
+                case BITSET_XOR:    result[bit] = expected[bit] != other[bit]; break;
+                case BITSET_ANDNOT: result[bit] = expected[bit] && !other[bit]; break;
+            }
+        }
+        test_range("Testing operations on ranges\n", o, result, max);
+        test_ulong("Testing operation count on ranges\n", bitset_count(o), bitset_operation_count(op));
+        bitset_operation_free(op);
+        bitset_free(o);
+    }
+
+    //Ranges survive vector encoding
+    bitset_vector_t *vector = bitset_vector_new();
+    bitset_vector_push(vector, b, 1);
+    bitset_vector_push(vector, r, 2);
+    bitset_t *merged = bitset_vector_merge(vector);
+    for (size_t bit = 0; bit < max; bit++) {
+        result[bit] = expected[bit] || other[bit];
+    }
+    test_range("Testing ranges in a vector\n", merged, result, max);
+    unsigned raw, unique;
+    bitset_vector_cardinality(vector, &raw, &unique);
+    test_ulong("Testing cardinality of ranges in a vector\n", bitset_count(b) + bitset_count(r), raw);
+    test_ulong("Testing cardinality of ranges in a vector\n", bitset_count(merged), unique);
+
+    bitset_linear_t *linear = bitset_linear_new(max);
+    bitset_linear_add(linear, b);
+    bitset_linear_add(linear, r);
+    test_ulong("Testing linear count of ranges\n", bitset_count(merged), bitset_linear_count(linear));
+    bitset_linear_free(linear);
+
+    bitset_free(merged);
+    bitset_vector_free(vector);
+    bitset_malloc_free(expected);
+    bitset_malloc_free(other);
+    bitset_malloc_free(result);
+    bitset_free(b);
+    bitset_free(r);
+}
+
+void test_suite_new_bits() {
+    bitset_offset p1[] = { 100, 3, 70, 3, 0 };
+    bitset_t *b = bitset_new_bits(p1, 5);
+    test_ulong("Testing new bits doesn't sort the input\n", 100, p1[0]);
+    test_ulong("Testing new bits doesn't sort the input\n", 0, p1[4]);
+#ifndef BITSET_64BIT_WORDS
+    bitset_word e1[] = { BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(3),
+        BITSET_CREATE_FILL(1, 8), BITSET_CREATE_LITERAL(7) };
+    test_bool("Testing new bits 1", true, test_bitset("Testing new bits 1", b, 3, e1));
+#endif
+    test_ulong("Testing new bits ignores duplicates\n", 4, bitset_count(b));
+    bitset_free(b);
+
+    bitset_offset p2[BITSET_LITERAL_LENGTH * 3];
+    for (size_t i = 0; i < BITSET_LITERAL_LENGTH * 3; i++) {
+        p2[i] = BITSET_LITERAL_LENGTH + i;
+    }
+    b = bitset_new_sorted_bits(p2, BITSET_LITERAL_LENGTH * 3);
+    bitset_word e2[] = { BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_ONE_FILL(3) };
+    test_bool("Testing new bits 2", true, test_bitset("Testing new bits 2", b, 2, e2));
+    bitset_free(b);
+
+    //Large arrays are radix sorted
+    size_t count = 50000;
+    bitset_offset *bits = bitset_malloc(sizeof(bitset_offset) * count);
+    bitset_offset *sorted = bitset_malloc(sizeof(bitset_offset) * count);
+    for (size_t i = 0; i < count; i++) {
+        bits[i] = (bitset_offset)rand() * (i % 2 ? 1 : 1021) % 2000000000;
+    }
+    memcpy(sorted, bits, sizeof(bitset_offset) * count);
+    b = bitset_new_bits(bits, count);
+    test_bool("Testing new bits doesn't sort the input\n", true,
+        memcmp(sorted, bits, sizeof(bitset_offset) * count) == 0);
+    bitset_t *r = bitset_new();
+    bitset_set_many(r, sorted, count);
+    for (size_t i = 1; i < count; i++) {
+        test_bool("Testing set many sorts the input\n", true, sorted[i-1] <= sorted[i]);
+    }
+    test_bool("Testing radix sorted new bits\n", true, b->length == r->length
+        && memcmp(b->buffer, r->buffer, b->length * sizeof(bitset_word)) == 0);
+    bitset_t *c = bitset_new_sorted_bits(sorted, count);
+    test_bool("Testing new sorted bits\n", true, b->length == c->length
+        && memcmp(b->buffer, c->buffer, b->length * sizeof(bitset_word)) == 0);
+    bitset_meta_drop(r);
+    test_meta("Testing metadata of new sorted bits\n", c, r);
+    bitset_malloc_free(bits);
+    bitset_malloc_free(sorted);
+    bitset_free(b);
+    bitset_free(c);
+    bitset_free(r);
+}
+
+static bitset_t *test_random_bitset(bool *expected, size_t max, bool ranges) {
+    bitset_t *b = bitset_new();
+    bitset_offset start, end;
+    memset(expected, 0, sizeof(bool) * max);
+    for (size_t i = 0; i < 30; i++) {
+        start = rand() % max;
+        if (ranges && i % 3 == 0) {
+            end = start + rand() % 3000;
+            end = end > max ? max : end;
+            bitset_set_range(b, start, end);
+            for (bitset_offset bit = start; bit < end; bit++) {
+                expected[bit] = true;
+            }
+        } else {
+            bitset_set(b, start);
+            expected[start] = true;
+        }
+    }
+    return b;
+}
+
+void test_suite_merge() {
+    size_t max = 50000;
+    bool *ea = bitset_malloc(sizeof(bool) * max), *eb = bitset_malloc(sizeof(bool) * max);
+    bool *ec = bitset_malloc(sizeof(bool) * max), *result = bitset_malloc(sizeof(bool) * max);
+    bitset_t *(*merges[])(const bitset_t *, const bitset_t *) = {
+        bitset_and, bitset_or, bitset_xor, bitset_andnot };
+    enum bitset_operation_type types[] = { BITSET_AND, BITSET_OR, BITSET_XOR, BITSET_ANDNOT };
+    for (size_t i = 0; i < 40; i++) {
+        bitset_t *a = test_random_bitset(ea, max, i % 2);
+        bitset_t *b = test_random_bitset(eb, max, i % 4 < 2);
+        bitset_t *c = test_random_bitset(ec, max, true);
+        for (size_t t = 0; t < 4; t++) {
+            bitset_t *r = merges[t](a, b);
+            for (size_t bit = 0; bit < max; bit++) {
+                switch (types[t]) {
+                    case BITSET_AND:    result[bit] = ea[bit] && eb[bit]; break;
+                    case BITSET_OR:     result[bit] = ea[bit] || eb[bit]; break;
+                    case BITSET_XOR:    result[bit] = ea[bit] != eb[bit]; break;
+                    case BITSET_ANDNOT: result[bit] = ea[bit] && !eb[bit]; break;
+                }
+            }
+            test_range("Testing merge kernels\n", r, result, max);
+            bitset_t *d = bitset_copy(r);
+            bitset_meta_drop(d);
+            test_meta("Testing metadata of a merge\n", r, d);
+            bitset_free(d);
+
+            //Three operand operations are merged pairwise
+            bitset_operation_t *op = bitset_operation_new(a);
+            bitset_operation_add(op, b, types[t]);
+            bitset_operation_add(op, c, types[(t + i) % 4]);
+            bitset_t *o = bitset_operation_exec(op);
+            for (size_t bit = 0; bit < max; bit++) {
+                switch (types[(t + i) % 4]) {
+                    case BITSET_AND:    result[bit] = result[bit] && ec[bit]; break;
+                    case BITSET_OR:     result[bit] = result[bit] || ec[bit]; break;
+                    case BITSET_XOR:    result[bit] = result[bit] != ec[bit]; break;
+                    case BITSET_ANDNOT: result[bit] = result[bit] && !ec[bit]; break;
+                }
+            }
+            test_range("Testing three operand operations\n", o, result, max);
+            test_ulong("Testing three operand operations\n", bitset_count(o), bitset_operation_count(op));
+            bitset_operation_free(op);
+            bitset_free(o);
+            bitset_free(r);
+        }
+        bitset_free(a);
+        bitset_free(b);
+        bitset_free(c);
+    }
+    //Operations with more than three operands are hashed, and large ones grow the hash
+    bitset_operation_t *op = bitset_operation_new(NULL);
+    bitset_t *large[5], *merged = bitset_new(), *tmp;
+    bitset_offset *bits = bitset_malloc(sizeof(bitset_offset) * 150000);
+    for (size_t i = 0; i < 5; i++) {
+        for (size_t j = 0; j < 150000; j++) {
+            bits[j] = ((bitset_offset)rand() * 4099 + rand()) % 1000000000;
+        }
+        large[i] = bitset_new_bits(bits, 150000);
+        bitset_operation_add(op, large[i], i == 3 ? BITSET_XOR : BITSET_OR);
+        tmp = merged;
+        merged = i == 3 ? bitset_xor(tmp, large[i]) : bitset_or(tmp, large[i]);
+        bitset_free(tmp);
+    }
+    tmp = bitset_operation_exec(op);
+    test_bool("Testing a large hashed operation\n", true, tmp->length == merged->length
+        && !memcmp(tmp->buffer, merged->buffer, sizeof(bitset_word) * tmp->length));
+    test_ulong("Testing a large hashed operation\n", bitset_count(merged), bitset_operation_count(op));
+    bitset_free(tmp);
+    bitset_free(merged);
+    bitset_operation_free(op);
+    for (size_t i = 0; i < 5; i++) {
+        bitset_free(large[i]);
+    }
+    bitset_malloc_free(bits);
+
+    //Wider operations use a dense array, or a k-way merge or the hash when the
+    //operands are sparse. A far bit in every operand forces the sparse paths.
+    enum bitset_operation_type wide[] = { BITSET_OR, BITSET_XOR, BITSET_AND, BITSET_ANDNOT };
+    bitset_offset far = 1U << 31;
+    for (size_t t = 0; t < 6; t++) {
+        bitset_t *operands[12];
+        bool sparse = t % 2, far_set = false;
+        op = bitset_operation_new(NULL);
+        memset(result, 0, sizeof(bool) * max);
+        for (size_t i = 0; i < 12; i++) {
+            enum bitset_operation_type type = t < 4 ? wide[t / 2] : i ? wide[i % 4] : BITSET_OR;
+            operands[i] = test_random_bitset(ea, max, i % 2);
+            if (sparse) {
+                bitset_set(operands[i], far);
+                switch (type) {
+                    case BITSET_AND:    break;
+                    case BITSET_OR:     far_set = true; break;
+                    case BITSET_XOR:    far_set = !far_set; break;
+                    case BITSET_ANDNOT: far_set = false; break;
+                }
+            }
+            bitset_operation_add(op, operands[i], type);
+            for (size_t bit = 0; bit < max; bit++) {
+                switch (type) {
+                    case BITSET_AND:    result[bit] = result[bit] && ea[bit]; break;
+                    case BITSET_OR:     result[bit] = result[bit] || ea[bit]; break;
+                    case BITSET_XOR:    result[bit] = result[bit] != ea[bit]; break;
+                    case BITSET_ANDNOT: result[bit] = result[bit] && !ea[bit]; break;
+                }
+            }
+        }
+        tmp = bitset_operation_exec(op);
+        test_ulong("Testing a wide operation\n", bitset_count(tmp), bitset_operation_count(op));
+        test_bool("Testing a wide operation\n", far_set, bitset_get(tmp, far));
+        bitset_unset(tmp, far);
+        test_range("Testing a wide operation\n", tmp, result, max);
+        bitset_free(tmp);
+        bitset_operation_free(op);
+        for (size_t i = 0; i < 12; i++) {
+            bitset_free(operands[i]);
+        }
+    }
+
+    bitset_t *empty = bitset_new();
+    BITSET_NEW(b1, 1, 100);
+    bitset_t *r1 = bitset_or(empty, b1), *r2 = bitset_and(b1, empty), *r3 = bitset_andnot(b1, empty);
+    test_ulong("Testing merge with an empty bitset\n", 2, bitset_count(r1));
+    test_ulong("Testing merge with an empty bitset\n", 0, bitset_count(r2));
+    test_ulong("Testing merge with an empty bitset\n", 2, bitset_count(r3));
+    bitset_free(r1);
+    bitset_free(r2);
+    bitset_free(r3);
+    bitset_free(b1);
+    bitset_free(empty);
+    bitset_malloc_free(ea);
+    bitset_malloc_free(eb);
+    bitset_malloc_free(ec);
+    bitset_malloc_free(result);
+}
+
+static bool test_explain(bitset_operation_t *operation, const char *expected) {
+    char buffer[4096] = {0};
+    FILE *stream = tmpfile();
+    bitset_operation_explain(operation, stream);
+    rewind(stream);
+    size_t length = fread(buffer, 1, sizeof(buffer) - 1, stream);
+    fclose(stream);
+    buffer[length] = '\0';
+    return strstr(buffer, expected) != NULL;
+}
+
+void test_suite_plan() {
+    size_t max = 20000;
+    bool *ea = bitset_malloc(sizeof(bool) * max), *eb = bitset_malloc(sizeof(bool) * max);
+    bool *ec = bitset_malloc(sizeof(bool) * max), *result = bitset_malloc(sizeof(bool) * max);
+    bitset_t *a = test_random_bitset(ea, max, true);
+    bitset_t *b = test_random_bitset(eb, max, true);
+    bitset_t *c = test_random_bitset(ec, max, false);
+    BITSET_NEW(small, 10, 100, 1000);
+    BITSET_NEW(sparse, 1U << 31);
+    bitset_operation_t *op, *nested;
+    bitset_t *tmp;
+
+    //The smallest operand of an intersection is loaded first and ANDNOTs go last
+    op = bitset_operation_new(a);
+    bitset_operation_add(op, c, BITSET_ANDNOT);
+    bitset_operation_add(op, b, BITSET_AND);
+    bitset_operation_add(op, small, BITSET_AND);
+    test_bool("Testing an intersection is merged\n", true, test_explain(op, "executor: merge"));
+    test_bool("Testing the smallest operand is loaded first\n", true, test_explain(op, "0: load   step 3"));
+    test_bool("Testing ANDNOTs are applied last\n", true, test_explain(op, "3: andnot step 1"));
+    tmp = bitset_operation_exec(op);
+    for (size_t i = 0; i < max; i++) {
+        result[i] = ea[i] && eb[i] && !ec[i] && (i == 10 || i == 100 || i == 1000);
+    }
+    test_range("Testing a reordered intersection\n", tmp, result, max);
+    bitset_free(tmp);
+    bitset_operation_free(op);
+
+    //Steps before an empty intermediate result are dropped
+    op = bitset_operation_new(a);
+    nested = bitset_operation_new(b);
+    bitset_operation_add(nested, c, BITSET_AND);
+    bitset_operation_add(nested, b, BITSET_ANDNOT);
+    bitset_operation_add_nested(op, nested, BITSET_AND);
+    bitset_operation_add(op, b, BITSET_OR);
+    bitset_operation_add(op, c, BITSET_XOR);
+    test_bool("Testing empty results are skipped\n", true, test_explain(op, "skipped: 2 steps"));
+    tmp = bitset_operation_exec(op);
+    for (size_t i = 0; i < max; i++) {
+        result[i] = eb[i] != ec[i];
+    }
+    test_range("Testing empty results are skipped\n", tmp, result, max);
+    bitset_free(tmp);
+    nested = bitset_operation_new(small);
+    bitset_operation_add(nested, small, BITSET_ANDNOT);
+    bitset_operation_add_nested(op, nested, BITSET_AND);
+    test_bool("Testing an empty result\n", true, test_explain(op, "executor: empty"));
+    test_ulong("Testing an empty result\n", 0, bitset_operation_count(op));
+    bitset_operation_free(op);
+
+    //Wider operations pick an executor based on the range of the operands
+    op = bitset_operation_new(a);
+    bitset_operation_add(op, b, BITSET_OR);
+    bitset_operation_add(op, c, BITSET_AND);
+    bitset_operation_add(op, small, BITSET_XOR);
+    test_bool("Testing a dense plan\n", true, test_explain(op, "executor: dense"));
+    bitset_operation_add(op, sparse, BITSET_OR);
+    test_bool("Testing a hash plan\n", true, test_explain(op, "executor: hash"));
+    bitset_operation_free(op);
+    op = bitset_operation_new(a);
+    bitset_operation_add(op, b, BITSET_OR);
+    bitset_operation_add(op, c, BITSET_OR);
+    bitset_operation_add(op, sparse, BITSET_OR);
+    test_bool("Testing a k-way merge plan\n", true, test_explain(op, "executor: k-way merge"));
+    bitset_operation_free(op);
+
+    //Operand statistics come from a single scan, or from the metadata
+    char stats[128];
+    tmp = bitset_new();
+    bitset_set(tmp, 40);
+    bitset_set_range(tmp, 4 * BITSET_LITERAL_LENGTH, 8 * BITSET_LITERAL_LENGTH);
+    bitset_set(tmp, 8 * BITSET_LITERAL_LENGTH + 5);
+    op = bitset_operation_new(tmp);
+    bitset_operation_add(op, small, BITSET_OR);
+    sprintf(stats, "step 0, %zu words, min 40, max " bitset_format, tmp->length + 3,
+        (bitset_offset)(8 * BITSET_LITERAL_LENGTH + 5));
+    test_bool("Testing operand statistics\n", true, test_explain(op, stats));
+    bitset_meta_build(tmp);
+    sprintf(stats, ", min 40, max " bitset_format, (bitset_offset)(8 * BITSET_LITERAL_LENGTH + 5));
+    test_bool("Testing operand statistics from metadata\n", true, test_explain(op, stats));
+    bitset_operation_free(op);
+    bitset_free(tmp);
+
+    bitset_free(a);
+    bitset_free(b);
+    bitset_free(c);
+    bitset_free(small);
+    bitset_free(sparse);
+    bitset_malloc_free(ea);
+    bitset_malloc_free(eb);
+    bitset_malloc_free(ec);
+    bitset_malloc_free(result);
+}
+
+void test_suite_parallel() {
+    enum bitset_operation_type types[][3] = {
+        { BITSET_OR, BITSET_OR, BITSET_OR },
+        { BITSET_XOR, BITSET_XOR, BITSET_XOR },
+        { BITSET_AND, BITSET_OR, BITSET_ANDNOT },
+        { BITSET_AND, BITSET_AND, BITSET_ANDNOT },
+        { BITSET_OR, BITSET_AND, BITSET_XOR }
+    };
+    unsigned threads[] = { 2, 3, 8 };
+    bitset_offset *bits = bitset_malloc(sizeof(bitset_offset) * 100000);
+    bitset_t *b[4], *expected, *result, *d;
+    bitset_operation_t *op;
+    for (size_t i = 0; i < 4; i++) {
+        for (size_t j = 0; j < 100000; j++) {
+            bits[j] = ((bitset_offset)rand() * 4099 + rand()) % (i % 2 ? 10000000 : 100000000);
+        }
+        b[i] = bitset_new_bits(bits, 100000);
+        //Runs of ones that cross range boundaries
+        for (size_t j = 0; j < 20; j++) {
+            bitset_offset start = ((bitset_offset)rand() * 4099 + rand()) % 90000000;
+            bitset_set_range(b[i], start, start + rand() % 100000);
+        }
+        //Literals that are left empty once their bits are unset
+        for (size_t j = 0; j < 300; j++) {
+            bitset_offset start = ((bitset_offset)rand() * 4099 + rand()) % 300000 * BITSET_LITERAL_LENGTH;
+            bitset_set(b[i], start);
+            bitset_set(b[i], start + 1);
+            bitset_unset(b[i], start);
+            bitset_unset(b[i], start + 1);
+        }
+        //An empty literal after a run of ones at the start of the first range
+        bitset_set_range(b[i], 0, 2 * BITSET_LITERAL_LENGTH);
+        bitset_clear_range(b[i], 2 * BITSET_LITERAL_LENGTH, 3 * BITSET_LITERAL_LENGTH);
+        bitset_set(b[i], 2 * BITSET_LITERAL_LENGTH);
+        bitset_unset(b[i], 2 * BITSET_LITERAL_LENGTH);
+    }
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        op = bitset_operation_new(b[0]);
+        for (size_t i = 0; i < 3; i++) {
+            bitset_operation_add(op, b[i + 1], types[t][i]);
+        }
+        expected = bitset_operation_exec(op);
+        for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+            bitset_operation_threads(op, threads[i]);
+            result = bitset_operation_exec(op);
+            test_bool("Testing a parallel operation\n", true, result->length == expected->length
+                && !memcmp(result->buffer, expected->buffer, sizeof(bitset_word) * result->length));
+            d = bitset_copy(result);
+            bitset_meta_drop(d);
+            test_meta("Testing metadata of a parallel operation\n", result, d);
+            test_ulong("Testing a parallel count\n", bitset_count(expected), bitset_operation_count(op));
+            bitset_free(d);
+            bitset_free(result);
+        }
+        bitset_free(expected);
+        bitset_operation_free(op);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        bitset_free(b[i]);
+    }
+    bitset_malloc_free(bits);
+}
+
+void test_suite_compiled() {
+    size_t max = 50000;
+    bool *e[5], *result = bitset_malloc(sizeof(bool) * max);
+    bitset_t *b[5], *r;
+    bitset_operation_t *op, *nested;
+    bitset_compiled_t *compiled;
+    bool ok;
+    for (size_t i = 0; i < 5; i++) {
+        e[i] = bitset_malloc(sizeof(bool) * max);
+        b[i] = test_random_bitset(e[i], max, i % 2);
+    }
+
+    //(a OR (b AND c)) ANDNOT d, with d rebound to e on later runs
+    op = bitset_operation_new(b[0]);
+    nested = bitset_operation_new(b[1]);
+    bitset_operation_add(nested, b[2], BITSET_AND);
+    bitset_operation_add_nested(op, nested, BITSET_OR);
+    bitset_operation_add(op, b[3], BITSET_ANDNOT);
+    compiled = bitset_operation_compile(op);
+    test_ulong("Testing compiled operation slots\n", 4, bitset_compiled_slots(compiled));
+    for (size_t run = 0; run < 4; run++) {
+        if (run == 2) {
+            bitset_compiled_bind(compiled, 3, b[4]);
+        }
+        r = bitset_compiled_exec(compiled);
+        ok = true;
+        for (size_t bit = 0; bit < max; bit++) {
+            result[bit] = (e[0][bit] || (e[1][bit] && e[2][bit])) && !e[run < 2 ? 3 : 4][bit];
+            ok = ok && bitset_get(r, bit) == result[bit];
+        }
+        test_bool("Testing a compiled operation\n", true, ok);
+        test_ulong("Testing a compiled operation count\n", bitset_count(r),
+            bitset_compiled_count(compiled));
+        bitset_free(r);
+    }
+    test_bool("Testing compiled operations don't consume nested operations\n", true,
+        op->steps[1]->is_operation);
+
+    //Rebind every slot, then free the operation
+    for (size_t i = 0; i < 4; i++) {
+        bitset_compiled_bind(compiled, i, b[4 - i]);
+    }
+    r = bitset_operation_exec(op);
+    bitset_operation_free(op);
+    bitset_free(r);
+    r = bitset_compiled_exec(compiled);
+    ok = true;
+    for (size_t bit = 0; bit < max; bit++) {
+        ok = ok && bitset_get(r, bit) == ((e[4][bit] || (e[3][bit] && e[2][bit])) && !e[1][bit]);
+    }
+    test_bool("Testing a rebound compiled operation\n", true, ok);
+    bitset_free(r);
+    bitset_compiled_free(compiled);
+
+    for (size_t i = 0; i < 5; i++) {
+        bitset_free(b[i]);
+        bitset_malloc_free(e[i]);
+    }
+    bitset_malloc_free(result);
+}
+
+static bitset_t *test_cached_exec(bitset_t *a, bitset_t *b, bitset_t *c, bitset_cache_t *cache) {
+    bitset_operation_t *op = bitset_operation_new(a);
+    bitset_operation_t *nested = bitset_operation_new(b);
+    bitset_operation_add(nested, c, BITSET_AND);
+    bitset_operation_add_nested(op, nested, BITSET_OR);
+    bitset_operation_cache(op, cache);
+    bitset_t *result = bitset_operation_exec(op);
+    bitset_operation_free(op);
+    return result;
+}
+
+static bool test_bitset_equal(const bitset_t *a, const bitset_t *b) {
+    return a->length == b->length
+        && (!a->length || !memcmp(a->buffer, b->buffer, sizeof(bitset_word) * a->length));
+}
+
+void test_suite_cache() {
+    size_t max = 50000;
+    bool *e = bitset_malloc(sizeof(bool) * max);
+    bitset_t *b[4], *expected, *r;
+    bitset_cache_t *cache = bitset_cache_new(1 << 20);
+    bitset_cache_stats_t stats;
+    for (size_t i = 0; i < 4; i++) {
+        b[i] = test_random_bitset(e, max, true);
+    }
+
+    expected = test_cached_exec(b[0], b[1], b[2], NULL);
+    r = test_cached_exec(b[0], b[1], b[2], cache);
+    test_bool("Testing a cache miss\n", true, test_bitset_equal(expected, r));
+    bitset_free(r);
+    r = test_cached_exec(b[0], b[1], b[2], cache);
+    test_bool("Testing a cache hit\n", true, test_bitset_equal(expected, r));
+    bitset_free(r);
+    bitset_cache_stats(cache, &stats);
+    test_ulong("Testing cache hits\n", 1, stats.hits);
+    test_ulong("Testing cache misses\n", 1, stats.misses);
+    test_ulong("Testing cache entries\n", 1, stats.entries);
+
+    //The subtree is shared with a different outer operation
+    bitset_free(expected);
+    expected = test_cached_exec(b[3], b[1], b[2], NULL);
+    r = test_cached_exec(b[3], b[1], b[2], cache);
+    test_bool("Testing a shared subtree\n", true, test_bitset_equal(expected, r));
+    bitset_free(r);
+    bitset_cache_stats(cache, &stats);
+    test_ulong("Testing shared subtree hits\n", 2, stats.hits);
+
+    //Modifying an operand invalidates the cached result
+    bitset_free(expected);
+    bitset_set_range(b[1], 0, 1000);
+    bitset_set_range(b[2], 0, 1000);
+    expected = test_cached_exec(b[0], b[1], b[2], NULL);
+    r = test_cached_exec(b[0], b[1], b[2], cache);
+    test_bool("Testing a modified operand\n", true, test_bitset_equal(expected, r)
+        && bitset_get(r, 999));
+    bitset_free(r);
+    bitset_cache_stats(cache, &stats);
+    test_ulong("Testing modified operand misses\n", 2, stats.misses);
+    bitset_free(expected);
+
+    //Results are evicted once the cache is over budget
+    bitset_cache_clear(cache);
+    bitset_cache_stats(cache, &stats);
+    test_ulong("Testing a cleared cache\n", 0, stats.entries);
+    bitset_cache_free(cache);
+    cache = bitset_cache_new(600);
+    for (size_t i = 0; i < 4; i++) {
+        expected = bitset_new();
+        bitset_set(expected, i * 100);
+        bitset_free(test_cached_exec(b[0], expected, expected, cache));
+        bitset_free(expected);
+    }
+    bitset_cache_stats(cache, &stats);
+    test_bool("Testing the cache budget\n", true, stats.bytes <= 600 && stats.entries
+        && stats.entries + stats.evictions == 4);
+    bitset_cache_free(cache);
+
+    //Nested vector operations
+    bitset_vector_t *v[3], *vr, *vexpected;
+    bitset_vector_operation_t *vop, *vnested;
+    cache = bitset_cache_new(1 << 20);
+    for (size_t i = 0; i < 3; i++) {
+        v[i] = bitset_vector_new();
+        for (unsigned j = 0; j < 4; j++) {
+            bitset_vector_push(v[i], b[(i + j) % 4], j + i);
+        }
+    }
+    vexpected = NULL;
+    for (size_t run = 0; run < 3; run++) {
+        vop = bitset_vector_operation_new(v[0]);
+        vnested = bitset_vector_operation_new(v[1]);
+        bitset_vector_operation_add(vnested, v[2], BITSET_AND);
+        bitset_vector_operation_add_nested(vop, vnested, BITSET_OR);
+        bitset_vector_operation_cache(vop, run ? cache : NULL);
+        vr = bitset_vector_operation_exec(vop);
+        bitset_vector_operation_free(vop);
+        if (!run) {
+            vexpected = vr;
+            continue;
+        }
+        test_bool("Testing a cached vector operation\n", true, vr->length == vexpected->length
+            && !memcmp(vr->buffer, vexpected->buffer, vr->length));
+        bitset_vector_free(vr);
+    }
+    bitset_cache_stats(cache, &stats);
+    test_ulong("Testing vector cache hits\n", 1, stats.hits);
+    bitset_vector_free(vexpected);
+    for (size_t i = 0; i < 3; i++) {
+        bitset_vector_free(v[i]);
+    }
+    bitset_cache_free(cache);
+
+    for (size_t i = 0; i < 4; i++) {
+        bitset_free(b[i]);
+    }
+    bitset_malloc_free(e);
+}
+
+void test_suite_threshold() {
+    size_t max = 50000, n = 7;
+    bool *e[7];
+    bitset_t *b[7], *r, *expected;
+    unsigned count;
+    bool ok;
+    for (size_t t = 0; t < 4; t++) {
+        for (size_t i = 0; i < n; i++) {
+            e[i] = bitset_malloc(sizeof(bool) * max);
+            b[i] = test_random_bitset(e[i], max, t % 2 || i % 3 == 0);
+        }
+        if (t == 3) {
+            //Overlapping runs of ones in every bitset
+            for (size_t i = 0; i < n; i++) {
+                bitset_set_range(b[i], 10000 + i * 1000, 30000 - i * 1000);
+                for (size_t bit = 10000 + i * 1000; bit < 30000 - i * 1000; bit++) {
+                    e[i][bit] = true;
+                }
+            }
+        }
+        for (unsigned k = 1; k <= n + 1; k++) {
+            r = bitset_threshold(b, n, k);
+            ok = true;
+            for (size_t bit = 0; bit < max; bit++) {
+                count = 0;
+                for (size_t i = 0; i < n; i++) {
+                    count += e[i][bit];
+                }
+                ok = ok && bitset_get(r, bit) == (count >= k);
+            }
+            test_bool("Testing a threshold\n", true, ok);
+            expected = bitset_copy(r);
+            bitset_meta_drop(expected);
+            test_meta("Testing threshold metadata\n", r, expected);
+            bitset_free(expected);
+            bitset_free(r);
+        }
+        for (size_t i = 0; i < n; i++) {
+            bitset_free(b[i]);
+            bitset_malloc_free(e[i]);
+        }
+    }
+    r = bitset_threshold(NULL, 0, 1);
+    test_ulong("Testing an empty threshold\n", 0, bitset_count(r));
+    bitset_free(r);
+}
+
+void test_suite_into() {
+    size_t max = 50000;
+    bool *expected = bitset_malloc(sizeof(bool) * max), *e = bitset_malloc(sizeof(bool) * max);
+    void (*intos[])(bitset_t *, const bitset_t *) = {
+        bitset_and_into, bitset_or_into, bitset_xor_into, bitset_andnot_into };
+    bitset_t *dst, *src, *r;
+    bool ok;
+    for (size_t t = 0; t < 4; t++) {
+        dst = test_random_bitset(expected, max, true);
+        if (t % 2) {
+            bitset_meta_build(dst);
+            bitset_index_build(dst, 4);
+        }
+        for (size_t i = 0; i < 20; i++) {
+            src = test_random_bitset(e, max, t == 0 || i % 2);
+            //Keep intersections from emptying the destination
+            if (t == 0 || t == 3) {
+                bitset_or_into(dst, src);
+                for (size_t bit = 0; bit < max; bit++) {
+                    expected[bit] = expected[bit] || e[bit];
+                }
+                bitset_free(src);
+                src = test_random_bitset(e, max, i % 2);
+            }
+            intos[t](dst, src);
+            ok = true;
+            for (size_t bit = 0; bit < max; bit++) {
+                switch (t) {
+                    case 0: expected[bit] = expected[bit] && e[bit];  break;
+                    case 1: expected[bit] = expected[bit] || e[bit];  break;
+                    case 2: expected[bit] = expected[bit] != e[bit];  break;
+                    case 3: expected[bit] = expected[bit] && !e[bit]; break;
+                }
+                ok = ok && bitset_get(dst, bit) == expected[bit];
+            }
+            test_bool("Testing an in-place operation\n", true, ok);
+            bitset_free(src);
+        }
+        if (dst->meta) {
+            r = bitset_copy(dst);
+            bitset_meta_drop(r);
+            test_meta("Testing metadata of an in-place operation\n", dst, r);
+            bitset_free(r);
+        }
+        bitset_free(dst);
+    }
+
+    //The destination can also be the source
+    dst = test_random_bitset(expected, max, true);
+    r = bitset_copy(dst);
+    bitset_or_into(dst, dst);
+    test_bool("Testing an in-place OR with itself\n", true, dst->length == r->length
+        && !memcmp(dst->buffer, r->buffer, sizeof(bitset_word) * r->length));
+    bitset_xor_into(dst, dst);
+    test_ulong("Testing an in-place XOR with itself\n", 0, bitset_count(dst));
+    bitset_free(dst);
+    bitset_free(r);
+
+    //Large scratch buffers are freed rather than kept for the next call
+    dst = bitset_new();
+    src = bitset_new();
+    for (bitset_offset word = 0; word < 200000; word++) {
+        bitset_set(dst, word * BITSET_LITERAL_LENGTH);
+    }
+    bitset_set(src, 1);
+    bitset_or_into(dst, src);
+    bitset_or_into(dst, src);
+    bitset_xor_into(src, dst);
+    test_ulong("Testing an in-place OR after a large scratch buffer\n", 200001, bitset_count(dst));
+    test_ulong("Testing an in-place XOR after a large scratch buffer\n", 200000, bitset_count(src));
+    bitset_free(dst);
+    bitset_free(src);
+
+    //The scratch buffer takes over a buffer that was imported with its exact length
+    bitset_word p1[] = { BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1),
+        BITSET_CREATE_EMPTY_FILL(1), BITSET_CREATE_LITERAL(0) | BITSET_CREATE_LITERAL(1) };
+    dst = bitset_new_buffer((const char *)p1, sizeof(p1));
+    src = bitset_new();
+    bitset_or_into(dst, src);
+    test_ulong("Testing an in-place OR with an empty bitset\n", 4, bitset_count(dst));
+    bitset_free(dst);
+    bitset_free(src);
+    dst = bitset_new();
+    src = bitset_new();
+    bitset_offset words[] = { 0, 100, 101 };
+    for (unsigned i = 0; i < 3; i++) {
+        bitset_set(i == 1 ? src : dst, words[i] * BITSET_LITERAL_LENGTH);
+        bitset_set(i == 1 ? src : dst, words[i] * BITSET_LITERAL_LENGTH + 1);
+    }
+    bitset_or_into(dst, src);
+    test_ulong("Testing an in-place OR into a reused scratch buffer\n", 6, bitset_count(dst));
+    test_ulong("Testing an in-place OR into a reused scratch buffer\n", 4, dst->length);
+    bitset_free(dst);
+    bitset_free(src);
+    bitset_malloc_free(expected);
+    bitset_malloc_free(e);
+}
+
+typedef struct test_sink_s {
+    bitset_t *words;
+    bitset_offset *offsets;
+    size_t count;
+    size_t calls;
+    size_t limit;
+} test_sink_t;
+
+static bool test_sink_words(const bitset_word *words, size_t length, void *context) {
+    test_sink_t *sink = context;
+    size_t start = sink->words->length;
+    bitset_resize(sink->words, start + length);
+    memcpy(sink->words->buffer + start, words, sizeof(bitset_word) * length);
+    return ++sink->calls != sink->limit;
+}
+
+static bool test_sink_offsets(const bitset_offset *offsets, size_t length, void *context) {
+    test_sink_t *sink = context;
+    sink->offsets = bitset_realloc(sink->offsets, sizeof(bitset_offset) * (sink->count + length));
+    memcpy(sink->offsets + sink->count, offsets, sizeof(bitset_offset) * length);
+    sink->count += length;
+    return ++sink->calls != sink->limit;
+}
+
+void test_suite_sink() {
+    enum bitset_operation_type types[][3] = {
+        { BITSET_OR, BITSET_OR, BITSET_OR },
+        { BITSET_XOR, BITSET_OR, BITSET_XOR },
+        { BITSET_AND, BITSET_OR, BITSET_ANDNOT },
+        { BITSET_OR, BITSET_AND, BITSET_AND },
+        { BITSET_ANDNOT, BITSET_XOR, BITSET_OR }
+    };
+    bitset_sink_t sinks[] = {
+        { NULL, test_sink_words },
+        { test_sink_offsets, NULL }
+    };
+    bitset_offset *bits = bitset_malloc(sizeof(bitset_offset) * 20000), start;
+    bitset_t *b[4], *expected;
+    bitset_operation_t *op;
+    bitset_iterator_t *iterator;
+    test_sink_t sink;
+    bool ok;
+    for (size_t i = 0; i < 4; i++) {
+        for (size_t j = 0; j < 20000; j++) {
+            bits[j] = ((bitset_offset)rand() * 4099 + rand()) % (i % 2 ? 1000000 : 10000000);
+        }
+        b[i] = bitset_new_bits(bits, 20000);
+        for (size_t j = 0; j < 10; j++) {
+            start = rand() % 9000000;
+            bitset_set_range(b[i], start, start + rand() % 200000);
+        }
+    }
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        for (size_t s = 0; s < 3; s++) {
+            op = bitset_operation_new(b[0]);
+            for (size_t i = 0; i < 3; i++) {
+                bitset_operation_add(op, b[i + 1], types[t][i]);
+            }
+            expected = bitset_operation_exec(op);
+            sink.words = bitset_new();
+            sink.offsets = NULL;
+            sink.count = sink.calls = 0;
+            sink.limit = s == 2 ? 3 : 0;
+            ok = bitset_operation_exec_to(op, &sinks[s ? 1 : 0], &sink);
+            if (s == 0) {
+                test_bool("Testing a sink of words\n", true, ok
+                    && sink.words->length == expected->length && !memcmp(sink.words->buffer,
+                    expected->buffer, sizeof(bitset_word) * expected->length));
+            } else if (s == 1) {
+                iterator = bitset_iterator_new(expected);
+                test_bool("Testing a sink of offsets\n", true, ok && sink.count == iterator->length
+                    && !memcmp(sink.offsets, iterator->offsets, sizeof(bitset_offset) * sink.count));
+                bitset_iterator_free(iterator);
+            } else {
+                test_bool("Testing a sink that stops early\n", true, ok ? sink.calls < 3
+                    && sink.count == bitset_count(expected) : sink.calls == 3);
+            }
+            bitset_free(sink.words);
+            bitset_malloc_free(sink.offsets);
+            bitset_free(expected);
+            bitset_operation_free(op);
+        }
+    }
+    for (size_t i = 0; i < 4; i++) {
+        bitset_free(b[i]);
+    }
+    bitset_malloc_free(bits);
+}
+
+void test_suite_window() {
+    enum bitset_operation_type types[][2] = {
+        { BITSET_OR, BITSET_OR },
+        { BITSET_AND, BITSET_OR },
+        { BITSET_XOR, BITSET_ANDNOT },
+        { BITSET_OR, BITSET_AND }
+    };
+    bitset_offset *bits = bitset_malloc(sizeof(bitset_offset) * 5000), start, end, limit;
+    bitset_t *b[3], *full, *r;
+    bitset_operation_t *op;
+    bitset_iterator_t *expected, *actual;
+    size_t first, count;
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 5000; j++) {
+            bits[j] = rand() % 1000000;
+        }
+        b[i] = bitset_new_bits(bits, 5000);
+        for (size_t j = 0; j < 10; j++) {
+            start = rand() % 1000000;
+            bitset_set_range(b[i], start, start + rand() % 20000);
+        }
+        if (i != 1) {
+            bitset_index_build(b[i], 8);
+        }
+    }
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        op = bitset_operation_new(b[0]);
+        bitset_operation_add(op, b[1], types[t][0]);
+        bitset_operation_add(op, b[2], types[t][1]);
+        full = bitset_operation_exec(op);
+        expected = bitset_iterator_new(full);
+        for (size_t w = 0; w < 20; w++) {
+            start = rand() % 1100000;
+            end = w % 5 ? start + rand() % 50000 : start;
+            r = bitset_operation_exec_range(op, start, end);
+            actual = bitset_iterator_new(r);
+            for (first = 0; first < expected->length && expected->offsets[first] < start; first++);
+            for (count = 0; first + count < expected->length
+                && expected->offsets[first + count] < end; count++);
+            test_bool("Testing a range\n", true, actual->length == count && (!count
+                || !memcmp(actual->offsets, expected->offsets + first, sizeof(bitset_offset) * count)));
+            test_ulong("Testing range metadata\n", count, r->meta->count);
+            bitset_iterator_free(actual);
+            bitset_free(r);
+
+            limit = w % 4 ? rand() % 100000 : 0;
+            r = bitset_operation_exec_limit(op, start, limit);
+            actual = bitset_iterator_new(r);
+            count = expected->length - first < limit ? expected->length - first : limit;
+            test_bool("Testing a limit\n", true, actual->length == count && (!count
+                || !memcmp(actual->offsets, expected->offsets + first, sizeof(bitset_offset) * count)));
+            bitset_iterator_free(actual);
+            bitset_free(r);
+        }
+        bitset_iterator_free(expected);
+        bitset_free(full);
+        bitset_operation_free(op);
+    }
+    for (size_t i = 0; i < 3; i++) {
+        bitset_free(b[i]);
+    }
+    bitset_malloc_free(bits);
+}
+
+static int test_compare(const bool *a, const bool *b, size_t max) {
+    size_t bit = 0;
+    while (bit < max && a[bit] == b[bit]) {
+        bit++;
+    }
+    if (bit == max) {
+        return 0;
+    }
+    const bool *rest = a[bit] ? b : a;
+    for (size_t later = bit + 1; later < max; later++) {
+        if (rest[later]) {
+            return a[bit] ? -1 : 1;
+        }
+    }
+    return a[bit] ? 1 : -1;
+}
+
+void test_suite_predicates() {
+    size_t max = 50000;
+    bool *ea = bitset_malloc(sizeof(bool) * max), *eb = bitset_malloc(sizeof(bool) * max);
+    bool *ec = bitset_malloc(sizeof(bool) * max), intersects, subset, equal;
+    bitset_t *pairs[4][2];
+    bool *expected[4][2];
+    bitset_offset bit;
+    int compare;
+    for (size_t i = 0; i < 40; i++) {
+        bitset_t *a = test_random_bitset(ea, max, i % 2);
+        bitset_t *b = test_random_bitset(eb, max, i % 4 < 2);
+        bitset_t *c = bitset_or(a, b);
+        for (size_t j = 0; j < max; j++) {
+            ec[j] = ea[j] || eb[j];
+        }
+        //The same bits encoded differently, and with one bit removed
+        bitset_t *d = bitset_new(), *e;
+        for (size_t j = max; j-- > 0;) {
+            if (ea[j]) {
+                bitset_set(d, j);
+            }
+        }
+        bitset_set(d, max + 100);
+        bitset_unset(d, max + 100);
+        e = bitset_copy(a);
+        if (bitset_count(a) && i % 3) {
+            bitset_select(a, rand() % bitset_count(a), &bit);
+            bitset_unset(e, bit);
+        }
+        if (i % 2) {
+            bitset_meta_build(c);
+            bitset_meta_build(d);
+        } else {
+            bitset_meta_drop(c);
+        }
+        pairs[0][0] = a; pairs[0][1] = b; expected[0][0] = ea; expected[0][1] = eb;
+        pairs[1][0] = a; pairs[1][1] = c; expected[1][0] = ea; expected[1][1] = ec;
+        pairs[2][0] = c; pairs[2][1] = b; expected[2][0] = ec; expected[2][1] = eb;
+        pairs[3][0] = d; pairs[3][1] = a; expected[3][0] = ea; expected[3][1] = ea;
+        for (size_t p = 0; p < 4; p++) {
+            for (size_t swap = 0; swap < 2; swap++) {
+                const bool *x = expected[p][swap], *y = expected[p][!swap];
+                intersects = false;
+                subset = equal = true;
+                for (size_t j = 0; j < max; j++) {
+                    intersects = intersects || (x[j] && y[j]);
+                    subset = subset && (!x[j] || y[j]);
+                    equal = equal && x[j] == y[j];
+                }
+                compare = test_compare(x, y, max);
+                test_bool("Testing intersects\n", intersects,
+                    bitset_intersects(pairs[p][swap], pairs[p][!swap]));
+                test_bool("Testing subset\n", subset,
+                    bitset_is_subset(pairs[p][swap], pairs[p][!swap]));
+                test_bool("Testing equal\n", equal,
+                    bitset_equal(pairs[p][swap], pairs[p][!swap]));
+                test_ulong("Testing compare\n", compare + 1,
+                    bitset_compare(pairs[p][swap], pairs[p][!swap]) + 1);
+            }
+        }
+        for (size_t j = 0; j < max; j++) {
+            ec[j] = ea[j];
+        }
+        if (bitset_count(e) != bitset_count(a)) {
+            ec[bit] = false;
+        }
+        test_bool("Testing subset\n", true, bitset_is_subset(e, a));
+        test_bool("Testing equal\n", bitset_count(e) == bitset_count(a), bitset_equal(e, a));
+        test_ulong("Testing compare\n", test_compare(ec, ea, max) + 1, bitset_compare(e, a) + 1);
+        test_ulong("Testing compare\n", test_compare(ea, ec, max) + 1, bitset_compare(a, e) + 1);
+        bitset_free(a);
+        bitset_free(b);
+        bitset_free(c);
+        bitset_free(d);
+        bitset_free(e);
+    }
+    bitset_malloc_free(ea);
+    bitset_malloc_free(eb);
+    bitset_malloc_free(ec);
+}
+
+void test_suite_cardinality() {
+    size_t max = 50000;
+    bool *ea = bitset_malloc(sizeof(bool) * max), *eb = bitset_malloc(sizeof(bool) * max);
+    enum bitset_operation_type types[] = { BITSET_AND, BITSET_OR, BITSET_XOR, BITSET_ANDNOT };
+    bitset_offset counts[4];
+    bitset_operation_t *op;
+    bitset_t *c;
+    for (size_t i = 0; i < 40; i++) {
+        bitset_t *a = test_random_bitset(ea, max, i % 2);
+        bitset_t *b = test_random_bitset(eb, max, i % 4 < 2);
+        //Overlap the operands so that intersections aren't always empty
+        if (i % 3) {
+            c = bitset_or(a, b);
+            bitset_free(b);
+            b = c;
+            for (size_t bit = 0; bit < max; bit++) {
+                eb[bit] = ea[bit] || eb[bit];
+            }
+        }
+        if (i % 2) {
+            bitset_meta_build(a);
+        } else {
+            bitset_meta_drop(b);
+        }
+        memset(counts, 0, sizeof(counts));
+        for (size_t bit = 0; bit < max; bit++) {
+            counts[0] += ea[bit] && eb[bit];
+            counts[1] += ea[bit] || eb[bit];
+            counts[2] += ea[bit] != eb[bit];
+            counts[3] += ea[bit] && !eb[bit];
+        }
+        test_ulong("Testing and count\n", counts[0], bitset_and_count(a, b));
+        test_ulong("Testing or count\n", counts[1], bitset_or_count(a, b));
+        test_ulong("Testing andnot count\n", counts[3], bitset_andnot_count(a, b));
+        test_bool("Testing jaccard\n", true,
+            bitset_jaccard(a, b) == (counts[1] ? (double) counts[0] / counts[1] : 0));
+        for (size_t t = 0; t < 4; t++) {
+            op = bitset_operation_new(a);
+            bitset_operation_add(op, b, types[t]);
+            test_ulong("Testing a pairwise operation count\n", counts[t],
+                bitset_operation_count(op));
+            bitset_operation_free(op);
+        }
+        bitset_free(a);
+        bitset_free(b);
+    }
+    c = bitset_new();
+    test_bool("Testing jaccard of empty bitsets\n", true, bitset_jaccard(c, c) == 0);
+    bitset_free(c);
+    bitset_malloc_free(ea);
+    bitset_malloc_free(eb);
+}
+
 void test_suite_stress() {
     bitset_t *b = bitset_new();
     unsigned int max = 100000000, num = 1000;
@@ -861,6 +2672,7 @@ void test_suite_vector() {
     b = bitset_new();
     bitset_set_to(b, 10, true);
     bitset_vector_push(l, b, 3);
+#ifndef BITSET_64BIT_WORDS
     test_int("Checking vector was resized properly 1\n", 8, l->size);
     test_int("Checking vector was resized properly 2\n", 8, l->length);
     tmp = b->buffer;
@@ -868,6 +2680,7 @@ void test_suite_vector() {
     test_bool("Checking bitset was added properly 1\n", true, bitset_get(b, 10));
     test_bool("Checking bitset was added properly 2\n", false, bitset_get(b, 100));
     b->buffer = tmp;
+#endif
     bitset_free(b);
 
 
@@ -876,6 +2689,7 @@ void test_suite_vector() {
     bitset_set_to(b, 1000, true);
     bitset_vector_push(l, b, 10);
     test_int("Checking vector bitset count 2\n", 2, bitset_vector_bitsets(l));
+#ifndef BITSET_64BIT_WORDS
     test_int("Checking vector was resized properly 4\n", 32, l->size);
     test_int("Checking vector was resized properly 5\n", 20, l->length);
     tmp = b->buffer;
@@ -884,6 +2698,7 @@ void test_suite_vector() {
     test_bool("Checking bitset was added properly 4\n", true, bitset_get(b, 1000));
     test_bool("Checking bitset was added properly 5\n", false, bitset_get(b, 10));
     b->buffer = tmp;
+#endif
     bitset_free(b);
 
     b = bitset_new();
@@ -987,8 +2802,10 @@ void test_suite_vector() {
 
     //Check the copy is the same
     l = bitset_vector_import(buffer, length);
+#ifndef BITSET_64BIT_WORDS
     test_int("Check size is copied\n", 32, l->size);
-    test_int("Check length is copied\n", 20, l->length);
+#endif
+    test_int("Check length is copied\n", length, l->length);
     test_int("Check tail_offset is copied\n", 10, l->tail_offset);
     bitset_vector_free(l);
     bitset_malloc_free(buffer);
@@ -17,11 +17,33 @@ void test_suite_max();
 void test_suite_vector();
 void test_suite_vector_operation();
 void test_suite_estimate();
+void test_suite_index();
+void test_suite_set_many();
+void test_suite_cursor();
+void test_suite_decode();
+void test_suite_popcount();
+void test_suite_rank();
+void test_suite_meta();
+void test_suite_view();
+void test_suite_encoding();
+void test_suite_range();
+void test_suite_new_bits();
+void test_suite_merge();
+void test_suite_plan();
+void test_suite_parallel();
+void test_suite_compiled();
+void test_suite_cache();
+void test_suite_threshold();
+void test_suite_into();
+void test_suite_sink();
+void test_suite_window();
+void test_suite_predicates();
+void test_suite_cardinality();
 
 void test_bool(char *, bool, bool);
 void test_ulong(char *, unsigned long, unsigned long);
 void test_int(char *, int, int);
-bool test_bitset(char *, bitset_t *, unsigned, uint32_t *);
+bool test_bitset(char *, bitset_t *, unsigned, bitset_word *);
 void bitset_dump(bitset_t *);
 
 #endif